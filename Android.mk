@@ -9,6 +9,8 @@ LOCAL_PRELINK_MODULE := false
 
 LOCAL_SRC_FILES := QualcommCameraHardware.cpp
 LOCAL_SRC_FILES += Overlay.cpp
+LOCAL_SRC_FILES += FaceDetector.cpp
+LOCAL_SRC_FILES += ImageProcessing.cpp
 LOCAL_SRC_FILES += cameraHAL.cpp
 
 LOCAL_CFLAGS := -DDLOPEN_LIBMMCAMERA=1 -DHW_ENCODE
@@ -29,4 +31,97 @@ LOCAL_C_INCLUDES += $(TARGET_OUT_HEADERS)/mm-still/jpeg
 LOCAL_SHARED_LIBRARIES := libutils libui libcamera_client liblog libcutils
 LOCAL_SHARED_LIBRARIES += libbinder libdl libhardware
 
+# The face detection cascade is converted from an OpenCV Haar cascade at
+# build time; boards point BOARD_CAMERA_FACE_CASCADE_XML at their own.
+FACE_CASCADE_XML := $(BOARD_CAMERA_FACE_CASCADE_XML)
+ifeq ($(FACE_CASCADE_XML),)
+    FACE_CASCADE_XML := $(TOP)/external/opencv/data/haarcascades/haarcascade_frontalface_alt.xml
+endif
+ifneq ($(wildcard $(FACE_CASCADE_XML)),)
+    LOCAL_REQUIRED_MODULES := face_cascade.bin
+endif
+
 include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := face_cascade_convert
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES := tools/face_cascade_convert.cpp
+
+include $(BUILD_HOST_EXECUTABLE)
+
+ifneq ($(wildcard $(FACE_CASCADE_XML)),)
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := face_cascade.bin
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)/camera
+
+include $(BUILD_SYSTEM)/base_rules.mk
+
+FACE_CASCADE_CONVERT := $(HOST_OUT_EXECUTABLES)/face_cascade_convert$(HOST_EXECUTABLE_SUFFIX)
+$(LOCAL_BUILT_MODULE): PRIVATE_XML := $(FACE_CASCADE_XML)
+$(LOCAL_BUILT_MODULE): $(FACE_CASCADE_XML) $(FACE_CASCADE_CONVERT)
+	@mkdir -p $(dir $@)
+	$(FACE_CASCADE_CONVERT) $(PRIVATE_XML) $@
+endif
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := face_detect_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := tests/face_detect_test.cpp FaceDetector.cpp
+LOCAL_STATIC_LIBRARIES := liblog libcutils
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := face_cascade_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := tests/face_cascade_test.cpp FaceDetector.cpp
+LOCAL_STATIC_LIBRARIES := liblog libcutils
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := denoise_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := tests/denoise_test.cpp ImageProcessing.cpp
+LOCAL_STATIC_LIBRARIES := liblog libcutils
+LOCAL_LDLIBS := -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := raw_unpack_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := tests/raw_unpack_test.cpp ImageProcessing.cpp
+LOCAL_STATIC_LIBRARIES := liblog libcutils
+LOCAL_LDLIBS := -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := sharpness_test
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := tests/sharpness_test.cpp ImageProcessing.cpp
+LOCAL_STATIC_LIBRARIES := liblog libcutils
+LOCAL_LDLIBS := -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := camera_params_bench
+LOCAL_MODULE_TAGS := tests
+LOCAL_SRC_FILES := tests/camera_params_bench.cpp
+LOCAL_C_INCLUDES := $(TOP)/frameworks/base/include
+LOCAL_SHARED_LIBRARIES := libutils libcutils libhardware
+
+include $(BUILD_EXECUTABLE)
@@ -60,6 +60,24 @@ typedef void (*data_callback_timestamp)(nsecs_t timestamp,
                                         const sp<IMemory>& dataPtr,
                                         void* user);
 
+/* Vendor notifications. They sit above CAMERA_MSG_ALL_MSGS (0xFFFF), so
+ * enabling all the framework messages does not turn them on.
+ *
+ * CAMERA_MSG_SCENE_DETECT is sent by the software scene detection when the
+ * client enables it: ext1 is the camera_bestshot_mode_type of the detected
+ * scene, CAMERA_BESTSHOT_OFF for none in particular. The scene is also
+ * reported as the "scene-detected" parameter, for clients that cannot
+ * enable vendor messages.
+ *
+ * CAMERA_MSG_PARAMS_CHANGED is sent whenever a value reported by
+ * getParameters() changes without a setParameters() call, such as
+ * af-sharpness or scene-detected, whatever messages are enabled. The
+ * camera_device wrapper drops its parameter cache on it and does not pass
+ * it on.
+ */
+#define CAMERA_MSG_SCENE_DETECT   0x10000
+#define CAMERA_MSG_PARAMS_CHANGED 0x20000
+
 /**
  * CameraHardwareInterface.h defines the interface to the
  * camera hardware abstraction layer, used for setting and getting
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "FaceDetector"
+#include <utils/Log.h>
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(USE_NEON_CONVERSION) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAL_USE_NEON 1
+#endif
+
+#include "FaceDetector.h"
+
+namespace android {
+
+/* A classifier computes the weighted rectangle sums of the window divided
+ * by the area times the luma standard deviation of the window less its
+ * one pixel border, as OpenCV evaluates its Haar cascades, and adds left
+ * when that is below threshold, right otherwise. A window is a face when
+ * every stage sum reaches the stage threshold.
+ */
+#define FACE_MAX_STAGES         64
+#define FACE_MAX_WEAK           4096
+#define FACE_STAGE_BIAS         0.0001f
+#define FACE_PYRAMID_SCALE      1.25f
+#define FACE_WINDOW_STEP        2
+#define FACE_MAX_CANDIDATES     128
+#define FACE_MIN_NEIGHBORS      2
+#define FACE_SCORE_NEIGHBORS    10      // detections for a score of 100
+
+struct face_weak {
+    int numRects;
+    int16_t rect[3][4];         // x, y, w, h within the window
+    float weight[3];
+    float threshold;
+    float left, right;
+};
+
+struct face_stage {
+    int first;                  // index of the first classifier
+    int count;
+    float threshold;
+};
+
+struct face_cascade {
+    int winW, winH;
+    int numStages;
+    face_stage stages[FACE_MAX_STAGES];
+    int numWeak;
+    face_weak *weak;
+};
+
+face_cascade *face_cascade_load(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < 20 || st.st_size > (1 << 22)) {
+        close(fd);
+        return NULL;
+    }
+    int words = st.st_size / 4;
+    uint32_t *data = (uint32_t *)malloc(words * 4);
+    bool ok = data != NULL && read(fd, data, words * 4) == words * 4;
+    close(fd);
+
+    face_cascade *c = ok ? (face_cascade *)calloc(1, sizeof(face_cascade)) : NULL;
+    if (c != NULL)
+        c->weak = (face_weak *)malloc(FACE_MAX_WEAK * sizeof(face_weak));
+    ok = c != NULL && c->weak != NULL &&
+         data[0] == FACE_CASCADE_MAGIC && data[1] == FACE_CASCADE_VERSION;
+    int pos = 5;
+    if (ok) {
+        c->winW = data[2];
+        c->winH = data[3];
+        c->numStages = data[4];
+        ok = c->winW >= 8 && c->winW <= 64 && c->winH >= 8 && c->winH <= 64 &&
+             c->numStages > 0 && c->numStages <= FACE_MAX_STAGES;
+    }
+    for (int i = 0; ok && i < c->numStages; i++) {
+        face_stage *stage = &c->stages[i];
+        ok = pos + 2 <= words;
+        if (!ok)
+            break;
+        stage->first = c->numWeak;
+        stage->count = data[pos];
+        memcpy(&stage->threshold, &data[pos + 1], 4);
+        pos += 2;
+        ok = stage->count > 0 && c->numWeak + stage->count <= FACE_MAX_WEAK &&
+             pos + stage->count * 19 <= words;
+        for (int j = 0; ok && j < stage->count; j++) {
+            face_weak *w = &c->weak[c->numWeak++];
+            w->numRects = data[pos++];
+            ok = w->numRects >= 1 && w->numRects <= 3;
+            for (int r = 0; r < 3; r++) {
+                for (int k = 0; k < 4; k++)
+                    w->rect[r][k] = (int16_t)data[pos + k];
+                memcpy(&w->weight[r], &data[pos + 4], 4);
+                pos += 5;
+                if (r < w->numRects)
+                    ok = ok && w->rect[r][0] >= 0 && w->rect[r][1] >= 0 &&
+                         w->rect[r][2] > 0 && w->rect[r][3] > 0 &&
+                         w->rect[r][0] + w->rect[r][2] <= c->winW &&
+                         w->rect[r][1] + w->rect[r][3] <= c->winH;
+            }
+            memcpy(&w->threshold, &data[pos], 4);
+            memcpy(&w->left, &data[pos + 1], 4);
+            memcpy(&w->right, &data[pos + 2], 4);
+            pos += 3;
+        }
+    }
+    free(data);
+    if (!ok) {
+        LOGE("%s: %s is not a valid face cascade", __FUNCTION__, path);
+        face_cascade_free(c);
+        return NULL;
+    }
+    LOGI("%s: %s: %dx%d window, %d stages, %d features", __FUNCTION__, path,
+         c->winW, c->winH, c->numStages, c->numWeak);
+    return c;
+}
+
+void face_cascade_free(face_cascade *cascade)
+{
+    if (cascade == NULL)
+        return;
+    free(cascade->weak);
+    free(cascade);
+}
+
+void face_downscale_base(const uint8_t *src, int width, int outW, int outH,
+                         uint8_t *dst)
+{
+    for (int y = 0; y < outH; y++) {
+        const uint8_t *r0 = src + 2 * y * width;
+        const uint8_t *r1 = r0 + width;
+        uint8_t *out = dst + y * outW;
+        int x = 0;
+#ifdef HAL_USE_NEON
+        for (; x + 8 <= outW; x += 8) {
+            uint16x8_t s0 = vaddq_u16(vpaddlq_u8(vld1q_u8(r0 + 4 * x)),
+                                      vpaddlq_u8(vld1q_u8(r1 + 4 * x)));
+            uint16x8_t s1 = vaddq_u16(vpaddlq_u8(vld1q_u8(r0 + 4 * x + 16)),
+                                      vpaddlq_u8(vld1q_u8(r1 + 4 * x + 16)));
+            uint16x8_t sum = vcombine_u16(
+                vpadd_u16(vget_low_u16(s0), vget_high_u16(s0)),
+                vpadd_u16(vget_low_u16(s1), vget_high_u16(s1)));
+            vst1_u8(out + x, vrshrn_n_u16(sum, 3));
+        }
+#endif
+        for (; x < outW; x++) {
+            int sum = 0;
+            for (int i = 0; i < 4; i++)
+                sum += r0[4 * x + i] + r1[4 * x + i];
+            out[x] = (sum + 4) >> 3;
+        }
+    }
+}
+
+// Bilinear downscale for the upper pyramid levels, in 16.16 fixed point.
+static void face_downscale(const uint8_t *src, int sw, int sh,
+                           uint8_t *dst, int dw, int dh)
+{
+    int fx = (sw << 16) / dw, fy = (sh << 16) / dh;
+    for (int y = 0; y < dh; y++) {
+        int sy = y * fy;
+        int y0 = sy >> 16, wy = (sy >> 8) & 0xff;
+        int y1 = y0 + 1 < sh ? y0 + 1 : y0;
+        const uint8_t *a = src + y0 * sw, *b = src + y1 * sw;
+        for (int x = 0; x < dw; x++) {
+            int sx = x * fx;
+            int x0 = sx >> 16, wx = (sx >> 8) & 0xff;
+            int x1 = x0 + 1 < sw ? x0 + 1 : x0;
+            int top = a[x0] * (256 - wx) + a[x1] * wx;
+            int bottom = b[x0] * (256 - wx) + b[x1] * wx;
+            dst[y * dw + x] = (top * (256 - wy) + bottom * wy + (1 << 15)) >> 16;
+        }
+    }
+}
+
+// Integral and squared integral images, (w + 1) x (h + 1) with a zero row
+// and column in front.
+static void face_integral(const uint8_t *src, int w, int h,
+                          uint32_t *sum, uint64_t *sqsum)
+{
+    int stride = w + 1;
+    memset(sum, 0, stride * sizeof(uint32_t));
+    memset(sqsum, 0, stride * sizeof(uint64_t));
+    for (int y = 0; y < h; y++) {
+        uint32_t rowSum = 0;
+        uint64_t rowSq = 0;
+        uint32_t *s = sum + (y + 1) * stride;
+        uint64_t *q = sqsum + (y + 1) * stride;
+        s[0] = 0;
+        q[0] = 0;
+        for (int x = 0; x < w; x++) {
+            uint32_t p = src[y * w + x];
+            rowSum += p;
+            rowSq += p * p;
+            s[x + 1] = s[x + 1 - stride] + rowSum;
+            q[x + 1] = q[x + 1 - stride] + rowSq;
+        }
+    }
+}
+
+static inline uint32_t face_rect_sum(const uint32_t *sum, int stride,
+                                     int x, int y, int w, int h)
+{
+    const uint32_t *p = sum + y * stride + x;
+    return p[h * stride + w] - p[h * stride] - p[w] + p[0];
+}
+
+// Runs the cascade on the window at (x, y) of one pyramid level and
+// returns the number of stages passed.
+static int face_window(const face_cascade *c, const uint32_t *sum,
+                       const uint64_t *sqsum, int stride, int x, int y)
+{
+    int w = c->winW - 2, h = c->winH - 2;
+    int area = w * h;
+    uint32_t s = face_rect_sum(sum, stride, x + 1, y + 1, w, h);
+    const uint64_t *q = sqsum + (y + 1) * stride + x + 1;
+    uint64_t sq = q[h * stride + w] - q[h * stride] - q[w] + q[0];
+    double mean = (double)s / area;
+    double var = (double)sq / area - mean * mean;
+    float norm = 1.0f / (area * (var > 0 ? (float)sqrt(var) : 1.0f));
+
+    for (int i = 0; i < c->numStages; i++) {
+        const face_stage *stage = &c->stages[i];
+        float stageSum = 0;
+        for (int j = 0; j < stage->count; j++) {
+            const face_weak *w = &c->weak[stage->first + j];
+            float f = 0;
+            for (int r = 0; r < w->numRects; r++)
+                f += w->weight[r] * face_rect_sum(sum, stride,
+                        x + w->rect[r][0], y + w->rect[r][1],
+                        w->rect[r][2], w->rect[r][3]);
+            stageSum += f * norm < w->threshold ? w->left : w->right;
+        }
+        if (stageSum < stage->threshold - FACE_STAGE_BIAS)
+            return i;
+    }
+    return c->numStages;
+}
+
+/* Merges overlapping candidates and keeps the best supported ones. rects
+ * holds x, y, w, h per candidate and receives up to max faces, most
+ * neighbours first, with their scores in scores unless it is NULL.
+ * Returns the number of faces.
+ */
+static int face_group(int *rects, int count, int *scores, int max)
+{
+    int cluster[FACE_MAX_CANDIDATES][5];    // x, y, w, h sums and members
+    int numClusters = 0;
+
+    for (int i = 0; i < count; i++) {
+        int *r = rects + 4 * i;
+        int k = 0;
+        for (; k < numClusters; k++) {
+            int n = cluster[k][4];
+            int cw = cluster[k][2] / n;
+            int d = (cw + r[2]) / 10;       // 20% of the mean width
+            if (abs(cluster[k][0] / n - r[0]) <= d &&
+                abs(cluster[k][1] / n - r[1]) <= d &&
+                abs(cw - r[2]) <= d)
+                break;
+        }
+        if (k == numClusters) {
+            memset(cluster[k], 0, sizeof(cluster[k]));
+            numClusters++;
+        }
+        for (int j = 0; j < 4; j++)
+            cluster[k][j] += r[j];
+        cluster[k][4]++;
+    }
+
+    int faces = 0;
+    while (faces < max) {
+        int best = -1;
+        for (int k = 0; k < numClusters; k++)
+            if (cluster[k][4] >= FACE_MIN_NEIGHBORS &&
+                    (best < 0 || cluster[k][4] > cluster[best][4]))
+                best = k;
+        if (best < 0)
+            break;
+        for (int j = 0; j < 4; j++)
+            rects[4 * faces + j] = cluster[best][j] / cluster[best][4];
+        if (scores != NULL)
+            scores[faces] = cluster[best][4] >= FACE_SCORE_NEIGHBORS ? 100 :
+                            cluster[best][4] * 100 / FACE_SCORE_NEIGHBORS;
+        cluster[best][4] = 0;
+        faces++;
+    }
+    return faces;
+}
+
+int face_scratch_size(int w, int h)
+{
+    return w * h * 2 + (w + 1) * (h + 1) * (sizeof(uint32_t) + sizeof(uint64_t));
+}
+
+int face_detect(const face_cascade *c, const uint8_t *base, int w, int h,
+                uint8_t *scratch, int *faces, int *scores, int max)
+{
+    int candidates[FACE_MAX_CANDIDATES * 4];
+    int count = 0;
+    uint8_t *level = scratch, *next = scratch + w * h;
+    uint32_t *sum = (uint32_t *)(scratch + w * h * 2);
+    uint64_t *sqsum = (uint64_t *)(sum + (w + 1) * (h + 1));
+    const uint8_t *img = base;
+    int lw = w, lh = h;
+    float scale = 1.0f;
+
+    while (lw >= c->winW && lh >= c->winH && count < FACE_MAX_CANDIDATES) {
+        face_integral(img, lw, lh, sum, sqsum);
+        for (int y = 0; y + c->winH <= lh; y += FACE_WINDOW_STEP) {
+            for (int x = 0; x + c->winW <= lw; x += FACE_WINDOW_STEP) {
+                if (face_window(c, sum, sqsum, lw + 1, x, y) < c->numStages)
+                    continue;
+                int *r = candidates + 4 * count;
+                r[0] = (int)(x * scale);
+                r[1] = (int)(y * scale);
+                r[2] = (int)(c->winW * scale);
+                r[3] = (int)(c->winH * scale);
+                if (++count == FACE_MAX_CANDIDATES)
+                    break;
+            }
+            if (count == FACE_MAX_CANDIDATES)
+                break;
+        }
+        int nw = (int)(lw / FACE_PYRAMID_SCALE), nh = (int)(lh / FACE_PYRAMID_SCALE);
+        if (nw < c->winW || nh < c->winH)
+            break;
+        face_downscale(img, lw, lh, next, nw, nh);
+        img = next;
+        next = level;
+        level = (uint8_t *)img;
+        lw = nw;
+        lh = nh;
+        scale *= FACE_PYRAMID_SCALE;
+    }
+
+    int n = face_group(candidates, count, scores, max);
+    memcpy(faces, candidates, n * 4 * sizeof(int));
+    return n;
+}
+
+int face_window_stages(const face_cascade *c, const uint8_t *window,
+                       int stride)
+{
+    int w = c->winW, h = c->winH;
+    uint8_t *img = (uint8_t *)malloc(w * h);
+    uint32_t *sum = (uint32_t *)malloc((w + 1) * (h + 1) * sizeof(uint32_t));
+    uint64_t *sqsum = (uint64_t *)malloc((w + 1) * (h + 1) * sizeof(uint64_t));
+    int stages = -1;
+    if (img != NULL && sum != NULL && sqsum != NULL) {
+        for (int y = 0; y < h; y++)
+            memcpy(img + y * w, window + y * stride, w);
+        face_integral(img, w, h, sum, sqsum);
+        stages = face_window(c, sum, sqsum, w + 1, 0, 0);
+    }
+    free(sqsum);
+    free(sum);
+    free(img);
+    return stages;
+}
+
+}; // namespace android
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_FACE_DETECTOR_H
+#define ANDROID_HARDWARE_FACE_DETECTOR_H
+
+#include <stdint.h>
+
+/* Software face detection: a Viola-Jones cascade of Haar-like features,
+ * evaluated on integral images over a pyramid. The cascade is not built
+ * in; it is read from a file in this layout of little-endian 32 bit words,
+ * as written by tools/face_cascade_convert:
+ *
+ *   magic FACE_CASCADE_MAGIC, version FACE_CASCADE_VERSION,
+ *   window width, window height, stage count, then per stage:
+ *     weak classifier count, stage threshold (float), then per classifier:
+ *       rect count (1-3), 3 x { x, y, w, h, weight (float) },
+ *       threshold (float), left value (float), right value (float)
+ */
+#define FACE_CASCADE_MAGIC      0x53414346    /* "FCAS" */
+#define FACE_CASCADE_VERSION    1
+
+namespace android {
+
+struct face_cascade;
+
+face_cascade *face_cascade_load(const char *path);
+void face_cascade_free(face_cascade *cascade);
+
+/* Averages 4x2 blocks of rows 4k+1 and 4k+2 of a luma plane, packed as
+ * 2 * outH rows of width bytes, into the outW x outH pyramid base.
+ */
+void face_downscale_base(const uint8_t *src, int width, int outW, int outH,
+                         uint8_t *dst);
+
+/* Detects faces in a w x h pyramid base and returns up to max of them as
+ * x, y, w, h in base pixels. scores, unless NULL, receives a confidence of
+ * 1-100 per face from the number of detections merged into it. scratch
+ * must hold face_scratch_size(w, h).
+ */
+int face_scratch_size(int w, int h);
+int face_detect(const face_cascade *c, const uint8_t *base, int w, int h,
+                uint8_t *scratch, int *faces, int *scores, int max);
+
+/* Runs the cascade on the one window at the top left of a luma plane with
+ * the given stride and returns the number of stages it passed, the stage
+ * count of the cascade for a face.
+ */
+int face_window_stages(const face_cascade *c, const uint8_t *window,
+                       int stride);
+
+/* The CAMERA_MSG_PREVIEW_METADATA payload of the software detector: the
+ * layout of the driver face detection (the value count, then
+ * FACE_METADATA_FACES rectangles as x, y, dx, dy in preview pixels with
+ * -1 for the unused ones), followed by a score and a tracking id per face.
+ * The camera_device wrapper turns it into a camera_frame_metadata_t.
+ */
+#define FACE_METADATA_FACES     2
+
+struct face_metadata {
+    int32_t values;                             // 4 per face
+    int32_t rect[FACE_METADATA_FACES][4];
+    int32_t score[FACE_METADATA_FACES];         // 1-100
+    int32_t id[FACE_METADATA_FACES];            // kept while the face stays
+};
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_FACE_DETECTOR_H
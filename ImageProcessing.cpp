@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ImageProcessing"
+#include <utils/Log.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(USE_NEON_CONVERSION) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAL_USE_NEON 1
+#endif
+
+#include "ImageProcessing.h"
+
+namespace android {
+
+#define DENOISE_LEVELS 3        // luma pyramid: 1/1, 1/2, 1/4
+#define DENOISE_TILE 64         // motion tile size at full resolution
+#define DENOISE_SEARCH 4        // search radius at the coarsest level
+#define DENOISE_THRESHOLD 12    // luma difference that is fully trusted
+
+/* Stripes other than the last go to short-lived joinable threads; the
+ * calling thread takes the last one and runs any stripe whose thread could
+ * not be created.
+ */
+struct stripe_job {
+    stripe_fn fn;
+    void *ctx;
+    int rowStart;
+    int rowEnd;
+};
+
+static void *stripe_worker(void *data)
+{
+    stripe_job *job = (stripe_job *)data;
+    job->fn(job->ctx, job->rowStart, job->rowEnd);
+    return NULL;
+}
+
+void run_stripes(stripe_fn fn, void *ctx, int rows, int numThreads)
+{
+    stripe_job jobs[HAL_WORKER_THREADS];
+    pthread_t threads[HAL_WORKER_THREADS];
+    bool started[HAL_WORKER_THREADS];
+
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > HAL_WORKER_THREADS) numThreads = HAL_WORKER_THREADS;
+
+    for (int i = 0; i < numThreads; i++) {
+        jobs[i].fn = fn;
+        jobs[i].ctx = ctx;
+        jobs[i].rowStart = rows * i / numThreads;
+        jobs[i].rowEnd = rows * (i + 1) / numThreads;
+        started[i] = false;
+    }
+    for (int i = 0; i < numThreads - 1; i++)
+        started[i] = !pthread_create(&threads[i], NULL,
+                                     stripe_worker, &jobs[i]);
+    stripe_worker(&jobs[numThreads - 1]);
+    for (int i = 0; i < numThreads - 1; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            stripe_worker(&jobs[i]);
+    }
+}
+
+/* MIPI CSI-2 RAW10: every 4 pixels are packed into 5 bytes. Bytes 0-3
+ * carry bits 9..2 of pixels 0-3, byte 4 carries bits 1..0 of each pixel,
+ * pixel 0 in the least significant position. The black level is
+ * subtracted with saturation at zero.
+ */
+static void unpack_mipi10_row(const uint8_t *src, uint16_t *dst,
+                              int width, int rowBytes, uint16_t black)
+{
+    int x = 0;
+#ifdef HAL_USE_NEON
+    static const uint8_t hiIdx[8] = { 0, 1, 2, 3, 5, 6, 7, 8 };
+    static const uint8_t loIdx[8] = { 4, 4, 4, 4, 9, 9, 9, 9 };
+    static const int16_t loShift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+    const uint8x8_t vHiIdx = vld1_u8(hiIdx);
+    const uint8x8_t vLoIdx = vld1_u8(loIdx);
+    const int16x8_t vShift = vld1q_s16(loShift);
+    const uint16x8_t vMask = vdupq_n_u16(3);
+    const uint16x8_t vBlack = vdupq_n_u16(black);
+    // 8 pixels come from 10 bytes, but we load 16; stay clear of the row end.
+    for (; x + 8 <= width && x * 5 / 4 + 16 <= width * 5 / 4; x += 8) {
+        const uint8_t *p = src + x * 5 / 4;
+        uint8x8x2_t tbl;
+        tbl.val[0] = vld1_u8(p);
+        tbl.val[1] = vld1_u8(p + 8);
+        uint16x8_t hi = vshll_n_u8(vtbl2_u8(tbl, vHiIdx), 2);
+        uint16x8_t lo = vmovl_u8(vtbl2_u8(tbl, vLoIdx));
+        lo = vandq_u16(vshlq_u16(lo, vShift), vMask);
+        vst1q_u16(dst + x, vqsubq_u16(vorrq_u16(hi, lo), vBlack));
+    }
+#endif
+    for (; x + 4 <= width; x += 4) {
+        const uint8_t *p = src + x * 5 / 4;
+        uint8_t low = p[4];
+        for (int i = 0; i < 4; i++) {
+            uint16_t v = (p[i] << 2) | ((low >> (2 * i)) & 3);
+            dst[x + i] = v > black ? v - black : 0;
+        }
+    }
+    // A partial last group; its low bits byte may fall past the row end,
+    // in which case those bits read as 0.
+    if (x < width) {
+        const uint8_t *p = src + x * 5 / 4;
+        uint8_t low = rowBytes - x * 5 / 4 > 4 ? p[4] : 0;
+        for (int i = 0; x + i < width; i++) {
+            uint16_t v = (p[i] << 2) | ((low >> (2 * i)) & 3);
+            dst[x + i] = v > black ? v - black : 0;
+        }
+    }
+}
+
+struct raw_unpack_job {
+    const uint8_t *src;
+    uint16_t *dst;
+    int stride;
+    int width;
+    uint16_t black;
+};
+
+static void raw_unpack_rows(void *ctx, int rowStart, int rowEnd)
+{
+    raw_unpack_job *job = (raw_unpack_job *)ctx;
+    for (int y = rowStart; y < rowEnd; y++)
+        unpack_mipi10_row(job->src + y * job->stride,
+                          job->dst + y * job->width,
+                          job->width, job->stride, job->black);
+}
+
+void unpack_mipi10(const uint8_t *src, uint16_t *dst, int stride,
+                   int width, int height, uint16_t black,
+                   int numThreads)
+{
+    raw_unpack_job job;
+    job.src = src;
+    job.dst = dst;
+    job.stride = stride;
+    job.width = width;
+    job.black = black;
+    run_stripes(raw_unpack_rows, &job, height, numThreads);
+}
+
+/* Tenengrad sum over a width x height window: the squared magnitude of
+ * the 3x3 Sobel gradient, summed. src points to the top left pixel of the
+ * window, which must have one valid pixel of border on every side.
+ */
+uint64_t tenengrad_sum(const uint8_t *src, int stride, int width, int height)
+{
+    uint64_t sum = 0;
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t *a = src + (y - 1) * stride;
+        const uint8_t *b = src + y * stride;
+        const uint8_t *c = src + (y + 1) * stride;
+        int x = 0;
+#ifdef HAL_USE_NEON
+        // |g| <= 1020, so each lane gains at most 2 * 1020^2 per step and
+        // the 32 bit accumulators are flushed once per row.
+        uint32x4_t accLo = vdupq_n_u32(0), accHi = vdupq_n_u32(0);
+        for (; x + 8 <= width; x += 8) {
+            uint8x8_t a0 = vld1_u8(a + x - 1), a1 = vld1_u8(a + x), a2 = vld1_u8(a + x + 1);
+            uint8x8_t b0 = vld1_u8(b + x - 1), b2 = vld1_u8(b + x + 1);
+            uint8x8_t c0 = vld1_u8(c + x - 1), c1 = vld1_u8(c + x), c2 = vld1_u8(c + x + 1);
+            uint16x8_t right = vaddq_u16(vaddl_u8(a2, c2), vshll_n_u8(b2, 1));
+            uint16x8_t left = vaddq_u16(vaddl_u8(a0, c0), vshll_n_u8(b0, 1));
+            uint16x8_t below = vaddq_u16(vaddl_u8(c0, c2), vshll_n_u8(c1, 1));
+            uint16x8_t above = vaddq_u16(vaddl_u8(a0, a2), vshll_n_u8(a1, 1));
+            uint16x8_t gx = vreinterpretq_u16_s16(
+                vabsq_s16(vreinterpretq_s16_u16(vsubq_u16(right, left))));
+            uint16x8_t gy = vreinterpretq_u16_s16(
+                vabsq_s16(vreinterpretq_s16_u16(vsubq_u16(below, above))));
+            accLo = vmlal_u16(accLo, vget_low_u16(gx), vget_low_u16(gx));
+            accLo = vmlal_u16(accLo, vget_low_u16(gy), vget_low_u16(gy));
+            accHi = vmlal_u16(accHi, vget_high_u16(gx), vget_high_u16(gx));
+            accHi = vmlal_u16(accHi, vget_high_u16(gy), vget_high_u16(gy));
+        }
+        uint64x2_t acc = vaddq_u64(vpaddlq_u32(accLo), vpaddlq_u32(accHi));
+        sum += vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+#endif
+        for (; x < width; x++) {
+            int gx = (a[x + 1] + 2 * b[x + 1] + c[x + 1]) -
+                     (a[x - 1] + 2 * b[x - 1] + c[x - 1]);
+            int gy = (c[x - 1] + 2 * c[x] + c[x + 1]) -
+                     (a[x - 1] + 2 * a[x] + a[x + 1]);
+            sum += gx * gx + gy * gy;
+        }
+    }
+    return sum;
+}
+
+/* Multi-frame temporal denoise. Every extra frame is aligned to the
+ * reference (the frame in job->dst) with a per-tile translation found by
+ * block matching on a luma pyramid: a full search at 1/4 scale, refined by
+ * one pixel at 1/2 and full scale. Aligned samples are then averaged into
+ * the reference. Each sample's weight falls off with its difference from
+ * the reference, so misaligned or moving content is rejected instead of
+ * ghosting.
+ */
+struct luma_pyramid {
+    const uint8_t *level[DENOISE_LEVELS];
+    uint8_t *owned[DENOISE_LEVELS];
+    int width[DENOISE_LEVELS];
+    int height[DENOISE_LEVELS];
+};
+
+struct denoise_job {
+    fusion_job *frames;
+    luma_pyramid pyr[FUSION_MAX_FRAMES];
+    int height;
+    int tilesX;
+    int tilesY;
+    int16_t *mv;             // [frame][tileY][tileX][2], full resolution
+    uint16_t weight[256];    // robust weight by absolute difference, Q8
+};
+
+static void pyramid_downscale(const uint8_t *src, int sw,
+                              uint8_t *dst, int dw, int dh)
+{
+    for (int y = 0; y < dh; y++) {
+        const uint8_t *s0 = src + 2 * y * sw;
+        const uint8_t *s1 = s0 + sw;
+        uint8_t *d = dst + y * dw;
+        int x = 0;
+#ifdef HAL_USE_NEON
+        for (; x + 8 <= dw; x += 8) {
+            uint8x8x2_t a = vld2_u8(s0 + 2 * x);
+            uint8x8x2_t b = vld2_u8(s1 + 2 * x);
+            uint16x8_t sum = vaddl_u8(a.val[0], a.val[1]);
+            sum = vaddw_u8(sum, b.val[0]);
+            sum = vaddw_u8(sum, b.val[1]);
+            vst1_u8(d + x, vrshrn_n_u16(sum, 2));
+        }
+#endif
+        for (; x < dw; x++)
+            d[x] = (s0[2 * x] + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1] + 2) >> 2;
+    }
+}
+
+static int pyramid_build(luma_pyramid *pyr, const uint8_t *luma,
+                         int width, int height)
+{
+    int bytes = 0;
+    pyr->level[0] = luma;
+    pyr->owned[0] = NULL;
+    pyr->width[0] = width;
+    pyr->height[0] = height;
+    for (int l = 1; l < DENOISE_LEVELS; l++) {
+        pyr->width[l] = pyr->width[l - 1] / 2;
+        pyr->height[l] = pyr->height[l - 1] / 2;
+        pyr->owned[l] = (uint8_t *)malloc(pyr->width[l] * pyr->height[l]);
+        if (pyr->owned[l] == NULL)
+            return -1;
+        bytes += pyr->width[l] * pyr->height[l];
+        pyramid_downscale(pyr->level[l - 1], pyr->width[l - 1],
+                          pyr->owned[l], pyr->width[l], pyr->height[l]);
+        pyr->level[l] = pyr->owned[l];
+    }
+    return bytes;
+}
+
+static void pyramid_free(luma_pyramid *pyr)
+{
+    for (int l = 1; l < DENOISE_LEVELS; l++) {
+        free(pyr->owned[l]);
+        pyr->owned[l] = NULL;
+    }
+}
+
+static uint32_t block_sad(const uint8_t *a, const uint8_t *b, int stride,
+                          int w, int h)
+{
+    uint32_t sad = 0;
+    for (int y = 0; y < h; y++, a += stride, b += stride) {
+        int x = 0;
+#ifdef HAL_USE_NEON
+        uint16x8_t acc = vdupq_n_u16(0);
+        for (; x + 8 <= w; x += 8)
+            acc = vabal_u8(acc, vld1_u8(a + x), vld1_u8(b + x));
+        uint32x4_t acc32 = vpaddlq_u16(acc);
+        uint64x2_t acc64 = vpaddlq_u32(acc32);
+        sad += (uint32_t)(vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1));
+#endif
+        for (; x < w; x++)
+            sad += abs((int)a[x] - (int)b[x]);
+    }
+    return sad;
+}
+
+/* Best translation of one tile at pyramid level l, around (cx, cy). Near
+ * the frame edges only the part of the tile that stays inside both frames
+ * is compared, so border tiles can still move outwards.
+ */
+static void tile_search(const luma_pyramid *ref, const luma_pyramid *alt,
+                        int l, int tx, int ty, int radius, int *cx, int *cy)
+{
+    int tile = DENOISE_TILE >> l;
+    int w = ref->width[l], h = ref->height[l];
+    int x0 = tx * tile, y0 = ty * tile;
+    int x1 = (x0 + tile > w) ? w : x0 + tile;
+    int y1 = (y0 + tile > h) ? h : y0 + tile;
+    if (x1 <= x0 || y1 <= y0)
+        return;
+    int minArea = (x1 - x0) * (y1 - y0) / 2;
+
+    uint32_t best = 0xffffffff;
+    int bestX = *cx, bestY = *cy;
+    for (int dy = *cy - radius; dy <= *cy + radius; dy++) {
+        int sy0 = y0 + dy < 0 ? -dy : y0;
+        int sy1 = y1 + dy > h ? h - dy : y1;
+        for (int dx = *cx - radius; dx <= *cx + radius; dx++) {
+            int sx0 = x0 + dx < 0 ? -dx : x0;
+            int sx1 = x1 + dx > w ? w - dx : x1;
+            int area = (sx1 - sx0) * (sy1 - sy0);
+            if (sx1 <= sx0 || sy1 <= sy0 || area < minArea)
+                continue;
+            uint32_t sad = block_sad(ref->level[l] + sy0 * w + sx0,
+                                     alt->level[l] + (sy0 + dy) * w + sx0 + dx,
+                                     w, sx1 - sx0, sy1 - sy0);
+            sad = (uint32_t)(((uint64_t)sad << 8) / area);
+            // Prefer the smaller motion on ties, so flat areas stay put.
+            if (sad < best || (sad == best &&
+                    abs(dx) + abs(dy) < abs(bestX) + abs(bestY))) {
+                best = sad;
+                bestX = dx;
+                bestY = dy;
+            }
+        }
+    }
+    *cx = bestX;
+    *cy = bestY;
+}
+
+static void denoise_search_rows(void *ctx, int rowStart, int rowEnd)
+{
+    denoise_job *job = (denoise_job *)ctx;
+    const int numAlt = job->frames->numFrames - 1;
+    const luma_pyramid *ref = &job->pyr[numAlt];
+
+    for (int i = 0; i < numAlt; i++) {
+        for (int ty = rowStart; ty < rowEnd; ty++) {
+            for (int tx = 0; tx < job->tilesX; tx++) {
+                int mx = 0, my = 0;
+                tile_search(ref, &job->pyr[i], DENOISE_LEVELS - 1, tx, ty,
+                            DENOISE_SEARCH, &mx, &my);
+                for (int l = DENOISE_LEVELS - 2; l >= 0; l--) {
+                    mx *= 2;
+                    my *= 2;
+                    tile_search(ref, &job->pyr[i], l, tx, ty, 1, &mx, &my);
+                }
+                int16_t *mv = job->mv + ((i * job->tilesY + ty) * job->tilesX + tx) * 2;
+                mv[0] = mx;
+                mv[1] = my;
+            }
+        }
+    }
+}
+
+static inline int clamp_int(int v, int lo, int hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static void denoise_chroma_rows(void *ctx, int rowStart, int rowEnd)
+{
+    denoise_job *job = (denoise_job *)ctx;
+    fusion_job *f = job->frames;
+    const int numAlt = f->numFrames - 1;
+    const int width = f->width;
+    const uint8_t *ref = f->src[numAlt];
+
+    for (int y = rowStart; y < rowEnd; y++) {
+        int ty = (2 * y) / DENOISE_TILE;
+        for (int x = 0; x + 1 < width; x += 2) {
+            int tx = x / DENOISE_TILE;
+            int refY = ref[f->yOffset + 2 * y * width + x];
+            int cidx = f->cbcrOffset + y * width + x;
+            uint32_t sumW = 256;
+            uint32_t sumV = 256 * ref[cidx], sumU = 256 * ref[cidx + 1];
+            for (int i = 0; i < numAlt; i++) {
+                const int16_t *mv = job->mv + ((i * job->tilesY + ty) * job->tilesX + tx) * 2;
+                int ax = clamp_int(x + mv[0], 0, width - 2) & ~1;
+                int ay = clamp_int(2 * y + mv[1], 0, job->height - 2) & ~1;
+                int altY = f->src[i][f->yOffset + ay * width + ax];
+                uint32_t w = job->weight[abs(altY - refY)];
+                int aidx = f->cbcrOffset + (ay / 2) * width + ax;
+                sumW += w;
+                sumV += w * f->src[i][aidx];
+                sumU += w * f->src[i][aidx + 1];
+            }
+            f->dst[cidx] = (sumV + sumW / 2) / sumW;
+            f->dst[cidx + 1] = (sumU + sumW / 2) / sumW;
+        }
+    }
+}
+
+static void denoise_luma_rows(void *ctx, int rowStart, int rowEnd)
+{
+    denoise_job *job = (denoise_job *)ctx;
+    fusion_job *f = job->frames;
+    const int numAlt = f->numFrames - 1;
+    const int width = f->width;
+    const uint8_t *ref = f->src[numAlt];
+
+    for (int y = rowStart; y < rowEnd; y++) {
+        int ty = y / DENOISE_TILE;
+        const uint8_t *r = ref + f->yOffset + y * width;
+        uint8_t *out = f->dst + f->yOffset + y * width;
+        for (int x = 0; x < width; x++) {
+            int tx = x / DENOISE_TILE;
+            int refY = r[x];
+            uint32_t sumW = 256, sum = 256 * refY;
+            for (int i = 0; i < numAlt; i++) {
+                const int16_t *mv = job->mv + ((i * job->tilesY + ty) * job->tilesX + tx) * 2;
+                int ax = clamp_int(x + mv[0], 0, width - 1);
+                int ay = clamp_int(y + mv[1], 0, job->height - 1);
+                int altY = f->src[i][f->yOffset + ay * width + ax];
+                uint32_t w = job->weight[abs(altY - refY)];
+                sumW += w;
+                sum += w * altY;
+            }
+            out[x] = (sum + sumW / 2) / sumW;
+        }
+    }
+}
+
+int denoise_frames(fusion_job *frames, int height, int numThreads)
+{
+    denoise_job *job = new denoise_job;
+    const int numAlt = frames->numFrames - 1;
+    int scratch = sizeof(denoise_job);
+
+    memset(job, 0, sizeof(*job));
+    job->frames = frames;
+    job->height = height;
+    job->tilesX = (frames->width + DENOISE_TILE - 1) / DENOISE_TILE;
+    job->tilesY = (height + DENOISE_TILE - 1) / DENOISE_TILE;
+    for (int d = 0; d < 256; d++) {
+        if (d <= DENOISE_THRESHOLD)
+            job->weight[d] = 256;
+        else if (d >= 3 * DENOISE_THRESHOLD)
+            job->weight[d] = 0;
+        else
+            job->weight[d] = 256 * (3 * DENOISE_THRESHOLD - d) / (2 * DENOISE_THRESHOLD);
+    }
+
+    int mvBytes = numAlt * job->tilesX * job->tilesY * 2 * sizeof(int16_t);
+    job->mv = (int16_t *)malloc(mvBytes);
+    bool ok = job->mv != NULL;
+    scratch += mvBytes;
+    for (int i = 0; ok && i <= numAlt; i++) {
+        int bytes = pyramid_build(&job->pyr[i], frames->src[i] + frames->yOffset,
+                                  frames->width, height);
+        ok = bytes >= 0;
+        scratch += bytes;
+    }
+
+    if (ok) {
+        run_stripes(denoise_search_rows, job, job->tilesY, numThreads);
+        run_stripes(denoise_chroma_rows, job, height / 2, numThreads);
+        run_stripes(denoise_luma_rows, job, height, numThreads);
+    } else {
+        LOGE("denoise_frames: out of memory, keeping the reference frame");
+    }
+
+    for (int i = 0; i <= numAlt; i++)
+        pyramid_free(&job->pyr[i]);
+    free(job->mv);
+    delete job;
+    return scratch;
+}
+
+}; // namespace android
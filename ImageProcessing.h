@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_IMAGE_PROCESSING_H
+#define ANDROID_HARDWARE_IMAGE_PROCESSING_H
+
+#include <stdint.h>
+
+/* Software image kernels of the HAL that depend on nothing but the
+ * pixels, so they build for the host tests as well.
+ */
+
+// Number of threads the software image kernels split their work across
+#define HAL_WORKER_THREADS 2
+
+#define FUSION_MAX_FRAMES 5
+
+namespace android {
+
+/* Runs fn over [0, rows) split in numThreads stripes, at most
+ * HAL_WORKER_THREADS of them.
+ */
+typedef void (*stripe_fn)(void *ctx, int rowStart, int rowEnd);
+
+void run_stripes(stripe_fn fn, void *ctx, int rows, int numThreads);
+
+/* Unpacks a MIPI CSI-2 RAW10 frame with rows stride bytes apart into
+ * width x height 16-bit samples, less the black level.
+ */
+void unpack_mipi10(const uint8_t *src, uint16_t *dst, int stride,
+                   int width, int height, uint16_t black, int numThreads);
+
+// Tenengrad sharpness of a window that has a one pixel border around it.
+uint64_t tenengrad_sum(const uint8_t *src, int stride, int width, int height);
+
+// Frames merged by fuse_exposures() and denoise_frames(), YUV420
+// semi-planar with the planes at yOffset and cbcrOffset.
+struct fusion_job {
+    uint8_t *dst;
+    const uint8_t *src[FUSION_MAX_FRAMES];
+    int numFrames;
+    int width;
+    int yOffset;
+    int cbcrOffset;
+};
+
+/* Denoises frames->src[0..n-2] into the reference frames->src[n-1], which
+ * must be frames->dst. Returns the scratch memory used, in bytes.
+ */
+int denoise_frames(fusion_job *frames, int height, int numThreads);
+
+}; // namespace android
+
+#endif // ANDROID_HARDWARE_IMAGE_PROCESSING_H
@@ -28,12 +28,14 @@ namespace android {
 Overlay::Overlay(overlay_set_fd_hook set_fd,
         overlay_set_crop_hook set_crop,
         overlay_queue_buffer_hook queue_buffer,
-        void *data)
+        void *data,
+        overlay_resize_input_hook resize_input)
     : mStatus(NO_INIT)
 {
     set_fd_hook = set_fd;
     set_crop_hook = set_crop;
     queue_buffer_hook = queue_buffer;
+    resize_input_hook = resize_input;
     hook_data = data;
     mStatus = NO_ERROR;
 }
@@ -55,6 +57,8 @@ status_t Overlay::queueBuffer(void* buffer)
 
 status_t Overlay::resizeInput(uint32_t width, uint32_t height)
 {
+    if (resize_input_hook)
+        resize_input_hook(hook_data, width, height);
     return mStatus;
 }
 
@@ -33,6 +33,8 @@ typedef void (*overlay_set_crop_hook)(void *data,
         uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 typedef void (*overlay_queue_buffer_hook)(void *data,
         void* buffer);
+typedef void (*overlay_resize_input_hook)(void *data,
+        uint32_t width, uint32_t height);
 
 namespace android {
 
@@ -47,7 +49,8 @@ public:
     Overlay(overlay_set_fd_hook set_fd,
             overlay_set_crop_hook set_crop,
             overlay_queue_buffer_hook queue_buffer,
-            void* data);
+            void* data,
+            overlay_resize_input_hook resize_input = NULL);
 
     /* destroys this overlay */
     void destroy();
@@ -95,6 +98,7 @@ private:
     overlay_set_fd_hook set_fd_hook;
     overlay_set_crop_hook set_crop_hook;
     overlay_queue_buffer_hook queue_buffer_hook;
+    overlay_resize_input_hook resize_input_hook;
     void* hook_data;
 
     status_t mStatus;
@@ -22,6 +22,7 @@
 
 #include "QualcommCameraHardware.h"
 
+#include <utils/Debug.h>
 #include <utils/Errors.h>
 #include <utils/threads.h>
 #include <binder/MemoryHeapPmem.h>
@@ -47,6 +48,11 @@
 #define UNLIKELY(exp) __builtin_expect(!!(exp), 0)
 #define CAMERA_HAL_UNUSED(expr) do { (void)(expr); } while (0)
 
+#if defined(USE_NEON_CONVERSION) && defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAL_USE_NEON 1
+#endif
+
 extern "C" {
 #include <fcntl.h>
 #include <time.h>
@@ -63,6 +69,8 @@ extern "C" {
 #include <sys/mman.h>
 #include <sys/system_properties.h>
 #include <sys/time.h>
+#include <sys/utsname.h>
+#include <limits.h>
 #include <stdlib.h>
 
 #if 0
@@ -310,17 +318,6 @@ static  android::FPSRange FpsRangesSupported[1] = {android::FPSRange(MINIMUM_FPS
 #define FPS_RANGES_SUPPORTED_COUNT (sizeof(FpsRangesSupported)/sizeof(FpsRangesSupported[0]))
 
 #define JPEG_THUMBNAIL_SIZE_COUNT (sizeof(jpeg_thumbnail_sizes)/sizeof(camera_size_type))
-static int attr_lookup(const str_map arr[], int len, const char *name)
-{
-    if (name) {
-        for (int i = 0; i < len; i++) {
-            if (!strcmp(arr[i].desc, name))
-                return arr[i].val;
-        }
-    }
-    return NOT_FOUND;
-}
-
 // round to the next power of two
 static inline unsigned clp2(unsigned x)
 {
@@ -357,6 +354,26 @@ namespace android {
 static const int PICTURE_FORMAT_JPEG = 1;
 static const int PICTURE_FORMAT_RAW = 2;
 
+// Layout of PICTURE_FORMAT_RAW data handed to the application
+static const int RAW_FORMAT_MIPI10 = 0;      // packed sensor output, as is
+static const int RAW_FORMAT_UNPACKED16 = 1;  // one uint16_t per pixel
+#define MAX_RAW_BLACK_LEVEL 1023
+#define RAW_WHITE_LEVEL 1023
+
+// Container wrapped around PICTURE_FORMAT_RAW data
+static const int RAW_CONTAINER_NONE = 0;
+static const int RAW_CONTAINER_DNG = 1;
+#define DNG_HEADER_MAX_SIZE 4096
+
+// How the frames captured by captureBracket() are merged
+static const int BRACKET_MERGE_FUSION = 0;
+static const int BRACKET_MERGE_DENOISE = 1;
+
+static const int MULTI_FRAME_DENOISE_OFF = 0;
+static const int MULTI_FRAME_DENOISE_ON = 1;
+static const int MULTI_FRAME_DENOISE_NIGHT = 2;  // only in night scene modes
+#define DEFAULT_DENOISE_FRAMES 4
+
 // from aeecamera.h
 static const str_map whitebalance[] = {
     { CameraParameters::WHITE_BALANCE_AUTO,            CAMERA_WB_AUTO },
@@ -683,6 +700,12 @@ static const str_map iso[] = {
 };
 
 
+#define AF_TIMEOUT_MS 3000        // upper bound on one autofocus pass
+#define AF_POLL_FALLBACK_MS 50    // re-check focus state if frames stop
+#define AF_CMD_START 0x1
+#define AF_CMD_ROI   0x2
+#define AF_CMD_EXIT  0x4
+
 #define DONT_CARE 0
 static const str_map focus_modes[] = {
     { CameraParameters::FOCUS_MODE_AUTO,     AF_MODE_AUTO},
@@ -738,6 +761,7 @@ struct SensorType {
     int max_supported_snapshot_width;
     int max_supported_snapshot_height;
     int bitMask;
+    camera_format_type bayerOrder;  // colour of the top-left raw pixels
 };
 
 
@@ -747,6 +771,7 @@ struct SensorType {
 #define CAMERA_HISTOGRAM_ENABLE 1
 #define CAMERA_HISTOGRAM_DISABLE 0
 #define HISTOGRAM_STATS_SIZE 257
+#define HISTOGRAM_SAMPLE_BUDGET (64 * 1024)    // luma samples per software histogram
 
 #define EXPOSURE_COMPENSATION_MAXIMUM_NUMERATOR 12
 #define EXPOSURE_COMPENSATION_MINIMUM_NUMERATOR -12
@@ -755,14 +780,14 @@ struct SensorType {
 #define EXPOSURE_COMPENSATION_STEP ((float (1))/EXPOSURE_COMPENSATION_DENOMINATOR)
 
 static SensorType sensorTypes[] = {
-        { "12mp", 5464, 3120, true, 4000, 3000,0x00001fff },
-        { "12mp_sn12m0pz",4032, 3024, true,  4000, 3000,0x00000fff },
-        { "5mp", 2608, 1960, true,  2592, 1944,0x00000fff },
-        { "5mp_triumph", 5184, 1944, false,  2592, 1944,0x00000fff },
-        { "3mp", 2064, 1544, false, 2048, 1536,0x000007ff },
-        { "2mp", 3200, 1200, false, 1600, 1200,0x000007ff },
-        { "mt9m113", 1280, 1024, false, 1280, 1024, 0x000000ff }, //TouchPad Camera Sensor
-        { "ov7692", 640, 480, false, 640, 480, 0x000000ff } }; //Web Camera
+        { "12mp", 5464, 3120, true, 4000, 3000,0x00001fff, CAMERA_BAYER_RGGB },
+        { "12mp_sn12m0pz",4032, 3024, true,  4000, 3000,0x00000fff, CAMERA_BAYER_RGGB },
+        { "5mp", 2608, 1960, true,  2592, 1944,0x00000fff, CAMERA_BAYER_RGGB },
+        { "5mp_triumph", 5184, 1944, false,  2592, 1944,0x00000fff, CAMERA_BAYER_RGGB },
+        { "3mp", 2064, 1544, false, 2048, 1536,0x000007ff, CAMERA_BAYER_RGGB },
+        { "2mp", 3200, 1200, false, 1600, 1200,0x000007ff, CAMERA_BAYER_RGGB },
+        { "mt9m113", 1280, 1024, false, 1280, 1024, 0x000000ff, CAMERA_BAYER_RGGB }, //TouchPad Camera Sensor
+        { "ov7692", 640, 480, false, 640, 480, 0x000000ff, CAMERA_BAYER_RGGB } }; //Web Camera
 
 
 static SensorType * sensorType;
@@ -772,6 +797,35 @@ static const str_map picture_formats[] = {
         {CameraParameters::PIXEL_FORMAT_RAW, PICTURE_FORMAT_RAW}
 };
 
+static const str_map raw_formats[] = {
+        {"mipi10", RAW_FORMAT_MIPI10},
+        {"unpacked16", RAW_FORMAT_UNPACKED16}
+};
+
+// persist.camera.hal.bayer, for sensors whose table entry is wrong
+static const str_map bayer_orders[] = {
+        {"rggb", CAMERA_BAYER_RGGB},
+        {"bggr", CAMERA_BAYER_BGGR},
+        {"grbg", CAMERA_BAYER_GRBG},
+        {"gbrg", CAMERA_BAYER_GBRG}
+};
+
+static const str_map raw_containers[] = {
+        {"none", RAW_CONTAINER_NONE},
+        {"dng", RAW_CONTAINER_DNG}
+};
+
+static const str_map bracketing_modes[] = {
+        {"off", CAMERA_BRACKETING_OFF},
+        {"exposure", CAMERA_BRACKETING_EXPOSURE}
+};
+
+static const str_map multi_frame_denoise_modes[] = {
+        {"off", MULTI_FRAME_DENOISE_OFF},
+        {"on", MULTI_FRAME_DENOISE_ON},
+        {"night", MULTI_FRAME_DENOISE_NIGHT}
+};
+
 static const str_map frame_rate_modes[] = {
         {CameraParameters::KEY_PREVIEW_FRAME_RATE_AUTO_MODE, FPS_MODE_AUTO},
         {CameraParameters::KEY_PREVIEW_FRAME_RATE_FIXED_MODE, FPS_MODE_FIXED}
@@ -783,6 +837,134 @@ static const str_map preview_formats[] = {
         {CameraParameters::PIXEL_FORMAT_YUV420SP_ADRENO, CAMERA_YUV_420_NV21_ADRENO}
 };
 
+/* Hash indices over the larger str_map tables. The table strings are
+ * defined in libcamera_client, so the indices cannot be generated at
+ * compile time; they are built once, on the first lookup. Smaller tables
+ * stay with the linear scan, which is cheaper for two or three entries. */
+#define STR_MAP_INDEX_MIN 4
+#define STR_MAP_INDEX_SLOTS 64      // power of two, at least twice the largest table
+#define STR_MAP_TABLE_SLOTS 32      // power of two, at least twice the indexed tables
+
+struct str_map_table {
+    const str_map *arr;
+    int len;
+};
+
+#define STR_MAP_TABLE(t) { t, sizeof(t) / sizeof(str_map) }
+static const str_map_table indexed_str_maps[] = {
+    STR_MAP_TABLE(whitebalance),
+    STR_MAP_TABLE(effects),
+    STR_MAP_TABLE(antibanding),
+    STR_MAP_TABLE(scenemode),
+    STR_MAP_TABLE(flash),
+    STR_MAP_TABLE(iso),
+    STR_MAP_TABLE(focus_modes),
+    STR_MAP_TABLE(selectable_zone_af),
+};
+#undef STR_MAP_TABLE
+
+struct str_map_index {
+    const str_map *arr;
+    uint32_t hash[STR_MAP_INDEX_SLOTS];
+    int8_t entry[STR_MAP_INDEX_SLOTS];  // -1 for an empty slot
+};
+
+static str_map_index str_map_indices[sizeof(indexed_str_maps) / sizeof(str_map_table)];
+static str_map_index *str_map_slots[STR_MAP_TABLE_SLOTS];
+static pthread_once_t str_map_once = PTHREAD_ONCE_INIT;
+
+// FNV-1a
+static inline uint32_t str_map_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 16777619u;
+    return h;
+}
+
+static inline unsigned str_map_table_slot(const str_map *arr)
+{
+    return ((uintptr_t)arr >> 3) & (STR_MAP_TABLE_SLOTS - 1);
+}
+
+static void str_map_build_indices()
+{
+    for (unsigned t = 0; t < sizeof(indexed_str_maps) / sizeof(str_map_table); t++) {
+        const str_map_table *table = &indexed_str_maps[t];
+        str_map_index *index = &str_map_indices[t];
+
+        if (table->len < STR_MAP_INDEX_MIN || table->len * 2 > STR_MAP_INDEX_SLOTS)
+            continue;
+        index->arr = table->arr;
+        memset(index->entry, -1, sizeof(index->entry));
+        for (int i = 0; i < table->len; i++) {
+            uint32_t h = str_map_hash(table->arr[i].desc);
+            unsigned slot = h & (STR_MAP_INDEX_SLOTS - 1);
+            bool dup = false;
+            while (index->entry[slot] >= 0) {
+                // the linear scan returns the first match; keep it that way
+                if (index->hash[slot] == h &&
+                    !strcmp(table->arr[index->entry[slot]].desc, table->arr[i].desc)) {
+                    dup = true;
+                    break;
+                }
+                slot = (slot + 1) & (STR_MAP_INDEX_SLOTS - 1);
+            }
+            if (dup)
+                continue;
+            index->hash[slot] = h;
+            index->entry[slot] = i;
+        }
+        unsigned slot = str_map_table_slot(table->arr);
+        while (str_map_slots[slot])
+            slot = (slot + 1) & (STR_MAP_TABLE_SLOTS - 1);
+        str_map_slots[slot] = index;
+    }
+}
+
+static const str_map_index *str_map_find_index(const str_map *arr)
+{
+    pthread_once(&str_map_once, str_map_build_indices);
+    unsigned slot = str_map_table_slot(arr);
+    while (str_map_slots[slot]) {
+        if (str_map_slots[slot]->arr == arr)
+            return str_map_slots[slot];
+        slot = (slot + 1) & (STR_MAP_TABLE_SLOTS - 1);
+    }
+    return NULL;
+}
+
+static int attr_lookup_linear(const str_map arr[], int len, const char *name)
+{
+    for (int i = 0; i < len; i++) {
+        if (!strcmp(arr[i].desc, name))
+            return arr[i].val;
+    }
+    return NOT_FOUND;
+}
+
+static int attr_lookup(const str_map arr[], int len, const char *name)
+{
+    if (!name)
+        return NOT_FOUND;
+    if (len < STR_MAP_INDEX_MIN)
+        return attr_lookup_linear(arr, len, name);
+
+    const str_map_index *index = str_map_find_index(arr);
+    if (!index)
+        return attr_lookup_linear(arr, len, name);
+
+    uint32_t h = str_map_hash(name);
+    unsigned slot = h & (STR_MAP_INDEX_SLOTS - 1);
+    while (index->entry[slot] >= 0) {
+        const str_map *entry = &arr[index->entry[slot]];
+        if (index->hash[slot] == h && !strcmp(entry->desc, name))
+            return entry->val;
+        slot = (slot + 1) & (STR_MAP_INDEX_SLOTS - 1);
+    }
+    return NOT_FOUND;
+}
+
 static bool parameter_string_initialized = false;
 static String8 preview_size_values;
 static String8 picture_size_values;
@@ -800,6 +982,10 @@ static String8 histogram_values;
 static String8 skinToneEnhancement_values;
 static String8 touchafaec_values;
 static String8 picture_format_values;
+static String8 raw_format_values;
+static String8 raw_container_values;
+static String8 bracketing_values;
+static String8 multi_frame_denoise_values;
 static String8 scenemode_values;
 static String8 continuous_af_values;
 static String8 zoom_ratio_values;
@@ -1046,13 +1232,245 @@ static bool zoomSupported = false;
 static bool native_get_maxzoom(int camfd, void *pZm);
 static bool native_get_zoomratios(int camfd, void *pZr, int maxZoomLevel);
 
+static void fuse_exposures(fusion_job *job, int height, int numThreads);
+static void mem_account_set_budget(int kbytes);
+static void mem_account_dump(int fd);
+static int mem_account_live(void);
+void *liveshot_thread(void *user);
+void *auto_focus_thread(void *user);
+void *sharpness_thread(void *user);
+void *histogram_thread(void *user);
+void *face_thread(void *user);
+
 static int dstOffset = 0;
 
-static int camerafd = -1;
-pthread_t w_thread;
+/* Capability cache. The camera info ioctl and the sensor dependent
+ * parameter strings only change with the sensor or the build, so they are
+ * kept in files under CAPS_CACHE_DIR keyed by build fingerprint, target,
+ * camera id and sensor name, and mapped back on the next open. Bump
+ * CAPS_CACHE_VERSION when the layout or caps_cache_strings changes.
+ */
+#define CAPS_CACHE_DIR      "/data/misc/camera"
+#define CAPS_CACHE_MAGIC    0x50414351    /* "QCAP" */
+#define CAPS_CACHE_VERSION  4
+#define CAPS_CACHE_ALIGN(x) (((x) + 3) & ~3)
+
+enum {
+    CAPS_CACHE_CAMERA_INFO,
+    CAPS_CACHE_PARAMETERS
+};
+
+struct caps_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    uint32_t size;      // payload bytes following the header
+    int32_t target;
+    int32_t cameraId;
+    char sensor[MAX_SENSOR_NAME];
+    char fingerprint[PROPERTY_VALUE_MAX];
+};
+
+static String8 *const caps_cache_strings[] = {
+    &preview_size_values,
+    &picture_size_values,
+    &antibanding_values,
+    &effect_values,
+    &autoexposure_values,
+    &whitebalance_values,
+    &flash_values,
+    &focus_mode_values,
+    &iso_values,
+    &lensshade_values,
+    &touchafaec_values,
+    &continuous_af_values,
+    &zoom_ratio_values,
+    &scenemode_values,
+    &scenedetect_values,
+    &selectable_zone_af_values
+};
+#define CAPS_CACHE_STRING_COUNT \
+    (sizeof(caps_cache_strings) / sizeof(caps_cache_strings[0]))
+
+static bool caps_cache_enabled(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.hal.capcache", value, "1");
+    return atoi(value) != 0;
+}
+
+static void caps_cache_key(caps_cache_header *key, int kind, int target,
+                           int cameraId, const char *sensor)
+{
+    memset(key, 0, sizeof(*key));
+    key->magic = CAPS_CACHE_MAGIC;
+    key->version = CAPS_CACHE_VERSION;
+    key->kind = kind;
+    key->target = target;
+    key->cameraId = cameraId;
+    if (sensor)
+        strlcpy(key->sensor, sensor, sizeof(key->sensor));
+    property_get("ro.build.fingerprint", key->fingerprint, "");
+}
+
+static void caps_cache_path(char *path, size_t len, const caps_cache_header *key)
+{
+    snprintf(path, len, "%s/hal_caps_%d_%d.bin", CAPS_CACHE_DIR,
+             key->kind, key->cameraId);
+}
+
+// Maps the cache file for key. Returns NULL when it is missing or was written
+// for another sensor, target or build; release with caps_cache_unmap().
+static const caps_cache_header *caps_cache_map(const caps_cache_header *key)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    caps_cache_path(path, sizeof(path), key);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*key))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const caps_cache_header *hdr = (const caps_cache_header *)map;
+    caps_cache_header expected = *key;
+    expected.size = hdr->size;
+    if (sizeof(*hdr) + hdr->size != (size_t)st.st_size ||
+        memcmp(hdr, &expected, sizeof(expected))) {
+        LOGI("%s: %s is stale, ignoring", __FUNCTION__, path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    return hdr;
+}
+
+static void caps_cache_unmap(const caps_cache_header *hdr)
+{
+    munmap((void *)hdr, sizeof(*hdr) + hdr->size);
+}
+
+// Writes the payload under key through a temporary file so that a reader
+// never maps a partial cache.
+static void caps_cache_store(caps_cache_header *key, const void *payload, size_t size)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+
+    if (!caps_cache_enabled())
+        return;
+    caps_cache_path(path, sizeof(path), key);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    key->size = size;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGV("%s: cannot create %s: %s", __FUNCTION__, tmp, strerror(errno));
+        return;
+    }
+    bool ok = write(fd, key, sizeof(*key)) == (ssize_t)sizeof(*key) &&
+              write(fd, payload, size) == (ssize_t)size;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) {
+        LOGW("%s: cannot write %s: %s", __FUNCTION__, path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* The camera info is queried before any sensor is open, so its key holds
+ * the kernel the sensors were probed by, and the payload records the
+ * sensor found behind each camera id once it has been opened; see
+ * caps_cache_check_sensor(). */
+struct caps_cache_camera_info {
+    int32_t num;
+    camera_info_t info[MSM_MAX_CAMERA_SENSORS];
+    char sensors[MSM_MAX_CAMERA_SENSORS][MAX_SENSOR_NAME];
+};
+
+static void caps_cache_camera_info_key(caps_cache_header *key)
+{
+    struct utsname uts;
+
+    caps_cache_key(key, CAPS_CACHE_CAMERA_INFO, -1, 0, NULL);
+    if (uname(&uts) == 0)
+        snprintf(key->sensor, sizeof(key->sensor), "%s", uts.version);
+}
+
+static bool caps_cache_map_camera_info(caps_cache_camera_info *ci)
+{
+    caps_cache_header key;
+
+    if (!caps_cache_enabled())
+        return false;
+    caps_cache_camera_info_key(&key);
+    const caps_cache_header *hdr = caps_cache_map(&key);
+    if (hdr == NULL)
+        return false;
+    bool ok = hdr->size == sizeof(*ci);
+    if (ok) {
+        memcpy(ci, hdr + 1, sizeof(*ci));
+        ok = ci->num > 0 && ci->num <= MSM_MAX_CAMERA_SENSORS;
+    }
+    caps_cache_unmap(hdr);
+    return ok;
+}
+
+static void caps_cache_store_camera_info(const caps_cache_camera_info *ci)
+{
+    caps_cache_header key;
+
+    caps_cache_camera_info_key(&key);
+    caps_cache_store(&key, ci, sizeof(*ci));
+}
+
+static bool caps_cache_load_camera_info(void)
+{
+    caps_cache_camera_info ci;
+
+    if (!caps_cache_map_camera_info(&ci))
+        return false;
+    memcpy(HAL_cameraInfo, ci.info, sizeof(HAL_cameraInfo));
+    HAL_numOfCameras = ci.num;
+    return true;
+}
+
+// Drops the camera info cache when another sensor now answers for cameraId.
+static void caps_cache_check_sensor(int cameraId, const char *sensor)
+{
+    caps_cache_camera_info ci;
+    caps_cache_header key;
+    char path[PATH_MAX];
+
+    if (!sensor[0] || cameraId < 0 || cameraId >= MSM_MAX_CAMERA_SENSORS ||
+        !caps_cache_map_camera_info(&ci))
+        return;
+    char *recorded = ci.sensors[cameraId];
+    if (!recorded[0]) {
+        strlcpy(recorded, sensor, MAX_SENSOR_NAME);
+        caps_cache_store_camera_info(&ci);
+    } else if (strncmp(recorded, sensor, MAX_SENSOR_NAME)) {
+        LOGI("%s: camera %d was %s, now %s; dropping the camera info cache",
+             __FUNCTION__, cameraId, recorded, sensor);
+        caps_cache_camera_info_key(&key);
+        caps_cache_path(path, sizeof(path), &key);
+        unlink(path);
+    }
+}
+
+static const char *open_task_names[] = {
+    "sensor", "symbols", "fb", "caps"
+};
 
-void *opencamerafd(void *data) {
-    camerafd = open(MSM_CAMERA_CONTROL, O_RDWR);
+void *open_task_thread(void *user)
+{
+    QualcommCameraHardware::open_task *task =
+        (QualcommCameraHardware::open_task *)user;
+    nsecs_t start = systemTime();
+    task->ok = task->obj->runOpenTask(task->id);
+    task->elapsed = systemTime() - start;
     return NULL;
 }
 
@@ -1077,13 +1495,30 @@ QualcommCameraHardware::QualcommCameraHardware()
     : mParameters(),
       mCameraRunning(false),
       mPreviewInitialized(false),
+      mPmemPoolCacheHits(0),
       mFrameThreadRunning(false),
       mVideoThreadRunning(false),
+      mLiveShotPending(false),
+      mLiveShotThreadRunning(false),
+      mLiveShotEncoding(false),
+      mLiveShotFrameReleased(false),
+      mLiveShotFrame(NULL),
+      mLiveShotWidth(0),
+      mLiveShotHeight(0),
       mSnapshotThreadRunning(false),
       mJpegThreadRunning(false),
       mInSnapshotMode(false),
       mEncodePending(false),
       mSnapshotFormat(0),
+      mRawFormat(RAW_FORMAT_MIPI10),
+      mRawBlackLevel(0),
+      mRawContainer(RAW_CONTAINER_NONE),
+      mBracketMode(CAMERA_BRACKETING_OFF),
+      mBracketCount(0),
+      mBracketCaptured(0),
+      mBracketMerge(BRACKET_MERGE_FUSION),
+      mDenoiseMode(MULTI_FRAME_DENOISE_OFF),
+      mDenoiseFrames(DEFAULT_DENOISE_FRAMES),
       mFirstFrame(true),
       mReleasedRecordingFrame(false),
       mPreviewFrameSize(0),
@@ -1117,26 +1552,130 @@ QualcommCameraHardware::QualcommCameraHardware()
       mPrevHeapDeallocRunning(false)
 {
     LOGI("QualcommCameraHardware constructor E");
-    mMMCameraDLRef = MMCameraDL::getInstance();
-    libmmcamera = mMMCameraDLRef->pointer();
-    LOGV("%s, libmmcamera: %p\n", __FUNCTION__, libmmcamera);
+    mOpenTime = systemTime();
+    mConfigInitTime = 0;
+    libmmcamera = NULL;
     char value[PROPERTY_VALUE_MAX];
 
     storeTargetType();
 
-    // Start opening camera device in a separate thread/ Since this
-    // initializes the sensor hardware, this can take a long time. So,
-    // start the process here so it will be ready by the time it's
-    // needed.
-    if ((pthread_create(&w_thread, NULL, opencamerafd, NULL)) != 0) {
-        LOGE("Camera open thread creation failed");
-    }
+    // Start the open sequence as independent tasks. Opening the control
+    // device initializes the sensor hardware and dominates, so the
+    // library binding, framebuffer open and the constant parameter
+    // strings are overlapped with it rather than run after it.
+    memset(mOpenTasks, 0, sizeof(mOpenTasks));
+    startOpenTask(OPEN_TASK_SENSOR);
+    startOpenTask(OPEN_TASK_SYMBOLS);
+    if ((mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM8660))
+        startOpenTask(OPEN_TASK_FB);
+    if (!parameter_string_initialized)
+        startOpenTask(OPEN_TASK_CAPS);
 
     memset(&mDimension, 0, sizeof(mDimension));
     memset(&mCrop, 0, sizeof(mCrop));
     memset(&zoomCropInfo, 0, sizeof(zoom_crop_info));
     property_get("persist.debug.sf.showfps", value, "0");
     mDebugFps = atoi(value);
+    property_get("persist.camera.hal.cachedpreview", value, "0");
+    mCachedPreview = atoi(value);
+    property_get("persist.camera.hal.cachebench", value, "0");
+    mCacheBenchFrames = atoi(value) ? 30 : 0;
+    mCacheBenchBytes = 0;
+    mCacheBenchTime = 0;
+    memset(mParamHandlerIoctls, 0, sizeof(mParamHandlerIoctls));
+    mSetParmCount = 0;
+    mParamIoctlsIssued = 0;
+    mParamIoctlsSkipped = 0;
+    mParamIoctlsFailed = 0;
+    mSetParamsCalls = 0;
+    mSetParamsTime = 0;
+    mApplyAllParams = false;
+    mSnapshotVersion = 0;
+    mAfPending = 0;
+    memset(&mAfRoi, 0, sizeof(mAfRoi));
+    mAfBusy = false;
+    mAfWaiting = false;
+    mAfCancelled = false;
+    mAfCoalesced = 0;
+    mSharpThreadRunning = false;
+    mSharpExit = false;
+    mSharpEnabled = false;
+    mSharpBuf = NULL;
+    mSharpBufSize = 0;
+    mSharpQueued = false;
+    memset(mSharpRoi, 0, sizeof(mSharpRoi));
+    memset(mSharpHistory, 0, sizeof(mSharpHistory));
+    mSharpCount = 0;
+    mSharpDropped = 0;
+    mSharpTimeTotal = 0;
+    mStatsFromDriver = false;
+    mHistThreadRunning = false;
+    mHistExit = false;
+    mHistBuf = NULL;
+    mHistBufSize = 0;
+    mHistQueued = false;
+    mHistWidth = mHistRows = mHistStep = 0;
+    mHistFrames = 0;
+    mHistDropped = 0;
+    mHistTimeTotal = 0;
+    mFaceDetectOn = false;
+    mSendMetaData = false;
+    mMetaDataIndex = 0;
+    mFaceCascade = NULL;
+    mFdThreadRunning = false;
+    mFdExit = false;
+    mFdBuf = NULL;
+    mFdBufSize = 0;
+    mFdQueued = false;
+    mFdWidth = mFdHeight = 0;
+    mFdQueuedTime = 0;
+    mFdNextTime = 0;
+    mFdBudget = 25;
+    mFdFrames = 0;
+    mFdSkipped = 0;
+    mFdUnsent = 0;
+    mFdFaces = 0;
+    mFdStartTime = 0;
+    mFdTimeTotal = 0;
+    mFdTimeMax = 0;
+    mFdLatencyTotal = 0;
+    mFdLastFaces = 0;
+    memset(mFdPrevRects, 0, sizeof(mFdPrevRects));
+    memset(mFdPrevIds, 0, sizeof(mFdPrevIds));
+    mFdNextId = 1;
+    mSceneDetectOn = false;
+    mSceneRowStep = 4;
+    mSceneBudgetUs = 300;
+    mSceneCurrent = mSceneCandidate = CAMERA_BESTSHOT_OFF;
+    mSceneCandidateFrames = 0;
+    mSceneFrames = 0;
+    mSceneChanges = 0;
+    mSceneTimeTotal = 0;
+    mSceneTimeMax = 0;
+    mAfRequestTime = 0;
+    memset(mAfLatencyHist, 0, sizeof(mAfLatencyHist));
+    mAfStateChecks = 0;
+    mLastPreviewFrameTime = 0;
+    mReconfigGapStart = 0;
+    mReconfigCount = 0;
+    mReconfigGapLast = mReconfigGapMax = 0;
+    mParmSeq = mParmDone = 0;
+    mParmFailed = 0;
+    memset(mParmHandlerFailed, 0, sizeof(mParmHandlerFailed));
+    mParmBatchOpen = false;
+    mParmIssuing = false;
+    mParmSyncHeld = false;
+    mParmHandler = -1;
+    mParmDeadline = 0;
+    mParmThreadRunning = false;
+    mParmThreadExit = false;
+    mParmMaxDepth = 0;
+    mParmTimeouts = 0;
+    mParmCompleted = 0;
+    mParmLatencyTotal = 0;
+    mParmLatencyMax = 0;
+    property_get("persist.camera.hal.membudget", value, "0");
+    mem_account_set_budget(atoi(value));
     if( mCurrentTarget == TARGET_MSM7630 || mCurrentTarget == TARGET_MSM8660 ) {
         kPreviewBufferCountActual = kPreviewBufferCount;
         kRecordBufferCount = RECORD_BUFFERS;
@@ -1244,16 +1783,9 @@ void QualcommCameraHardware::filterPictureSizes(){
 }
 
 bool QualcommCameraHardware::supportsSceneDetection() {
-   unsigned int prop = 0;
-   return false;
-   for(prop=0; prop<sizeof(boardProperties)/sizeof(board_property); prop++) {
-       if((mCurrentTarget == boardProperties[prop].target)
-          && boardProperties[prop].hasSceneDetect == true) {
-           return true;
-           break;
-       }
-   }
-   return false;
+   // The driver detection is not used; the software classifier works on
+   // every target.
+   return true;
 }
 
 bool QualcommCameraHardware::supportsSelectableZoneAf() {
@@ -1270,21 +1802,133 @@ bool QualcommCameraHardware::supportsSelectableZoneAf() {
 }
 
 bool QualcommCameraHardware::supportsFaceDetection() {
-   unsigned int prop = 0;
-   return false;
-   for(prop=0; prop<sizeof(boardProperties)/sizeof(board_property); prop++) {
-       if((mCurrentTarget == boardProperties[prop].target)
-          && boardProperties[prop].hasFaceDetect == true) {
-           return true;
-           break;
-       }
-   }
-   return false;
+   // The driver face detection path is not used; the software detector
+   // provides it when a cascade is installed.
+   return mFaceCascade != NULL;
+}
+
+// Parameter strings that depend only on the target, built by the open task
+// graph while the sensor is still being opened.
+void QualcommCameraHardware::initStaticCapabilityStrings()
+{
+    fps_ranges_supported_values = create_fps_str(
+        FpsRangesSupported,FPS_RANGES_SUPPORTED_COUNT );
+    //Currently Enabling Histogram for 8x60
+    if(mCurrentTarget == TARGET_MSM8660) {
+        histogram_values = create_values_str(
+            histogram,sizeof(histogram)/sizeof(str_map));
+    }
+    //Currently Enabling Skin Tone Enhancement for 8x60 and 7630
+    if((mCurrentTarget == TARGET_MSM8660)||(mCurrentTarget == TARGET_MSM7630)) {
+        skinToneEnhancement_values = create_values_str(
+            skinToneEnhancement,sizeof(skinToneEnhancement)/sizeof(str_map));
+    }
+    picture_format_values = create_values_str(
+        picture_formats, sizeof(picture_formats)/sizeof(str_map));
+    raw_format_values = create_values_str(
+        raw_formats, sizeof(raw_formats)/sizeof(str_map));
+    raw_container_values = create_values_str(
+        raw_containers, sizeof(raw_containers)/sizeof(str_map));
+    bracketing_values = create_values_str(
+        bracketing_modes, sizeof(bracketing_modes)/sizeof(str_map));
+    multi_frame_denoise_values = create_values_str(
+        multi_frame_denoise_modes, sizeof(multi_frame_denoise_modes)/sizeof(str_map));
+    preview_frame_rate_values = create_values_range_str(
+        MINIMUM_FPS, MAXIMUM_FPS);
+}
+
+// Restores the sensor dependent parameter strings and the zoom table from
+// the capability cache. Nothing is applied unless the whole file is valid.
+bool QualcommCameraHardware::loadCapabilityCache()
+{
+    caps_cache_header key;
+    String8 values[CAPS_CACHE_STRING_COUNT];
+    int32_t zoom[2];
+
+    if (!caps_cache_enabled() || !mSensorInfo.name[0])
+        return false;
+    caps_cache_key(&key, CAPS_CACHE_PARAMETERS, mCurrentTarget,
+                   HAL_currentCameraId, mSensorInfo.name);
+    const caps_cache_header *hdr = caps_cache_map(&key);
+    if (hdr == NULL)
+        return false;
+
+    const uint8_t *p = (const uint8_t *)(hdr + 1);
+    const uint8_t *end = p + hdr->size;
+    bool ok = hdr->size >= sizeof(zoom);
+    if (ok) {
+        memcpy(zoom, p, sizeof(zoom));
+        p += sizeof(zoom);
+    }
+    for (unsigned int i = 0; ok && i < CAPS_CACHE_STRING_COUNT; i++) {
+        uint32_t len;
+        if (end - p < (int)sizeof(len)) {
+            ok = false;
+            break;
+        }
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if (len > (uint32_t)(end - p)) {
+            ok = false;
+            break;
+        }
+        values[i].setTo((const char *)p, len);
+        p += CAPS_CACHE_ALIGN(len);
+    }
+    caps_cache_unmap(hdr);
+    if (!ok) {
+        LOGE("%s: capability cache for %s is corrupt", __FUNCTION__,
+             mSensorInfo.name);
+        return false;
+    }
+
+    for (unsigned int i = 0; i < CAPS_CACHE_STRING_COUNT; i++)
+        *caps_cache_strings[i] = values[i];
+    mMaxZoom = zoom[0];
+    zoomSupported = zoom[1];
+    LOGI("%s: using cached capabilities for %s", __FUNCTION__, mSensorInfo.name);
+    return true;
+}
+
+void QualcommCameraHardware::storeCapabilityCache()
+{
+    caps_cache_header key;
+    int32_t zoom[2] = { mMaxZoom, zoomSupported };
+    size_t size = sizeof(zoom);
+
+    if (!mSensorInfo.name[0])
+        return;
+    for (unsigned int i = 0; i < CAPS_CACHE_STRING_COUNT; i++)
+        size += sizeof(uint32_t) + CAPS_CACHE_ALIGN(caps_cache_strings[i]->length());
+
+    uint8_t *payload = (uint8_t *)calloc(1, size);
+    if (payload == NULL)
+        return;
+    uint8_t *p = payload;
+    memcpy(p, zoom, sizeof(zoom));
+    p += sizeof(zoom);
+    for (unsigned int i = 0; i < CAPS_CACHE_STRING_COUNT; i++) {
+        uint32_t len = caps_cache_strings[i]->length();
+        memcpy(p, &len, sizeof(len));
+        p += sizeof(len);
+        memcpy(p, caps_cache_strings[i]->string(), len);
+        p += CAPS_CACHE_ALIGN(len);
+    }
+
+    caps_cache_key(&key, CAPS_CACHE_PARAMETERS, mCurrentTarget,
+                   HAL_currentCameraId, mSensorInfo.name);
+    caps_cache_store(&key, payload, size);
+    free(payload);
 }
 
 void QualcommCameraHardware::initDefaultParameters()
 {
     LOGI("initDefaultParameters E");
+    nsecs_t start = systemTime();
+
+    /* The constant strings may still be under construction on the open
+     * task graph; parameter_string_initialized covers later instances. */
+    joinOpenTask(OPEN_TASK_CAPS);
 
     /* Set the default dimensions otherwise the native_set_parm
      * called from findSensorType will segfault */
@@ -1295,11 +1939,29 @@ void QualcommCameraHardware::initDefaultParameters()
 
     findSensorType();
     hasAutoFocusSupport();
+    caps_cache_check_sensor(HAL_currentCameraId, mSensorInfo.name);
+
+    // Without a focus motor the AF metric is the only focus feedback there
+    // is, so it runs on every frame unless turned off explicitly.
+    char afmetric[PROPERTY_VALUE_MAX];
+    property_get("persist.camera.hal.afmetric", afmetric,
+                 mHasAutoFocusSupport ? "0" : "1");
+    mSharpEnabled = atoi(afmetric) > 0;
 
     //Disable DIS for Web Camera
     if(!strcmp(sensorType->name, "ov7692") || !strcmp(sensorType->name, "mt9m113"))
         mDisEnabled = 0;
 
+    /* A warm open takes the sensor dependent strings from the capability
+     * cache; the size tables still have to be filtered for validation. */
+    bool freshStrings = !parameter_string_initialized;
+    bool cachedStrings = freshStrings && loadCapabilityCache();
+    if (cachedStrings) {
+        filterPreviewSizes();
+        filterPictureSizes();
+        parameter_string_initialized = true;
+    }
+
     // Initialize constant parameter strings. This will happen only once in the
     // lifetime of the mediaserver process.
     if (!parameter_string_initialized) {
@@ -1307,7 +1969,6 @@ void QualcommCameraHardware::initDefaultParameters()
         antibanding_values=sensor_values(antibanding, sizeof(antibanding) / sizeof(str_map),HAL_cameraInfo[HAL_currentCameraId].parameters_data.antibanding);
     else
         antibanding_values = CameraParameters::ANTIBANDING_OFF;
-        }
     if (HAL_cameraInfo[HAL_currentCameraId].parameters_data.effects>0)
         effect_values= sensor_values(effects, sizeof(effects) / sizeof(str_map),HAL_cameraInfo[HAL_currentCameraId].parameters_data.effects);
     else
@@ -1331,13 +1992,6 @@ void QualcommCameraHardware::initDefaultParameters()
         picture_size_values = create_sizes_str(
                 picture_sizes_ptr, supportedPictureSizesCount);
 
-        fps_ranges_supported_values = create_fps_str(
-            FpsRangesSupported,FPS_RANGES_SUPPORTED_COUNT );
-        mParameters.set(
-            CameraParameters::KEY_SUPPORTED_PREVIEW_FPS_RANGE,
-            fps_ranges_supported_values);
-        mParameters.setPreviewFpsRange(MINIMUM_FPS*1000,MAXIMUM_FPS*1000);
-
     if (HAL_cameraInfo[HAL_currentCameraId].parameters_data.flash>0)
         flash_values=sensor_values(flash, sizeof(flash) / sizeof(str_map),HAL_cameraInfo[HAL_currentCameraId].parameters_data.flash);
     else
@@ -1356,16 +2010,6 @@ void QualcommCameraHardware::initDefaultParameters()
         lensshade_values=sensor_values(lensshade,sizeof(lensshade)/sizeof(str_map),HAL_cameraInfo[HAL_currentCameraId].parameters_data.lensshade);
     else
         lensshade_values = CameraParameters::LENSSHADE_DISABLE;
-        //Currently Enabling Histogram for 8x60
-        if(mCurrentTarget == TARGET_MSM8660) {
-            histogram_values = create_values_str(
-                histogram,sizeof(histogram)/sizeof(str_map));
-        }
-        //Currently Enabling Skin Tone Enhancement for 8x60 and 7630
-        if((mCurrentTarget == TARGET_MSM8660)||(mCurrentTarget == TARGET_MSM7630)) {
-            skinToneEnhancement_values = create_values_str(
-                skinToneEnhancement,sizeof(skinToneEnhancement)/sizeof(str_map));
-        }
         if(mHasAutoFocusSupport){
             touchafaec_values = create_values_str(
                 touchafaec,sizeof(touchafaec)/sizeof(str_map));
@@ -1373,14 +2017,12 @@ void QualcommCameraHardware::initDefaultParameters()
         else
             touchafaec_values = CameraParameters::TOUCH_AF_AEC_OFF;
 
-        picture_format_values = create_values_str(
-            picture_formats, sizeof(picture_formats)/sizeof(str_map));
-
         if(sensorType->hasAutoFocusSupport){
             continuous_af_values = create_values_str(
                 continuous_af, sizeof(continuous_af) / sizeof(str_map));
         }
 
+        beginParmSync();
         if(native_get_maxzoom(mCameraControlFd,
                 (void *)&mMaxZoom) == true){
             LOGD("Maximum zoom value is %d", mMaxZoom);
@@ -1407,8 +2049,7 @@ void QualcommCameraHardware::initDefaultParameters()
                     "zoom to zero");
             mMaxZoom = 0;
         }
-        preview_frame_rate_values = create_values_range_str(
-            MINIMUM_FPS, MAXIMUM_FPS);
+        endParmSync();
 
     if (HAL_cameraInfo[HAL_currentCameraId].parameters_data.scenemode>0)
         scenemode_values=sensor_values(scenemode, sizeof(scenemode) / sizeof(str_map),HAL_cameraInfo[HAL_currentCameraId].parameters_data.scenemode);
@@ -1423,13 +2064,20 @@ void QualcommCameraHardware::initDefaultParameters()
             selectable_zone_af_values = create_values_str(
                 selectable_zone_af, sizeof(selectable_zone_af) / sizeof(str_map));
         }
-
-        if(mHasAutoFocusSupport && supportsFaceDetection()) {
-            facedetection_values = create_values_str(
-                facedetection, sizeof(facedetection) / sizeof(str_map));
-        }
         parameter_string_initialized = true;
     }
+    if (freshStrings && !cachedStrings)
+        storeCapabilityCache();
+    // Depends on the cascade file rather than the sensor, so never cached.
+    if(supportsFaceDetection()) {
+        facedetection_values = create_values_str(
+            facedetection, sizeof(facedetection) / sizeof(str_map));
+    } else {
+        facedetection_values = "";
+    }
+    mParameters.set(
+        CameraParameters::KEY_SUPPORTED_PREVIEW_FPS_RANGE,
+        fps_ranges_supported_values);
 
     mParameters.setPreviewSize(DEFAULT_PREVIEW_WIDTH, DEFAULT_PREVIEW_HEIGHT);
     mDimension.display_width = DEFAULT_PREVIEW_WIDTH;
@@ -1546,6 +2194,17 @@ void QualcommCameraHardware::initDefaultParameters()
 
     mParameters.set(CameraParameters::KEY_SUPPORTED_PICTURE_FORMATS,
                     picture_format_values);
+    mParameters.set("raw-format", "mipi10");
+    mParameters.set("raw-format-values", raw_format_values);
+    mParameters.set("raw-black-level", 0);
+    mParameters.set("raw-container", "none");
+    mParameters.set("raw-container-values", raw_container_values);
+    mParameters.set("exposure-bracketing", "off");
+    mParameters.set("exposure-bracketing-values", bracketing_values);
+    mParameters.set("exposure-bracketing-steps", "-6,0,6");
+    mParameters.set("multi-frame-denoise", "off");
+    mParameters.set("multi-frame-denoise-values", multi_frame_denoise_values);
+    mParameters.set("multi-frame-denoise-frames", DEFAULT_DENOISE_FRAMES);
 
     if (mSensorInfo.flash_enabled) {
         mParameters.set(CameraParameters::KEY_FLASH_MODE,
@@ -1668,6 +2327,9 @@ void QualcommCameraHardware::initDefaultParameters()
     mParameters.set("touchAfAec-dy","100");
     mParameters.set(CameraParameters::KEY_MAX_NUM_FOCUS_AREAS, "1");
     mParameters.set(CameraParameters::KEY_MAX_NUM_METERING_AREAS, "1");
+    mParameters.set(CameraParameters::KEY_MAX_NUM_DETECTED_FACES_HW, 0);
+    mParameters.set(CameraParameters::KEY_MAX_NUM_DETECTED_FACES_SW,
+                    supportsFaceDetection() ? FACE_METADATA_FACES : 0);
     mParameters.set(CameraParameters::KEY_SCENE_DETECT,
                     CameraParameters::SCENE_DETECT_OFF);
     mParameters.set(CameraParameters::KEY_SUPPORTED_SCENE_DETECT,
@@ -1712,6 +2374,12 @@ void QualcommCameraHardware::initDefaultParameters()
     mInitialized = true;
     strTexturesOn = false;
 
+    /* mHasAutoFocusSupport is only known once the sensor has been found,
+     * so the AF worker cannot be started along with the others. */
+    startAutoFocusThread();
+
+    publishParameters();
+    logOpenBreakdown(systemTime() - start);
     LOGI("initDefaultParameters X");
 }
 
@@ -1743,13 +2411,10 @@ void QualcommCameraHardware::findSensorType(){
 
 #define ROUND_TO_PAGE(x)  (((x)+0xfff)&~0xfff)
 
-bool QualcommCameraHardware::startCamera()
+bool QualcommCameraHardware::bindLibmmcamera()
 {
-    LOGV("startCamera E");
-    if( mCurrentTarget == TARGET_MAX ) {
-        LOGE(" Unable to determine the target type. Camera will not work ");
-        return false;
-    }
+    mMMCameraDLRef = MMCameraDL::getInstance();
+    libmmcamera = mMMCameraDLRef->pointer();
     LOGV("%s, libmmcamera: %p\n", __FUNCTION__, libmmcamera);
 #if DLOPEN_LIBMMCAMERA
     if (!libmmcamera) {
@@ -1868,33 +2533,112 @@ bool QualcommCameraHardware::startCamera()
     mmcamera_shutter_callback = receive_shutter_callback;
     mmcamera_liveshot_callback = receive_liveshot_callback;
 #endif // DLOPEN_LIBMMCAMERA
+    return true;
+}
+
+bool QualcommCameraHardware::runOpenTask(int id)
+{
+    switch (id) {
+    case OPEN_TASK_SENSOR:
+        mCameraControlFd = open(MSM_CAMERA_CONTROL, O_RDWR);
+        if (mCameraControlFd < 0) {
+            LOGE("%s open failed: %s!", MSM_CAMERA_CONTROL, strerror(errno));
+            return false;
+        }
+        return true;
+    case OPEN_TASK_SYMBOLS:
+        return bindLibmmcamera();
+    case OPEN_TASK_FB:
+        fb_fd = open("/dev/graphics/fb0", O_RDWR);
+        if (fb_fd < 0) {
+            LOGE("startCamera: fb0 open failed: %s!", strerror(errno));
+            return false;
+        }
+        return true;
+    case OPEN_TASK_CAPS:
+        initStaticCapabilityStrings();
+        return true;
+    }
+    return false;
+}
+
+void QualcommCameraHardware::startOpenTask(int id)
+{
+    open_task *task = &mOpenTasks[id];
+    task->obj = this;
+    task->id = id;
+    task->running = true;
+    if (pthread_create(&task->thread, NULL, open_task_thread, task) != 0) {
+        LOGE("open task %s thread creation failed, running inline",
+             open_task_names[id]);
+        task->running = false;
+        open_task_thread(task);
+    }
+}
+
+// Returns the task result; a task that was never started counts as done.
+bool QualcommCameraHardware::joinOpenTask(int id)
+{
+    open_task *task = &mOpenTasks[id];
+    if (task->running) {
+        if (pthread_join(task->thread, NULL) != 0) {
+            LOGE("open task %s exit failed", open_task_names[id]);
+            task->ok = false;
+        }
+        task->running = false;
+    } else if (task->obj == NULL) {
+        return true;
+    }
+    return task->ok;
+}
+
+void QualcommCameraHardware::logOpenBreakdown(nsecs_t defaultsTime)
+{
+    nsecs_t serial = mConfigInitTime + defaultsTime;
+    for (int i = 0; i < OPEN_TASK_MAX; i++)
+        serial += mOpenTasks[i].elapsed;
+    LOGI("camera open: sensor %lld ms, symbols %lld ms, fb %lld ms, "
+         "caps %lld ms, config_init %lld ms, defaults %lld ms; "
+         "%lld ms elapsed for %lld ms of work",
+         ns2ms(mOpenTasks[OPEN_TASK_SENSOR].elapsed),
+         ns2ms(mOpenTasks[OPEN_TASK_SYMBOLS].elapsed),
+         ns2ms(mOpenTasks[OPEN_TASK_FB].elapsed),
+         ns2ms(mOpenTasks[OPEN_TASK_CAPS].elapsed),
+         ns2ms(mConfigInitTime), ns2ms(defaultsTime),
+         ns2ms(systemTime() - mOpenTime), ns2ms(serial));
+}
+
+bool QualcommCameraHardware::startCamera()
+{
+    LOGV("startCamera E");
+    /* Symbols and the control device are needed below; the framebuffer
+     * is joined here too so that no open task outlives a failed start.
+     * The capability strings are joined in initDefaultParameters. */
+    bool symbolsOk = joinOpenTask(OPEN_TASK_SYMBOLS);
+    bool sensorOk = joinOpenTask(OPEN_TASK_SENSOR);
+    bool fbOk = joinOpenTask(OPEN_TASK_FB);
 
-    /* The control thread is in libcamera itself. */
-    if (pthread_join(w_thread, NULL) != 0) {
-        LOGE("Camera open thread exit failed");
+    if( mCurrentTarget == TARGET_MAX ) {
+        LOGE(" Unable to determine the target type. Camera will not work ");
         return false;
     }
-    mCameraControlFd = camerafd;
+    if (!symbolsOk)
+        return false;
 
-    if (mCameraControlFd < 0) {
-        LOGE("startCamera X: %s open failed: %s!",
-             MSM_CAMERA_CONTROL,
-             strerror(errno));
+    if (!sensorOk) {
+        LOGE("startCamera X: %s open failed!", MSM_CAMERA_CONTROL);
         return false;
     }
 
+    nsecs_t start = systemTime();
     if (MM_CAMERA_SUCCESS != LINK_mm_camera_config_init(&mCfgControl)) {
             LOGE("startCamera: mm_camera_config_init failed:");
             return FALSE;
     }
+    mConfigInitTime = systemTime() - start;
 
-    if((mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM8660)){
-        fb_fd = open("/dev/graphics/fb0", O_RDWR);
-        if (fb_fd < 0) {
-            LOGE("startCamera: fb0 open failed: %s!", strerror(errno));
-            return FALSE;
-        }
-    }
+    if (!fbOk)
+        return FALSE;
 
     /* This will block until the control thread is launched. After that, sensor
      * information becomes available.
@@ -1909,6 +2653,11 @@ bool QualcommCameraHardware::startCamera()
         LOGI("%s: camsensor name %s, flash %d", __FUNCTION__,
              mSensorInfo.name, mSensorInfo.flash_enabled);
 
+    startParmThread();
+    startSharpnessThread();
+    startHistogramThread();
+    startFaceThread();
+
 /* Disable and use hardcoded values for now
     mCfgControl.mm_camera_query_parms(CAMERA_PARM_PICT_SIZE, (void **)&picture_sizes, &PICTURE_SIZE_COUNT);
     if (!picture_sizes || !PICTURE_SIZE_COUNT) {
@@ -1944,6 +2693,59 @@ status_t QualcommCameraHardware::dump(int fd,
              "and jpeg max size (%d)\n", mPreviewFrameSize, mRawSize,
              mJpegSize, mJpegMaxSize);
     result.append(buffer);
+    snprintf(buffer, 255, "setParameters ioctls issued (%d), skipped (%d), "
+             "failed (%d)\n", mParamIoctlsIssued, mParamIoctlsSkipped,
+             mParamIoctlsFailed);
+    result.append(buffer);
+    snprintf(buffer, 255, "setParameters calls (%d), avg time (%lld us)\n",
+             mSetParamsCalls,
+             mSetParamsCalls ? ns2us(mSetParamsTime) / mSetParamsCalls : 0LL);
+    result.append(buffer);
+    snprintf(buffer, 255, "control commands (%u), max queue depth (%d), "
+             "avg latency (%lld us), max latency (%lld us), timeouts (%d)\n",
+             mParmCompleted, mParmMaxDepth,
+             mParmCompleted ? ns2us(mParmLatencyTotal) / mParmCompleted : 0LL,
+             ns2us(mParmLatencyMax), mParmTimeouts);
+    result.append(buffer);
+    mReconfigLock.lock();
+    snprintf(buffer, 255, "preview reconfigurations (%d), frame gap last (%lld ms), "
+             "max (%lld ms)\n", mReconfigCount, ns2ms(mReconfigGapLast),
+             ns2ms(mReconfigGapMax));
+    mReconfigLock.unlock();
+    result.append(buffer);
+    snprintf(buffer, 255, "autofocus latency <50/100/200/400/800/1600/more ms "
+             "(%d %d %d %d %d %d %d), focus state checks (%d)\n",
+             mAfLatencyHist[0], mAfLatencyHist[1], mAfLatencyHist[2],
+             mAfLatencyHist[3], mAfLatencyHist[4], mAfLatencyHist[5],
+             mAfLatencyHist[6], mAfStateChecks);
+    result.append(buffer);
+    snprintf(buffer, 255, "autofocus requests coalesced (%d)\n", mAfCoalesced);
+    result.append(buffer);
+    snprintf(buffer, 255, "af sharpness frames (%d), dropped (%d), avg (%lld us)\n",
+             mSharpCount, mSharpDropped,
+             mSharpCount ? ns2us(mSharpTimeTotal) / mSharpCount : 0LL);
+    result.append(buffer);
+    snprintf(buffer, 255, "software histograms (%d), dropped (%d), avg (%lld us), "
+             "driver stats (%d)\n", mHistFrames, mHistDropped,
+             mHistFrames ? ns2us(mHistTimeTotal) / mHistFrames : 0LL,
+             mStatsFromDriver);
+    result.append(buffer);
+    nsecs_t fdSpan = mFdStartTime ? systemTime() - mFdStartTime : 0;
+    snprintf(buffer, 255, "face detection frames (%d, %.1f fps), skipped (%d), "
+             "unsent (%d), faces (%d), avg (%lld ms), max (%lld ms), "
+             "latency (%lld ms)\n",
+             mFdFrames, fdSpan > 0 ? mFdFrames * 1e9 / fdSpan : 0.0,
+             mFdSkipped, mFdUnsent, mFdFaces,
+             mFdFrames ? ns2ms(mFdTimeTotal) / mFdFrames : 0LL,
+             ns2ms(mFdTimeMax),
+             mFdFrames ? ns2ms(mFdLatencyTotal) / mFdFrames : 0LL);
+    result.append(buffer);
+    snprintf(buffer, 255, "scene detection frames (%d), changes (%d), scene (%d), "
+             "avg (%lld us), max (%lld us), row step (%d)\n",
+             mSceneFrames, mSceneChanges, mSceneCurrent,
+             mSceneFrames ? ns2us(mSceneTimeTotal) / mSceneFrames : 0LL,
+             ns2us(mSceneTimeMax), mSceneRowStep);
+    result.append(buffer);
     write(fd, result.string(), result.size());
 
     // Dump internal objects.
@@ -1956,6 +2758,7 @@ status_t QualcommCameraHardware::dump(int fd,
     if (mJpegHeap != 0) {
         mJpegHeap->dump(fd, args);
     }
+    mem_account_dump(fd);
     mParameters.dump(fd, args);
     return NO_ERROR;
 }
@@ -2424,11 +3227,15 @@ static void setLatLon(exif_tag_id_t tag, const char *latlonString) {
     }
 }
 
+// Runs on the capture threads, so it reads the published parameters and
+// leaves mParameters to the callers holding mLock.
 void QualcommCameraHardware::setGpsParameters() {
     const char *str = NULL;
     LOGV("%s E", __FUNCTION__);
+    sp<param_snapshot> snap = getSnapshot();
+    const CameraParameters &params = snap->params;
 #if 0
-    str = mParameters.get(CameraParameters::KEY_GPS_PROCESSING_METHOD);
+    str = params.get(CameraParameters::KEY_GPS_PROCESSING_METHOD);
     if (str!=NULL) {
        memcpy(gpsProcessingMethod, ExifAsciiPrefix, EXIF_ASCII_PREFIX_SIZE);
        strlcpy(gpsProcessingMethod + EXIF_ASCII_PREFIX_SIZE, str,
@@ -2442,41 +3249,39 @@ void QualcommCameraHardware::setGpsParameters() {
     str = NULL;
 #endif
     //Set Latitude
-    str = mParameters.get(CameraParameters::KEY_GPS_LATITUDE);
+    str = params.get(CameraParameters::KEY_GPS_LATITUDE);
 
     if(str != NULL) {
         setLatLon(EXIFTAGID_GPS_LATITUDE, str);
-        float latitudeValue = mParameters.getFloat(CameraParameters::KEY_GPS_LATITUDE);
+        float latitudeValue = params.getFloat(CameraParameters::KEY_GPS_LATITUDE);
         latref[0] = 'N';
         if(latitudeValue < 0 ){
             latref[0] = 'S';
         }
         latref[1] = '\0';
-        mParameters.set(CameraParameters::KEY_GPS_LATITUDE_REF, latref);
         addExifTag(EXIFTAGID_GPS_LATITUDE_REF, EXIF_ASCII, 2,
                                 1, (void *)latref);
     }
 
     //set Longitude
     str = NULL;
-    str = mParameters.get(CameraParameters::KEY_GPS_LONGITUDE);
+    str = params.get(CameraParameters::KEY_GPS_LONGITUDE);
     if(str != NULL) {
         setLatLon(EXIFTAGID_GPS_LONGITUDE, str);
         //set Longitude Ref
-        float longitudeValue = mParameters.getFloat(CameraParameters::KEY_GPS_LONGITUDE);
+        float longitudeValue = params.getFloat(CameraParameters::KEY_GPS_LONGITUDE);
         lonref[0] = 'E';
         if(longitudeValue < 0){
             lonref[0] = 'W';
         }
         lonref[1] = '\0';
-        mParameters.set(CameraParameters::KEY_GPS_LONGITUDE_REF, lonref);
         addExifTag(EXIFTAGID_GPS_LONGITUDE_REF, EXIF_ASCII, 2,
                                 1, (void *)lonref);
     }
 
     //set Altitude
     str = NULL;
-    str = mParameters.get(CameraParameters::KEY_GPS_ALTITUDE);
+    str = params.get(CameraParameters::KEY_GPS_ALTITUDE);
     if(str != NULL) {
         double value = atof(str);
         int ref = 0;
@@ -2490,14 +3295,13 @@ void QualcommCameraHardware::setGpsParameters() {
         addExifTag(EXIFTAGID_GPS_ALTITUDE, EXIF_RATIONAL, 1,
                     1, (void *)&altitude);
         //set AltitudeRef
-        mParameters.set(CameraParameters::KEY_GPS_ALTITUDE_REF, ref);
         addExifTag(EXIFTAGID_GPS_ALTITUDE_REF, EXIF_BYTE, 1,
                     1, (void *)&ref);
     }
 
     //set Gps TimeStamp
     str = NULL;
-    str = mParameters.get(CameraParameters::KEY_GPS_TIMESTAMP);
+    str = params.get(CameraParameters::KEY_GPS_TIMESTAMP);
     if(str != NULL) {
 
       long value = atol(str);
@@ -2525,7 +3329,8 @@ void QualcommCameraHardware::setGpsParameters() {
 bool QualcommCameraHardware::native_jpeg_encode(void)
 {
     LOGV("%s E", __FUNCTION__);
-    int jpeg_quality = mParameters.getInt("jpeg-quality");
+    sp<param_snapshot> snap = getSnapshot();
+    int jpeg_quality = snap->jpegQuality;
     if (jpeg_quality >= 0) {
         //Application can pass quality of zero
         //when there is no back sensor connected.
@@ -2540,7 +3345,7 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
         }
     }
 
-    int thumbnail_quality = mParameters.getInt("jpeg-thumbnail-quality");
+    int thumbnail_quality = snap->thumbnailQuality;
     if (thumbnail_quality >= 0) {
         //Application can pass quality of zero
         //when there is no back sensor connected.
@@ -2556,7 +3361,7 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
     }
 
     if( (mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM7627) && (mCurrentTarget != TARGET_MSM8660) ) {
-        int rotation = mParameters.getInt("rotation");
+        int rotation = snap->rotation;
         if (rotation >= 0) {
             LOGV("native_jpeg_encode, rotation = %d", rotation);
             if(!LINK_jpeg_encoder_setRotation(rotation)) {
@@ -2569,15 +3374,14 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
     jpeg_set_location();
 
     //set TimeStamp
-    const char *str = mParameters.get(CameraParameters::KEY_EXIF_DATETIME);
+    const char *str = snap->dateTime;
     if(str != NULL) {
       strlcpy(dateTime, str, 20);
       addExifTag(EXIFTAGID_EXIF_DATE_TIME_ORIGINAL, EXIF_ASCII,
                   20, 1, (void *)dateTime);
     }
 
-    int focalLengthValue = (int) (mParameters.getFloat(
-                CameraParameters::KEY_FOCAL_LENGTH) * FOCAL_LENGTH_DECIMAL_PRECISON);
+    int focalLengthValue = (int) (snap->focalLength * FOCAL_LENGTH_DECIMAL_PRECISON);
     rat_t focalLengthRational = {focalLengthValue, FOCAL_LENGTH_DECIMAL_PRECISON};
     memcpy(&focalLength, &focalLengthRational, sizeof(focalLengthRational));
     addExifTag(EXIFTAGID_FOCAL_LENGTH, EXIF_RATIONAL, 1,
@@ -2586,8 +3390,8 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
     uint8_t * thumbnailHeap = NULL;
     int thumbfd = -1;
 
-    int width = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH);
-    int height = mParameters.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT);
+    int width = snap->thumbnailWidth;
+    int height = snap->thumbnailHeight;
 
     LOGV("width %d and height %d", width , height);
 
@@ -2675,23 +3479,31 @@ bool QualcommCameraHardware::native_jpeg_encode(void)
 bool QualcommCameraHardware::native_set_parm(
     cam_ctrl_type type, uint16_t length, void *value)
 {
-    struct msm_ctrl_cmd ctrlCmd;
-
-    ctrlCmd.timeout_ms = 5000;
-    ctrlCmd.type       = (uint16_t)type;
-    ctrlCmd.length     = length;
-    // FIXME: this will be put in by the kernel
-    ctrlCmd.resp_fd    = mCameraControlFd;
-    ctrlCmd.value = value;
+    int rc, status = CAM_CTRL_FAILED, err = 0;
+    uint32_t seq;
 
-    LOGV("%s: fd %d, type %d, length %d", __FUNCTION__,
-         mCameraControlFd, type, length);
+    mSetParmCount++;
+    /* The driver writes the dimension back and large values do not fit a
+     * queue slot; those are issued here once parm_thread is idle. */
+    if (mParmThreadRunning && length <= PARM_CMD_VALUE_MAX &&
+        type != CAMERA_SET_PARM_DIMENSION) {
+        if (!queueParm(type, length, value, &seq))
+            return false;
+        if (inParmBatch())
+            return true;
+        if (!waitParm(seq, &rc, &status, &err))
+            return false;
+    } else {
+        beginParmSync();
+        rc = issueParm(type, length, value, &status);
+        err = errno;
+        endParmSync();
+    }
 
-    if (ioctl(mCameraControlFd, MSM_CAM_IOCTL_CTRL_COMMAND, &ctrlCmd) < 0 ||
-                ctrlCmd.status != CAM_CTRL_SUCCESS) {
+    if (rc < 0 || status != CAM_CTRL_SUCCESS) {
         LOGE("%s: error (%s): fd %d, type %d, length %d, status %d",
-             __FUNCTION__, strerror(errno),
-             mCameraControlFd, type, length, ctrlCmd.status);
+             __FUNCTION__, strerror(err),
+             mCameraControlFd, type, length, status);
         return false;
     }
     return true;
@@ -2700,10 +3512,37 @@ bool QualcommCameraHardware::native_set_parm(
 //overloaded funtion which takes an extra parameter ie  ctrlCmd.status Value
 bool QualcommCameraHardware::native_set_parm(
     cam_ctrl_type type, uint16_t length, void *value, int *result)
+{
+    int rc = -1, status = CAM_CTRL_FAILED, err = 0;
+    uint32_t seq;
+
+    mSetParmCount++;
+    if (mParmThreadRunning && length <= PARM_CMD_VALUE_MAX &&
+        type != CAMERA_SET_PARM_DIMENSION) {
+        if (queueParm(type, length, value, &seq))
+            waitParm(seq, &rc, &status, &err);
+    } else {
+        beginParmSync();
+        rc = issueParm(type, length, value, &status);
+        err = errno;
+        endParmSync();
+    }
+
+    *result = status;
+    if (rc > 0 || status == CAM_CTRL_SUCCESS || status == CAM_CTRL_INVALID_PARM)
+        return true;
+    LOGE("%s: error (%s): fd %d, type %d, length %d, status %d",
+         __FUNCTION__, strerror(err),
+         mCameraControlFd, type, length, status);
+    return false;
+}
+
+int QualcommCameraHardware::issueParm(
+    cam_ctrl_type type, uint16_t length, void *value, int *status)
 {
     struct msm_ctrl_cmd ctrlCmd;
 
-    ctrlCmd.timeout_ms = 5000;
+    ctrlCmd.timeout_ms = PARM_DRIVER_TIMEOUT_MS;
     ctrlCmd.type       = (uint16_t)type;
     ctrlCmd.length     = length;
     // FIXME: this will be put in by the kernel
@@ -2712,27 +3551,290 @@ bool QualcommCameraHardware::native_set_parm(
 
     LOGV("%s: fd %d, type %d, length %d", __FUNCTION__,
          mCameraControlFd, type, length);
-    if (ioctl(mCameraControlFd, MSM_CAM_IOCTL_CTRL_COMMAND, &ctrlCmd) > 0 ||
-        ctrlCmd.status == CAM_CTRL_SUCCESS || ctrlCmd.status == CAM_CTRL_INVALID_PARM)  {
-        *result = ctrlCmd.status ;
-        return true;
-    } else {
-        LOGE("%s: error (%s): fd %d, type %d, length %d, status %d",
-             __FUNCTION__, strerror(errno),
-             mCameraControlFd, type, length, ctrlCmd.status);
-        *result = ctrlCmd.status;
+    int rc = ioctl(mCameraControlFd, MSM_CAM_IOCTL_CTRL_COMMAND, &ctrlCmd);
+    *status = ctrlCmd.status;
+    return rc;
+}
+
+void *parm_thread(void *user)
+{
+    LOGV("parm_thread E");
+    ((QualcommCameraHardware *)user)->runParmThread();
+    LOGV("parm_thread X");
+    return NULL;
+}
+
+void QualcommCameraHardware::runParmThread()
+{
+    mParmLock.lock();
+    while (true) {
+        while (mParmSyncHeld || (!mParmThreadExit && mParmDone == mParmSeq))
+            mParmWait.wait(mParmLock);
+        if (mParmDone == mParmSeq)
+            break;
+        // The slot is not reused before mParmDone moves past it.
+        parm_cmd *cmd = &mParmQueue[mParmDone % PARM_QUEUE_SIZE];
+        if (cmd->cancelled) {
+            LOGW("%s: skipping control command %u (%d), its caller gave up",
+                 __FUNCTION__, cmd->seq, cmd->type);
+            cmd->rc = -1;
+            cmd->status = CAM_CTRL_FAILED;
+            cmd->err = ETIMEDOUT;
+            mParmDone++;
+            mParmWait.broadcast();
+            continue;
+        }
+        mParmIssuing = true;
+        mParmLock.unlock();
+        int status = CAM_CTRL_FAILED;
+        int rc = issueParm(cmd->type, cmd->length, cmd->value, &status);
+        int err = rc < 0 ? errno : 0;
+        nsecs_t latency = systemTime() - cmd->queued;
+        mParmLock.lock();
+        mParmIssuing = false;
+        cmd->rc = rc;
+        cmd->status = status;
+        cmd->err = err;
+        if (cmd->late)
+            LOGW("%s: control command %u (%d) completed after its deadline, "
+                 "rc %d status %d", __FUNCTION__, cmd->seq, cmd->type, rc, status);
+        if (cmd->batched && (rc < 0 || status != CAM_CTRL_SUCCESS)) {
+            LOGE("%s: %s: control command %d failed, status %d", __FUNCTION__,
+                 cmd->handler >= 0 ? kParamHandlers[cmd->handler].name : "unknown",
+                 cmd->type, status);
+            if (cmd->handler >= 0)
+                mParmHandlerFailed[cmd->handler] = true;
+            mParmFailed++;
+        }
+        mParmCompleted++;
+        mParmLatencyTotal += latency;
+        if (latency > mParmLatencyMax)
+            mParmLatencyMax = latency;
+        mParmDone++;
+        mParmWait.broadcast();
+    }
+    mParmLock.unlock();
+}
+
+void QualcommCameraHardware::startParmThread()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    // A shorter deadline would give up on commands the driver still runs.
+    property_get("persist.camera.hal.ctrldeadline", value, "6000");
+    int deadline = atoi(value);
+    if (deadline < PARM_DRIVER_TIMEOUT_MS)
+        deadline = PARM_DRIVER_TIMEOUT_MS;
+    mParmDeadline = ms2ns(deadline);
+    mParmSeq = mParmDone = 0;
+    mParmThreadExit = false;
+    mParmThreadRunning =
+        !pthread_create(&mParmThread, NULL, parm_thread, this);
+    if (!mParmThreadRunning)
+        LOGE("%s: control thread creation failed, commands stay synchronous",
+             __FUNCTION__);
+}
+
+void QualcommCameraHardware::stopParmThread()
+{
+    if (!mParmThreadRunning)
+        return;
+    endParmBatch(NULL);
+    drainParm();
+    mParmLock.lock();
+    mParmThreadExit = true;
+    mParmWait.broadcast();
+    mParmLock.unlock();
+    pthread_join(mParmThread, NULL);
+    mParmThreadRunning = false;
+}
+
+bool QualcommCameraHardware::inParmBatch()
+{
+    return mParmBatchOpen && pthread_equal(mParmBatchThread, pthread_self());
+}
+
+// Queues a command, waiting up to the deadline for a free slot.
+bool QualcommCameraHardware::queueParm(
+    cam_ctrl_type type, uint16_t length, void *value, uint32_t *seq)
+{
+    nsecs_t deadline = systemTime() + mParmDeadline;
+    Mutex::Autolock l(&mParmLock);
+    while (mParmSeq - mParmDone == PARM_QUEUE_SIZE) {
+        nsecs_t left = deadline - systemTime();
+        if (left <= 0) {
+            mParmTimeouts++;
+            LOGE("%s: control queue still full after %lld ms", __FUNCTION__,
+                 ns2ms(mParmDeadline));
+            if (inParmBatch() && mParmHandler >= 0) {
+                mParmHandlerFailed[mParmHandler] = true;
+                mParmFailed++;
+            }
+            return false;
+        }
+        mParmWait.waitRelative(mParmLock, left);
+    }
+    parm_cmd *cmd = &mParmQueue[mParmSeq % PARM_QUEUE_SIZE];
+    cmd->seq = mParmSeq;
+    cmd->type = type;
+    cmd->length = length;
+    memcpy(cmd->value, value, length);
+    cmd->handler = mParmHandler;
+    cmd->owner = pthread_self();
+    cmd->batched = inParmBatch();
+    cmd->cancelled = false;
+    cmd->late = false;
+    cmd->queued = systemTime();
+    *seq = mParmSeq++;
+    int depth = mParmSeq - mParmDone;
+    if (depth > mParmMaxDepth)
+        mParmMaxDepth = depth;
+    mParmWait.broadcast();
+    return true;
+}
+
+/* Waits up to the deadline for command seq. On timeout the caller sees a
+ * failure instead of blocking on the driver, and the caller's own commands
+ * up to seq that parm_thread has not issued yet are cancelled. */
+bool QualcommCameraHardware::waitParm(uint32_t seq, int *rc, int *status, int *err)
+{
+    nsecs_t deadline = systemTime() + mParmDeadline;
+    Mutex::Autolock l(&mParmLock);
+    while ((int32_t)(mParmDone - seq) <= 0) {
+        nsecs_t left = deadline - systemTime();
+        if (left <= 0) {
+            mParmTimeouts++;
+            LOGE("%s: control command %u timed out after %lld ms, %d queued",
+                 __FUNCTION__, seq, ns2ms(mParmDeadline), mParmSeq - mParmDone);
+            cancelParm(seq);
+            return false;
+        }
+        mParmWait.waitRelative(mParmLock, left);
+    }
+    const parm_cmd *cmd = &mParmQueue[seq % PARM_QUEUE_SIZE];
+    if (cmd->seq != seq) {
+        LOGW("%s: result of control command %u was overwritten", __FUNCTION__, seq);
         return false;
     }
+    if (rc)
+        *rc = cmd->rc;
+    if (status)
+        *status = cmd->status;
+    if (err)
+        *err = cmd->err;
+    return true;
+}
+
+/* Called with mParmLock held once a wait for last has timed out. Only the
+ * calling thread's commands are cancelled; other callers keep their own
+ * deadlines. Batched commands count as failed whether they are skipped or
+ * still in the driver, so setParameters() rolls their keys back and the
+ * next call issues them again. */
+void QualcommCameraHardware::cancelParm(uint32_t last)
+{
+    for (uint32_t s = mParmDone; (int32_t)(last - s) >= 0; s++) {
+        parm_cmd *cmd = &mParmQueue[s % PARM_QUEUE_SIZE];
+        if (!pthread_equal(cmd->owner, pthread_self()))
+            continue;
+        if (s == mParmDone && mParmIssuing)
+            cmd->late = true;
+        else
+            cmd->cancelled = true;
+        if (cmd->batched) {
+            if (cmd->handler >= 0)
+                mParmHandlerFailed[cmd->handler] = true;
+            mParmFailed++;
+            cmd->batched = false;
+        }
+    }
+}
+
+// Waits for everything queued so far, bounded by the deadline.
+void QualcommCameraHardware::drainParm()
+{
+    if (!mParmThreadRunning)
+        return;
+    mParmLock.lock();
+    uint32_t last = mParmSeq;
+    bool pending = last != mParmDone;
+    mParmLock.unlock();
+    if (pending)
+        waitParm(last - 1, NULL, NULL, NULL);
+}
+
+/* Holds parm_thread idle so the caller can issue on its own thread. The
+ * queue is drained first; a command still in the driver after the drain
+ * timed out is waited for without a deadline, since the driver gives up
+ * on it after PARM_DRIVER_TIMEOUT_MS. */
+void QualcommCameraHardware::beginParmSync()
+{
+    if (!mParmThreadRunning)
+        return;
+    drainParm();
+    Mutex::Autolock l(&mParmLock);
+    while (mParmSyncHeld)
+        mParmWait.wait(mParmLock);
+    mParmSyncHeld = true;
+    while (mParmIssuing)
+        mParmWait.wait(mParmLock);
+}
+
+void QualcommCameraHardware::endParmSync()
+{
+    if (!mParmThreadRunning)
+        return;
+    Mutex::Autolock l(&mParmLock);
+    mParmSyncHeld = false;
+    mParmWait.broadcast();
+}
+
+// Issues one of the native_* control commands behind parm_thread.
+bool QualcommCameraHardware::native_ctrl(bool (*command)(int camfd))
+{
+    beginParmSync();
+    bool rc = command(mCameraControlFd);
+    endParmSync();
+    return rc;
+}
+
+void QualcommCameraHardware::beginParmBatch()
+{
+    if (!mParmThreadRunning)
+        return;
+    mParmFailed = 0;
+    memset(mParmHandlerFailed, 0, sizeof(mParmHandlerFailed));
+    mParmBatchThread = pthread_self();
+    mParmBatchOpen = true;
+}
+
+// Closes the batch once its commands have completed; returns how many of
+// them the driver rejected and, in failedHandlers, whose commands they were.
+int QualcommCameraHardware::endParmBatch(bool *failedHandlers)
+{
+    if (failedHandlers)
+        memset(failedHandlers, 0, sizeof(mParmHandlerFailed));
+    if (!inParmBatch())
+        return 0;
+    mParmBatchOpen = false;
+    drainParm();
+    Mutex::Autolock l(&mParmLock);
+    int failed = mParmFailed;
+    mParmFailed = 0;
+    if (failedHandlers)
+        memcpy(failedHandlers, mParmHandlerFailed, sizeof(mParmHandlerFailed));
+    return failed;
 }
+
 void QualcommCameraHardware::jpeg_set_location()
 {
     bool encode_location = true;
     camera_position_type pt;
+    sp<param_snapshot> snap = getSnapshot();
 
     LOGV("%s E", __FUNCTION__);
 #define PARSE_LOCATION(what,type,fmt,desc) do {                                \
         pt.what = 0;                                                           \
-        const char *what##_str = mParameters.get("gps-"#what);                 \
+        const char *what##_str = snap->params.get("gps-"#what);                \
         LOGV("GPS PARM %s --> [%s]", "gps-"#what, what##_str);                 \
         if (what##_str) {                                                      \
             type what = 0;                                                     \
@@ -2789,15 +3891,13 @@ void QualcommCameraHardware::runFrameThread(void *data)
 
 	LOGV("runFrameThread: clearing mPreviewHeap");
     mPmemWaitLock.lock();
-    mPreviewHeap.clear();
-    mPreviewHeap = NULL;
+    recyclePmemPool(mPreviewHeap);
     mPrevHeapDeallocRunning = true;
     mPmemWait.signal();
     mPmemWaitLock.unlock();
 
     if((mCurrentTarget == TARGET_MSM7630) || (mCurrentTarget == TARGET_QSD8250) || (mCurrentTarget == TARGET_MSM8660)) {
-        mRecordHeap.clear();
-        mRecordHeap = NULL;
+        recyclePmemPool(mRecordHeap);
 	}
 
     mFrameThreadWaitLock.lock();
@@ -2859,10 +3959,17 @@ void QualcommCameraHardware::runVideoThread(void *data)
             LOGV("offset = %lu , alignsize = %d , offset later = %ld", offset, mRecordHeap->mAlignedBufferSize, (offset / mRecordHeap->mAlignedBufferSize));
 
             offset /= mRecordHeap->mAlignedBufferSize;
+            mRecordHeap->invalidate(offset);
 
             //set the track flag to true for this video buffer
             record_buffers_tracking_flag[offset] = true;
 
+            // Pin this buffer for a pending software live snapshot
+            mLiveShotThreadWaitLock.lock();
+            if (mLiveShotPending)
+                startLiveShotThread(&recordframes[offset], NULL);
+            mLiveShotThreadWaitLock.unlock();
+
             /* Extract the timestamp of this frame */
 	    nsecs_t timeStamp = nsecs_t(vframe->ts.tv_sec)*1000000000LL + vframe->ts.tv_nsec;
 
@@ -2902,7 +4009,7 @@ void QualcommCameraHardware::runVideoThread(void *data)
 #else
             // 720p output2  : simulate release frame here:
             LOGE("in video_thread simulation , releasing the video frame");
-            LINK_camframe_free_video(vframe);
+            freeVideoFrame(vframe);
 #endif
 
         } else LOGE("in video_thread get frame returned null");
@@ -2959,6 +4066,20 @@ static int parse_size(const char *str, int &width, int &height)
     return 0;
 }
 
+// Size of one preview buffer and offset of its chroma plane
+static void preview_frame_layout(int width, int height, int format,
+                                 int *frameSize, int *cbcrOffset)
+{
+    if (format == CAMERA_YUV_420_NV21_ADRENO) {
+        *frameSize = PAD_TO_4K(CEILING32(width) * CEILING32(height)) +
+                     2 * (CEILING32(width/2) * CEILING32(height/2));
+        *cbcrOffset = PAD_TO_4K(CEILING32(width) * CEILING32(height));
+    } else {
+        *frameSize = width * height * 3/2;
+        *cbcrOffset = PAD_TO_WORD(width * height);
+    }
+}
+
 bool QualcommCameraHardware::initPreview()
 {
     LOGV("%s E", __FUNCTION__);
@@ -3014,10 +4135,12 @@ bool QualcommCameraHardware::initPreview()
 
     int cnt = 0;
 
-    mPreviewFrameSize = previewWidth * previewHeight * 3/2;
+    int frameSize, CbCrOffset;
+    preview_frame_layout(previewWidth, previewHeight, mPreviewFormat,
+                         &frameSize, &CbCrOffset);
+    mPreviewFrameSize = frameSize;
     LOGV("mPreviewFrameSize = %d, width = %d, height = %d \n",
         mPreviewFrameSize, previewWidth, previewHeight);
-    int CbCrOffset = PAD_TO_WORD(previewWidth * previewHeight);
 
     //Pass the yuv formats, display dimensions,
     //so that vfe will be initialized accordingly.
@@ -3026,9 +4149,6 @@ bool QualcommCameraHardware::initPreview()
     mDimension.display_chroma_width = previewWidth;
     mDimension.display_chroma_height = previewHeight;
     if(mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO) {
-        mPreviewFrameSize = PAD_TO_4K(CEILING32(previewWidth) * CEILING32(previewHeight)) +
-                                     2 * (CEILING32(previewWidth/2) * CEILING32(previewHeight/2));
-        CbCrOffset = PAD_TO_4K(CEILING32(previewWidth) * CEILING32(previewHeight));
         mDimension.prev_format = CAMERA_YUV_420_NV21_ADRENO;
         mDimension.display_luma_width = CEILING32(previewWidth);
         mDimension.display_luma_height = CEILING32(previewHeight);
@@ -3072,20 +4192,29 @@ bool QualcommCameraHardware::initPreview()
 
     if (mPreviewHeap != NULL) {
         LOGI("%s: Clearing previous mPreviewHeap", __FUNCTION__);
-        mPreviewHeap.clear();
+        recyclePmemPool(mPreviewHeap);
     }
 
     mPrevHeapDeallocRunning = false;
-    mPreviewHeap = new PmemPool(pmem_region,
-                                MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                                mCameraControlFd,
-                                MSM_PMEM_PREVIEW, //MSM_PMEM_OUTPUT2,
-                                mPreviewFrameSize,
-                                kPreviewBufferCountActual,
-                                mPreviewFrameSize,
-                                CbCrOffset,
-                                0,
-                                "preview");
+    if (mPreviewHeapNext != NULL &&
+        mPreviewHeapNext->matches(pmem_region, previewPoolFlags(), MSM_PMEM_PREVIEW,
+                                  mPreviewFrameSize, kPreviewBufferCountActual,
+                                  mPreviewFrameSize, CbCrOffset, 0, "preview")) {
+        mPreviewHeap = mPreviewHeapNext;
+        mPreviewHeapNext.clear();
+        mPreviewHeap->registerBuffers(true);
+    } else {
+        recyclePmemPool(mPreviewHeapNext);
+        mPreviewHeap = getPmemPool(pmem_region,
+                                    previewPoolFlags(),
+                                    MSM_PMEM_PREVIEW, //MSM_PMEM_OUTPUT2,
+                                    mPreviewFrameSize,
+                                    kPreviewBufferCountActual,
+                                    mPreviewFrameSize,
+                                    CbCrOffset,
+                                    0,
+                                    "preview");
+    }
 
     if (!mPreviewHeap->initialized()) {
         mPreviewHeap.clear();
@@ -3143,6 +4272,76 @@ bool QualcommCameraHardware::initPreview()
     return ret;
 }
 
+/* Restarts a running preview at the size and format now in mParameters.
+ * The preview pool for the new layout is allocated, and parked unregistered,
+ * while the old one still streams, so the gap between the last old frame
+ * and the first new one holds only the stop, CAMERA_SET_PARM_DIMENSION and
+ * the restart. libmmcamera's frame loop is bound to the buffers it was
+ * started with, so it is still restarted. Called with mLock held. */
+status_t QualcommCameraHardware::reconfigurePreview()
+{
+    const char *pmem_region;
+    int width, height, frameSize, cbcrOffset;
+
+    if(mCurrentTarget == TARGET_MSM8660)
+        pmem_region = "/dev/pmem_smipool";
+    else
+        pmem_region = "/dev/pmem_adsp";
+
+    mParameters.getPreviewSize(&width, &height);
+    preview_frame_layout(width, height, mPreviewFormat, &frameSize, &cbcrOffset);
+    recyclePmemPool(mPreviewHeapNext);
+    mPreviewHeapNext = getPmemPool(pmem_region,
+                                   previewPoolFlags(),
+                                   MSM_PMEM_PREVIEW,
+                                   frameSize,
+                                   kPreviewBufferCountActual,
+                                   frameSize,
+                                   cbcrOffset,
+                                   0,
+                                   "preview");
+    if (mPreviewHeapNext->initialized()) {
+        mPreviewHeapNext->registerBuffers(false);
+    } else {
+        // initPreview() will try again once the old pool is released
+        LOGE("%s: could not allocate the new preview pool ahead", __FUNCTION__);
+        mPreviewHeapNext.clear();
+    }
+
+    mReconfigLock.lock();
+    nsecs_t lastFrame = mLastPreviewFrameTime;
+    mReconfigLock.unlock();
+    nsecs_t start = systemTime();
+    stopPreviewInternal();
+    if (mCameraRunning) {
+        LOGE("%s: could not stop preview", __FUNCTION__);
+        return UNKNOWN_ERROR;
+    }
+
+    // The window still has the old geometry; no frame is in flight here.
+    if (mUseOverlay) {
+        mOverlayLock.lock();
+        if (mOverlay != NULL)
+            mOverlay->resizeInput(width, height);
+        mOverlayLock.unlock();
+    }
+
+    mReconfigLock.lock();
+    mReconfigGapStart = lastFrame ? lastFrame : start;
+    mReconfigLock.unlock();
+    status_t rc = startPreviewInternal();
+    if (rc != NO_ERROR) {
+        mReconfigLock.lock();
+        mReconfigGapStart = 0;
+        mReconfigLock.unlock();
+        return rc;
+    }
+    mReconfigCount++;
+    LOGI("%s: preview restarted at %dx%d in %lld ms", __FUNCTION__,
+         width, height, ns2ms(systemTime() - start));
+    return NO_ERROR;
+}
+
 void QualcommCameraHardware::deinitPreview(void)
 {
     LOGI("deinitPreview E");
@@ -3196,9 +4395,8 @@ bool QualcommCameraHardware::initRawSnapshot()
        pmem_region = "/dev/pmem_adsp";
 
     //Pmem based pool for Camera Driver
-    mRawSnapShotPmemHeap = new PmemPool(pmem_region,
+    mRawSnapShotPmemHeap = allocPmemPool(pmem_region,
                                     MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                                    mCameraControlFd,
                                     MSM_PMEM_RAW_MAINIMG,
                                     rawSnapshotSize,
                                     1,
@@ -3213,6 +4411,49 @@ bool QualcommCameraHardware::initRawSnapshot()
         LOGE("initRawSnapshot X: error initializing mRawSnapshotHeap");
         return false;
     }
+
+    if (mRawUnpackedHeap != NULL) {
+        mRawUnpackedHeap.clear();
+        mRawUnpackedHeap = NULL;
+    }
+    if (mDngHeap != NULL) {
+        mDngHeap.clear();
+        mDngHeap = NULL;
+    }
+    if (mRawContainer == RAW_CONTAINER_DNG) {
+        // DNG always carries unpacked 16-bit samples, written in place.
+        int dngSize = DNG_HEADER_MAX_SIZE +
+                      (mDimension.raw_picture_width * 4 / 5) *
+                      mDimension.raw_picture_height * sizeof(uint16_t);
+        mDngHeap = new AshmemPool(dngSize,
+                                  1,
+                                  0, // the file size is known after writing
+                                  "raw dng snapshot");
+        if (!mDngHeap->initialized()) {
+            mDngHeap.clear();
+            mDngHeap = NULL;
+            mRawSnapShotPmemHeap.clear();
+            mRawSnapShotPmemHeap = NULL;
+            LOGE("initRawSnapshot X: error initializing mDngHeap");
+            return false;
+        }
+    } else if (mRawFormat == RAW_FORMAT_UNPACKED16) {
+        // raw_picture_width is the packed line length in bytes.
+        int unpackedSize = (mDimension.raw_picture_width * 4 / 5) *
+                           mDimension.raw_picture_height * sizeof(uint16_t);
+        mRawUnpackedHeap = new AshmemPool(unpackedSize,
+                                          1,
+                                          unpackedSize,
+                                          "raw unpacked snapshot");
+        if (!mRawUnpackedHeap->initialized()) {
+            mRawUnpackedHeap.clear();
+            mRawUnpackedHeap = NULL;
+            mRawSnapShotPmemHeap.clear();
+            mRawSnapShotPmemHeap = NULL;
+            LOGE("initRawSnapshot X: error initializing mRawUnpackedHeap");
+            return false;
+        }
+    }
     LOGV("initRawSnapshot X");
     return true;
 
@@ -3374,23 +4615,55 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
     }
     mPmemWaitLock.unlock();
 
+    /* On targets where the postview comes from the VFE second output and
+     * the JPEG thumbnail from the main image, the main image and postview
+     * buffers are carved out of a single pmem region. The main image sits
+     * at offset 0, so the JPEG encoder sees it exactly as before.
+     */
+    int rawArenaSize = PAD_TO_4K(mJpegMaxSize) * kRawBufferCount;
+    mSnapshotArena.clear();
+    if (initJpegHeap &&
+        ((mCurrentTarget == TARGET_MSM7630) || (mCurrentTarget == TARGET_MSM8660))) {
+        int arenaSize = rawArenaSize + PAD_TO_4K(thumbnailBufferSize);
+        mSnapshotArena = allocSnapshotArena(pmem_region, arenaSize);
+        if (mSnapshotArena == NULL) {
+            flushPmemPoolCache();
+            mSnapshotArena = allocSnapshotArena(pmem_region, arenaSize);
+        }
+        if (mSnapshotArena == NULL)
+            LOGE("initRaw: no snapshot arena, using separate pools");
+    }
+
     LOGV("initRaw: initializing mRawHeap.");
-    mRawHeap =
-        new PmemPool(pmem_region,
-                     MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                     mCameraControlFd,
-                     MSM_PMEM_MAINIMG,
-                     mJpegMaxSize,
-                     kRawBufferCount,
-                     mRawSize,
-                     mCbCrOffsetRaw,
-                     yOffset,
-                     "snapshot camera");
+    if (mSnapshotArena != NULL) {
+        mRawHeap =
+            new PmemPool(mSnapshotArena, 0,
+                         mCameraControlFd,
+                         MSM_PMEM_MAINIMG,
+                         mJpegMaxSize,
+                         kRawBufferCount,
+                         mRawSize,
+                         mCbCrOffsetRaw,
+                         yOffset,
+                         "snapshot camera");
+    } else {
+        mRawHeap =
+            allocPmemPool(pmem_region,
+                          MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
+                          MSM_PMEM_MAINIMG,
+                          mJpegMaxSize,
+                          kRawBufferCount,
+                          mRawSize,
+                          mCbCrOffsetRaw,
+                          yOffset,
+                          "snapshot camera");
+    }
 
     if (!mRawHeap->initialized()) {
        LOGE("initRaw X failed ");
        mRawHeap.clear();
        mRawHeap = NULL;
+       mSnapshotArena.clear();
        LOGE("initRaw X: error initializing mRawHeap");
        return false;
     }
@@ -3420,6 +4693,7 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
             mJpegHeap = NULL;
             mRawHeap.clear();
             mRawHeap = NULL;
+            mSnapshotArena.clear();
             LOGE("initRaw X failed: error initializing mJpegHeap.");
             return false;
         }
@@ -3443,17 +4717,29 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
         if (mThumbnailHeap != NULL)
             mThumbnailHeap.clear();
 
-        mThumbnailHeap =
-            new PmemPool(pmem_region,
-                         MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                         mCameraControlFd,
-                         MSM_PMEM_THUMBNAIL,
-                         thumbnailBufferSize,
-                         1,
-                         thumbnailBufferSize,
-                         CbCrOffsetThumb,
-                         yOffsetThumb,
-                         "thumbnail");
+        if (mSnapshotArena != NULL) {
+            mThumbnailHeap =
+                new PmemPool(mSnapshotArena, rawArenaSize,
+                             mCameraControlFd,
+                             MSM_PMEM_THUMBNAIL,
+                             thumbnailBufferSize,
+                             1,
+                             thumbnailBufferSize,
+                             CbCrOffsetThumb,
+                             yOffsetThumb,
+                             "thumbnail");
+        } else {
+            mThumbnailHeap =
+                allocPmemPool(pmem_region,
+                              MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
+                              MSM_PMEM_THUMBNAIL,
+                              thumbnailBufferSize,
+                              1,
+                              thumbnailBufferSize,
+                              CbCrOffsetThumb,
+                              yOffsetThumb,
+                              "thumbnail");
+        }
 
         if (!mThumbnailHeap->initialized()) {
             mThumbnailHeap.clear();
@@ -3462,6 +4748,7 @@ bool QualcommCameraHardware::initRaw(bool initJpegHeap)
             mJpegHeap = NULL;
             mRawHeap.clear();
             mRawHeap = NULL;
+            mSnapshotArena.clear();
             LOGE("initRaw X failed: error initializing mThumbnailHeap.");
             return false;
         }
@@ -3477,6 +4764,10 @@ void QualcommCameraHardware::deinitRawSnapshot()
     LOGV("deinitRawSnapshot E");
     mRawSnapShotPmemHeap.clear();
     mRawSnapShotPmemHeap = NULL;
+    mRawUnpackedHeap.clear();
+    mRawUnpackedHeap = NULL;
+    mDngHeap.clear();
+    mDngHeap = NULL;
     LOGV("deinitRawSnapshot X");
 }
 
@@ -3488,6 +4779,8 @@ void QualcommCameraHardware::deinitRaw()
     mJpegHeap = NULL;
     mRawHeap.clear();
     mRawHeap = NULL;
+    // Pools still carved from the arena keep it alive until they go.
+    mSnapshotArena.clear();
     if(mCurrentTarget != TARGET_MSM8660){
        mThumbnailHeap.clear();
        mThumbnailHeap = NULL;
@@ -3525,6 +4818,7 @@ void QualcommCameraHardware::release()
         stopPreviewInternal();
         LOGI("release: stopPreviewInternal done.");
     }
+    deinitSoftLiveSnapshot();
     LINK_jpeg_encoder_join();
     //Signal the snapshot thread
     mJpegThreadWaitLock.lock();
@@ -3565,11 +4859,13 @@ void QualcommCameraHardware::release()
        mPreviewHeap.clear();
        mPreviewHeap = NULL;
     }
+    mPreviewHeapNext.clear();
     if (mRecordHeap != NULL) {
        LOGV("release: clearing mRecordHeap");
        mRecordHeap.clear();
        mRecordHeap = NULL;
     }
+    flushPmemPoolCache();
     if (mStatHeap != NULL) {
        LOGV("release: clearing mStatHeap");
        mStatHeap.clear();
@@ -3580,8 +4876,19 @@ void QualcommCameraHardware::release()
        mMetaDataHeap.clear();
        mMetaDataHeap = NULL;
     }
+    if (mBracketHeap != NULL) {
+       LOGV("release: clearing mBracketHeap");
+       mBracketHeap.clear();
+       mBracketHeap = NULL;
+    }
 
-    ctrlCmd.timeout_ms = 5000;
+    stopFaceThread();
+    stopHistogramThread();
+    stopSharpnessThread();
+    stopAutoFocusThread();
+    // parm_thread has exited, nothing else is in the driver.
+    stopParmThread();
+    ctrlCmd.timeout_ms = PARM_DRIVER_TIMEOUT_MS;
     ctrlCmd.length = 0;
     ctrlCmd.type = (uint16_t)CAMERA_EXIT;
     ctrlCmd.resp_fd = mCameraControlFd; // FIXME: this will be put in by the kernel
@@ -3611,6 +4918,15 @@ QualcommCameraHardware::~QualcommCameraHardware()
 {
     LOGI("~QualcommCameraHardware E");
 
+    for (int i = 0; i < OPEN_TASK_MAX; i++)
+        joinOpenTask(i);
+    stopFaceThread();
+    stopHistogramThread();
+    stopSharpnessThread();
+    stopAutoFocusThread();
+    stopParmThread();
+    face_cascade_free(mFaceCascade);
+    mFaceCascade = NULL;
     libmmcamera = NULL;
     mMMCameraDLRef.clear();
 
@@ -3630,10 +4946,38 @@ QualcommCameraHardware::~QualcommCameraHardware()
     LOGI("~QualcommCameraHardware X");
 }
 
+/* A view of the part of a snapshot arena one pool was carved from. It
+ * shares the arena mapping and fd, and reports the region's own base,
+ * size and offset, so a client mapping it sees only that pool.
+ */
+class ArenaRegionHeap : public BnMemoryHeap {
+public:
+    ArenaRegionHeap(const sp<MemoryHeapBase>& arena, int offset, int size)
+        : mArena(arena), mOffset(offset), mSize(size) { }
+    virtual int getHeapID() const { return mArena->getHeapID(); }
+    virtual void *getBase() const {
+        return (uint8_t *)mArena->getBase() + mOffset;
+    }
+    virtual size_t getSize() const { return mSize; }
+    virtual uint32_t getFlags() const { return mArena->getFlags(); }
+    virtual uint32_t getOffset() const { return mArena->getOffset() + mOffset; }
+private:
+    sp<MemoryHeapBase> mArena;
+    int mOffset;
+    int mSize;
+};
+
 sp<IMemoryHeap> QualcommCameraHardware::getRawHeap() const
 {
     LOGV("getRawHeap");
-    return mDisplayHeap != NULL ? mDisplayHeap->mHeap : NULL;
+    if (mDisplayHeap == NULL)
+        return NULL;
+    // Pools carved from the snapshot arena share its heap; hand out
+    // only the region of the displayed pool.
+    if (mDisplayHeap->mHeap == mSnapshotArena)
+        return new ArenaRegionHeap(mSnapshotArena, mDisplayHeap->mBaseOffset,
+                                   mDisplayHeap->mAlignedSize);
+    return mDisplayHeap->mHeap;
 }
 
 sp<IMemoryHeap> QualcommCameraHardware::getPreviewHeap() const
@@ -3649,7 +4993,11 @@ status_t QualcommCameraHardware::startPreviewInternal()
         LOGV("startPreview X: preview already running.");
         return NO_ERROR;
     }
+    // Starting the sensor may reset driver side settings.
+    mApplyAllParams = true;
 
+    nsecs_t start = systemTime();
+    int cacheHits = mPmemPoolCacheHits;
     if (!mPreviewInitialized) {
         mLastQueuedFrame = NULL;
         mPreviewInitialized = initPreview();
@@ -3658,16 +5006,17 @@ status_t QualcommCameraHardware::startPreviewInternal()
             return UNKNOWN_ERROR;
         }
     }
+    nsecs_t initDone = systemTime();
 
     {
         Mutex::Autolock cameraRunningLock(&mCameraRunningLock);
         if(( mCurrentTarget != TARGET_MSM7630 ) &&
                 (mCurrentTarget != TARGET_QSD8250) && (mCurrentTarget != TARGET_MSM8660)) {
             LOGV("Calling CAMERA_START_PREVIEW");
-            mCameraRunning = native_start_preview(mCameraControlFd);
+            mCameraRunning = native_ctrl(native_start_preview);
         } else {
             LOGV("Calling CAMERA_START_VIDEO");
-            mCameraRunning = native_start_video(mCameraControlFd);
+            mCameraRunning = native_ctrl(native_start_video);
         }
     }
 
@@ -3688,6 +5037,9 @@ status_t QualcommCameraHardware::startPreviewInternal()
     //Reset the Gps Information
     exif_table_numEntries = 0;
 
+    LOGI("startPreview: initPreview %lld ms, start %lld ms, %d cached pools reused",
+         ns2ms(initDone - start), ns2ms(systemTime() - initDone),
+         mPmemPoolCacheHits - cacheHits);
     LOGV("startPreviewInternal X");
     return NO_ERROR;
 }
@@ -3723,9 +5075,9 @@ void QualcommCameraHardware::stopPreviewInternal()
             if(!camframe_timeout_flag) {
                 if (( mCurrentTarget != TARGET_MSM7630 ) &&
                          (mCurrentTarget != TARGET_QSD8250) && (mCurrentTarget != TARGET_MSM8660))
-                    mCameraRunning = !native_stop_preview(mCameraControlFd);
+                    mCameraRunning = !native_ctrl(native_stop_preview);
                 else
-                    mCameraRunning = !native_stop_video(mCameraControlFd);
+                    mCameraRunning = !native_ctrl(native_stop_video);
             } else {
                 /* This means that the camframetimeout was issued.
                  * But we did not issue native_stop_preview(), so we
@@ -3778,102 +5130,254 @@ void QualcommCameraHardware::stopPreview()
     LOGV("stopPreview: X");
 }
 
+void *sharpness_thread(void *user)
+{
+    LOGV("sharpness_thread E");
+    ((QualcommCameraHardware *)user)->runSharpnessThread();
+    LOGV("sharpness_thread X");
+    return NULL;
+}
+
+void QualcommCameraHardware::runSharpnessThread()
+{
+    mSharpLock.lock();
+    while (true) {
+        while (!mSharpExit && !mSharpQueued)
+            mSharpWait.wait(mSharpLock);
+        if (mSharpExit)
+            break;
+        // mSharpBuf is not touched again before mSharpQueued is cleared.
+        af_sharpness result = mSharpPending;
+        mSharpLock.unlock();
+        nsecs_t start = systemTime();
+        uint64_t sum = tenengrad_sum(mSharpBuf + result.dx + 3, result.dx + 2,
+                                     result.dx, result.dy);
+        result.value = (uint32_t)(sum / ((uint64_t)result.dx * result.dy));
+        nsecs_t elapsed = systemTime() - start;
+        mSharpLock.lock();
+        bool changed = mSharpCount == 0 ||
+            mSharpHistory[(mSharpCount - 1) % AF_SHARPNESS_HISTORY].value != result.value;
+        mSharpHistory[mSharpCount % AF_SHARPNESS_HISTORY] = result;
+        mSharpCount++;
+        mSharpTimeTotal += elapsed;
+        mSharpQueued = false;
+        // getParameters() reports the newest value as af-sharpness.
+        if (changed) {
+            mSharpLock.unlock();
+            notifyParamsChanged();
+            mSharpLock.lock();
+        }
+    }
+    mSharpLock.unlock();
+}
+
+void QualcommCameraHardware::startSharpnessThread()
+{
+    if (mSharpThreadRunning)
+        return;
+    mSharpExit = false;
+    mSharpQueued = false;
+    mSharpThreadRunning =
+        !pthread_create(&mSharpThread, NULL, sharpness_thread, this);
+    if (!mSharpThreadRunning)
+        LOGE("%s: sharpness thread creation failed", __FUNCTION__);
+}
+
+void QualcommCameraHardware::stopSharpnessThread()
+{
+    if (!mSharpThreadRunning)
+        return;
+    mSharpLock.lock();
+    mSharpExit = true;
+    mSharpWait.signal();
+    mSharpLock.unlock();
+    pthread_join(mSharpThread, NULL);
+    mSharpThreadRunning = false;
+    free(mSharpBuf);
+    mSharpBuf = NULL;
+    mSharpBufSize = 0;
+}
+
+// Points the sharpness metric at the first ROI, or the centre without one.
+void QualcommCameraHardware::setSharpnessRoi(const roi_info_t &roi)
+{
+    Mutex::Autolock l(&mSharpLock);
+    if (roi.num_roi > 0) {
+        mSharpRoi[0] = roi.roi[0].x;
+        mSharpRoi[1] = roi.roi[0].y;
+        mSharpRoi[2] = roi.roi[0].dx;
+        mSharpRoi[3] = roi.roi[0].dy;
+    } else {
+        memset(mSharpRoi, 0, sizeof(mSharpRoi));
+    }
+}
+
+// Copies the AF ROI of a preview frame for the sharpness thread, with the
+// border the gradient needs. The ROI is clipped to the frame.
+void QualcommCameraHardware::queueSharpness(const uint8_t *luma, int stride,
+                                            int width, int height,
+                                            nsecs_t timestamp)
+{
+    Mutex::Autolock l(&mSharpLock);
+    if (mSharpQueued) {
+        mSharpDropped++;
+        return;
+    }
+    int x = mSharpRoi[0], y = mSharpRoi[1];
+    int dx = mSharpRoi[2], dy = mSharpRoi[3];
+    if (dx <= 0 || dy <= 0) {
+        dx = width / 2;
+        dy = height / 2;
+        x = (width - dx) / 2;
+        y = (height - dy) / 2;
+    }
+    if (x < 1) x = 1;
+    if (y < 1) y = 1;
+    if (x + dx > width - 1) dx = width - 1 - x;
+    if (y + dy > height - 1) dy = height - 1 - y;
+    if (dx <= 0 || dy <= 0)
+        return;
+
+    int bytes = (dx + 2) * (dy + 2);
+    if (bytes > mSharpBufSize) {
+        free(mSharpBuf);
+        mSharpBuf = (uint8_t *)malloc(bytes);
+        mSharpBufSize = mSharpBuf ? bytes : 0;
+        if (mSharpBuf == NULL) {
+            LOGE("%s: out of memory", __FUNCTION__);
+            return;
+        }
+    }
+    const uint8_t *src = luma + (y - 1) * stride + x - 1;
+    for (int r = 0; r < dy + 2; r++)
+        memcpy(mSharpBuf + r * (dx + 2), src + r * stride, dx + 2);
+
+    mSharpPending.timestamp = timestamp;
+    mSharpPending.x = x;
+    mSharpPending.y = y;
+    mSharpPending.dx = dx;
+    mSharpPending.dy = dy;
+    mSharpPending.value = 0;
+    mSharpQueued = true;
+    mSharpWait.signal();
+}
+
+// Copies up to max of the latest sharpness results, newest first, and
+// returns how many were copied.
+int QualcommCameraHardware::getAfSharpness(af_sharpness *out, int max) const
+{
+    Mutex::Autolock l(&mSharpLock);
+    int n = mSharpCount < AF_SHARPNESS_HISTORY ? mSharpCount : AF_SHARPNESS_HISTORY;
+    if (n > max)
+        n = max;
+    for (int i = 0; i < n; i++)
+        out[i] = mSharpHistory[(mSharpCount - 1 - i) % AF_SHARPNESS_HISTORY];
+    return n;
+}
+
 void QualcommCameraHardware::runAutoFocus()
+{
+    mAfEventLock.lock();
+    while (true) {
+        while (!mAfPending)
+            mAfEvent.wait(mAfEventLock);
+        if (mAfPending & AF_CMD_EXIT)
+            break;
+        // Apply the newest ROI before a pending start so the pass uses it.
+        if (mAfPending & AF_CMD_ROI) {
+            roi_info_t roi = mAfRoi;
+            mAfPending &= ~AF_CMD_ROI;
+            mAfEventLock.unlock();
+            native_set_parm(CAMERA_SET_PARM_AF_ROI, sizeof(roi_info_t), (void *)&roi);
+            mAfEventLock.lock();
+            continue;
+        }
+        mAfPending &= ~AF_CMD_START;
+        mAfCancelled = false;
+        mAfBusy = true;
+        mAfEventLock.unlock();
+        bool superseded = runAutoFocusPass();
+        mAfEventLock.lock();
+        mAfBusy = false;
+        if (superseded)
+            mAfCoalesced++;
+    }
+    mAfEventLock.unlock();
+}
+
+// One autofocus pass. Returns true when a newer start request superseded
+// it; that pass is cancelled and reports no callback of its own.
+bool QualcommCameraHardware::runAutoFocusPass()
 {
     bool status = true;
-    void *libhandle = NULL;
     isp3a_af_mode_t afMode;
     int done=-1;
     int retry_count=0;
     int af_focus_result=0;
+    bool superseded = false;
 
     LOGV("%s E", __FUNCTION__);
-    mAutoFocusThreadLock.lock();
+    sp<param_snapshot> snap = getSnapshot();
     // Skip autofocus if focus mode is infinity.
-    const char * focusMode = mParameters.get(CameraParameters::KEY_FOCUS_MODE);
-    if ((mParameters.get(CameraParameters::KEY_FOCUS_MODE) == 0)
+    const char * focusMode = snap->focusMode;
+    if ((focusMode == 0)
            || (strcmp(focusMode, CameraParameters::FOCUS_MODE_INFINITY) == 0)
            || (strcmp(focusMode, CameraParameters::FOCUS_MODE_CONTINUOUS_VIDEO) == 0)) {
         goto done;
     }
 
-    mAutoFocusFd = open(MSM_CAMERA_CONTROL, O_RDWR);
-    if (mAutoFocusFd < 0) {
-        LOGE("autofocus: cannot open %s: %s",
-             MSM_CAMERA_CONTROL,
-             strerror(errno));
-        mAutoFocusThreadRunning = false;
-        mAutoFocusThreadLock.unlock();
-        return;
-    }
-
-    LOGV("%s, libmmcamera: %p\n", __FUNCTION__, libmmcamera);
-    if(!libmmcamera){
-        LOGE("FATAL ERROR: could not dlopen liboemcamera.so: %s", dlerror());
-        close(mAutoFocusFd);
-        mAutoFocusFd = -1;
-        mAutoFocusThreadRunning = false;
-        mAutoFocusThreadLock.unlock();
-        return;
-    }
-
     afMode = (isp3a_af_mode_t)attr_lookup(focus_modes,
                                 sizeof(focus_modes) / sizeof(str_map),
-                                mParameters.get(CameraParameters::KEY_FOCUS_MODE));
+                                focusMode);
 
     /* This will block until either AF completes or is cancelled. */
     LOGV("af start (fd %d mode %d)", mAutoFocusFd, afMode);
-    status_t err;
-    err = mAfLock.tryLock();
-    if(err == NO_ERROR) {
-        {
-            Mutex::Autolock cameraRunningLock(&mCameraRunningLock);
-            if(mCameraRunning){
-                LOGV("Start AF");
-                status = native_set_afmode(mAutoFocusFd, afMode);
-                do {
-                    usleep(100*1000);
-                    done = getFocusState();
-                    retry_count++;
-                } 
-          while((done != NO_ERROR)&&(retry_count<30));
-
-                if(done==NO_ERROR)
-                {
-                    af_focus_result = getFocusResult();
-                    if(af_focus_result == NO_ERROR){
-                        status = true;
-                        LOGE("getFocusResult - SUCCESS");
-                    }else{
-                      status = false;
-                      LOGE("getFocusResult - FAIL");     
-                    }
+    {
+        Mutex::Autolock cameraRunningLock(&mCameraRunningLock);
+        if(mCameraRunning){
+            LOGV("Start AF");
+            status = native_set_afmode(mAutoFocusFd, afMode);
+            nsecs_t deadline = systemTime() + ms2ns(AF_TIMEOUT_MS);
+            while (waitAfEvent(deadline)) {
+                done = getFocusState();
+                retry_count++;
+                if (done == NO_ERROR)
+                    break;
+            }
+            mAfStateChecks += retry_count;
+
+            if(done==NO_ERROR)
+            {
+                af_focus_result = getFocusResult();
+                if(af_focus_result == NO_ERROR){
+                    status = true;
+                    LOGE("getFocusResult - SUCCESS");
+                }else{
+                  status = false;
+                  LOGE("getFocusResult - FAIL");     
                 }
-                else
-                    status = false;
-            }else{
-                LOGV("As Camera preview is not running, AF not issued");
+            }
+            else {
                 status = false;
+                mAfEventLock.lock();
+                superseded = !mAfCancelled && (mAfPending & AF_CMD_START);
+                mAfEventLock.unlock();
+                if (superseded)
+                    native_cancel_afmode(mCameraControlFd, mAutoFocusFd);
             }
+        }else{
+            LOGV("As Camera preview is not running, AF not issued");
+            status = false;
         }
-        mAfLock.unlock();
-    }
-    else{
-        //AF Cancel would have acquired the lock,
-        //so, no need to perform any AF
-        LOGV("As Cancel auto focus is in progress, auto focus request "
-                "is ignored");
-        status = FALSE;
     }
 
     LOGV("af done: %d", (int)status);
-    close(mAutoFocusFd);
-    mAutoFocusFd = -1;
+    if (superseded) {
+        LOGV("%s: superseded by a newer request", __FUNCTION__);
+        return true;
+    }
 
 done:
-    mAutoFocusThreadRunning = false;
-    mAutoFocusThreadLock.unlock();
-
     mCallbackLock.lock();
     bool autoFocusEnabled = mNotifyCallback && (mMsgEnabled & CAMERA_MSG_FOCUS);
     notify_callback cb = mNotifyCallback;
@@ -3881,35 +5385,127 @@ done:
     mCallbackLock.unlock();
     if (autoFocusEnabled)
         cb(CAMERA_MSG_FOCUS, status, 0, data);
+
+    if (mAfRequestTime != 0) {
+        nsecs_t latency = systemTime() - mAfRequestTime;
+        int bucket = 0;
+        for (nsecs_t limit = ms2ns(50); latency >= limit &&
+                 bucket < AF_LATENCY_BUCKETS - 1; limit *= 2)
+            bucket++;
+        mAfLatencyHist[bucket]++;
+        mAfRequestTime = 0;
+        LOGV("%s: %lld ms to callback, %d focus state checks", __FUNCTION__,
+             ns2ms(latency), retry_count);
+    }
+    return false;
 }
 
-status_t QualcommCameraHardware::updateFocusDistances(const char *focusmode)
+void QualcommCameraHardware::startAutoFocusThread()
 {
-    LOGV("%s: IN", __FUNCTION__);
-    focus_distances_info_t focusDistances;
-    if( mCfgControl.mm_camera_get_parm(CAMERA_PARM_FOCUS_DISTANCES,
-        (void *)&focusDistances) == MM_CAMERA_SUCCESS) {
-        String8 str;
-        char buffer[32];
-        snprintf(buffer, sizeof(buffer), "%f", focusDistances.focus_distance[0]);
-        str.append(buffer);
-        snprintf(buffer, sizeof(buffer), ",%f", focusDistances.focus_distance[1]);
-        str.append(buffer);
-        if(strcmp(focusmode, CameraParameters::FOCUS_MODE_INFINITY) == 0)
-            snprintf(buffer, sizeof(buffer), ",%s", "Infinity");
-        else
-            snprintf(buffer, sizeof(buffer), ",%f", focusDistances.focus_distance[2]);
-        str.append(buffer);
-        LOGI("%s: setting KEY_FOCUS_DISTANCES as %s", __FUNCTION__, str.string());
-        mParameters.set(CameraParameters::KEY_FOCUS_DISTANCES, str.string());
-        return NO_ERROR;
+    if (!mHasAutoFocusSupport || mAutoFocusThreadRunning)
+        return;
+    mAutoFocusFd = open(MSM_CAMERA_CONTROL, O_RDWR);
+    if (mAutoFocusFd < 0) {
+        LOGE("autofocus: cannot open %s: %s",
+             MSM_CAMERA_CONTROL,
+             strerror(errno));
+        return;
     }
-	else
-	{
-        String8 str;
-        char buffer[32];
-
-        sprintf(buffer, "%.2f", 0.95);
+    mAfPending = 0;
+    mAutoFocusThreadRunning =
+        !pthread_create(&mAutoFocusThread, NULL, auto_focus_thread, this);
+    if (!mAutoFocusThreadRunning) {
+        LOGE("failed to start autofocus thread");
+        close(mAutoFocusFd);
+        mAutoFocusFd = -1;
+    }
+}
+
+void QualcommCameraHardware::stopAutoFocusThread()
+{
+    if (!mAutoFocusThreadRunning)
+        return;
+    mAfEventLock.lock();
+    bool busy = mAfBusy;
+    mAfPending = AF_CMD_EXIT;
+    mAfCancelled = true;
+    mAfEvent.broadcast();
+    mAfEventLock.unlock();
+    if (busy)
+        native_cancel_afmode(mCameraControlFd, mAutoFocusFd);
+    pthread_join(mAutoFocusThread, NULL);
+    mAutoFocusThreadRunning = false;
+    close(mAutoFocusFd);
+    mAutoFocusFd = -1;
+}
+
+// Hands the AF ROI to the AF thread; only the newest one is applied.
+void QualcommCameraHardware::queueAutoFocusRoi(const roi_info_t &roi)
+{
+    if (!mAutoFocusThreadRunning) {
+        native_set_parm(CAMERA_SET_PARM_AF_ROI, sizeof(roi_info_t), (void *)&roi);
+        return;
+    }
+    Mutex::Autolock l(&mAfEventLock);
+    if (mAfPending & AF_CMD_ROI)
+        mAfCoalesced++;
+    mAfRoi = roi;
+    mAfPending |= AF_CMD_ROI;
+    mAfEvent.broadcast();
+}
+
+// Waits for the next preview frame, request or cancel, at most
+// AF_POLL_FALLBACK_MS in case frames stop. Returns false once the pass is
+// cancelled or superseded, or past the deadline.
+bool QualcommCameraHardware::waitAfEvent(nsecs_t deadline)
+{
+    Mutex::Autolock l(&mAfEventLock);
+    nsecs_t left = deadline - systemTime();
+    if (mAfCancelled || (mAfPending & (AF_CMD_START | AF_CMD_EXIT)) || left <= 0)
+        return false;
+    if (left > ms2ns(AF_POLL_FALLBACK_MS))
+        left = ms2ns(AF_POLL_FALLBACK_MS);
+    mAfWaiting = true;
+    mAfEvent.waitRelative(mAfEventLock, left);
+    mAfWaiting = false;
+    return !mAfCancelled && !(mAfPending & (AF_CMD_START | AF_CMD_EXIT));
+}
+
+void QualcommCameraHardware::signalAfEvent(bool cancel)
+{
+    Mutex::Autolock l(&mAfEventLock);
+    if (cancel)
+        mAfCancelled = true;
+    mAfEvent.broadcast();
+}
+
+status_t QualcommCameraHardware::updateFocusDistances(const char *focusmode)
+{
+    LOGV("%s: IN", __FUNCTION__);
+    focus_distances_info_t focusDistances;
+    if( mCfgControl.mm_camera_get_parm(CAMERA_PARM_FOCUS_DISTANCES,
+        (void *)&focusDistances) == MM_CAMERA_SUCCESS) {
+        String8 str;
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%f", focusDistances.focus_distance[0]);
+        str.append(buffer);
+        snprintf(buffer, sizeof(buffer), ",%f", focusDistances.focus_distance[1]);
+        str.append(buffer);
+        if(strcmp(focusmode, CameraParameters::FOCUS_MODE_INFINITY) == 0)
+            snprintf(buffer, sizeof(buffer), ",%s", "Infinity");
+        else
+            snprintf(buffer, sizeof(buffer), ",%f", focusDistances.focus_distance[2]);
+        str.append(buffer);
+        LOGI("%s: setting KEY_FOCUS_DISTANCES as %s", __FUNCTION__, str.string());
+        mParameters.set(CameraParameters::KEY_FOCUS_DISTANCES, str.string());
+        return NO_ERROR;
+    }
+	else
+	{
+        String8 str;
+        char buffer[32];
+
+        sprintf(buffer, "%.2f", 0.95);
         str.append(buffer);
         sprintf(buffer, ",%.2f", 1.90);
         str.append(buffer);
@@ -3935,36 +5531,33 @@ status_t QualcommCameraHardware::cancelAutoFocusInternal()
 {
     LOGV("cancelAutoFocusInternal E");
 
-    if(!mHasAutoFocusSupport){
+    if(!mHasAutoFocusSupport || !mAutoFocusThreadRunning){
         LOGV("cancelAutoFocusInternal X");
         return NO_ERROR;
     }
 
-    if (mAutoFocusFd < 0) {
-        LOGV("cancelAutoFocusInternal X: not in progress");
-        return NO_ERROR;
+    // Drop a start the AF thread has not picked up yet, and end a pass in
+    // progress at its next wait.
+    mAfEventLock.lock();
+    mAfPending &= ~AF_CMD_START;
+    bool busy = mAfBusy;
+    if (busy) {
+        mAfCancelled = true;
+        mAfEvent.broadcast();
     }
+    mAfEventLock.unlock();
 
     status_t rc = NO_ERROR;
-    status_t err;
-    err = mAfLock.tryLock();
-    if(err == NO_ERROR) {
-        //Got Lock, means either AF hasn't started or
-        // AF is done. So no need to cancel it, just change the state
-        LOGV("As Auto Focus is not in progress, Cancel Auto Focus "
-                "is ignored");
-        mAfLock.unlock();
-    }
-    else {
-        //AF is in Progess, So cancel it
-        LOGV("Lock busy...cancel AF");
+    if (busy) {
+        LOGV("AF in progress...cancel AF");
         rc = native_cancel_afmode(mCameraControlFd, mAutoFocusFd) ?
                 NO_ERROR :
                 UNKNOWN_ERROR;
+    } else {
+        LOGV("As Auto Focus is not in progress, Cancel Auto Focus "
+                "is ignored");
     }
 
-
-
     LOGV("cancelAutoFocusInternal X: %d", rc);
     return rc;
 }
@@ -3972,11 +5565,7 @@ status_t QualcommCameraHardware::cancelAutoFocusInternal()
 void *auto_focus_thread(void *user)
 {
     LOGV("auto_focus_thread E");
-    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
-    if (obj != 0) {
-        obj->runAutoFocus();
-    }
-    else LOGW("not starting autofocus: the object went away!");
+    ((QualcommCameraHardware *)user)->runAutoFocus();
     LOGV("auto_focus_thread X");
     return NULL;
 }
@@ -3999,38 +5588,37 @@ status_t QualcommCameraHardware::autoFocus()
         return NO_ERROR;
     }
 
-    if (mCameraControlFd < 0) {
-        LOGE("not starting autofocus: main control fd %d", mCameraControlFd);
+    if (mCameraControlFd < 0 || !mAutoFocusThreadRunning) {
+        LOGE("not starting autofocus: main control fd %d, AF thread %d",
+             mCameraControlFd, mAutoFocusThreadRunning);
         return UNKNOWN_ERROR;
     }
 
-    {
-        mAutoFocusThreadLock.lock();
-        if (!mAutoFocusThreadRunning) {
-            if (native_prepare_snapshot(mCameraControlFd) == FALSE) {
-               LOGE("native_prepare_snapshot failed!\n");
-               mAutoFocusThreadLock.unlock();
-               return UNKNOWN_ERROR;
-            } else {
-                mSnapshotPrepare = TRUE;
-            }
+    /* Only autoFocus() queues AF_CMD_START and it runs under mLock, so the
+     * state sampled here still holds once the prepare ioctl returns. The
+     * ioctl is issued without mAfEventLock so frames keep signalling. */
+    mAfEventLock.lock();
+    bool coalesce = mAfPending & AF_CMD_START;
+    bool prepare = !coalesce && !mAfBusy;
+    if (coalesce) {
+        // The AF thread has not picked up the previous start yet.
+        mAfCoalesced++;
+    }
+    mAfEventLock.unlock();
 
-            // Create a detached thread here so that we don't have to wait
-            // for it when we cancel AF.
-            pthread_t thr;
-            pthread_attr_t attr;
-            pthread_attr_init(&attr);
-            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-            mAutoFocusThreadRunning =
-                !pthread_create(&thr, &attr,
-                                auto_focus_thread, NULL);
-            if (!mAutoFocusThreadRunning) {
-                LOGE("failed to start autofocus thread");
-                mAutoFocusThreadLock.unlock();
-                return UNKNOWN_ERROR;
-            }
+    if (prepare) {
+        if (native_ctrl(native_prepare_snapshot) == FALSE) {
+            LOGE("native_prepare_snapshot failed!\n");
+            return UNKNOWN_ERROR;
         }
-        mAutoFocusThreadLock.unlock();
+        mSnapshotPrepare = TRUE;
+        mAfRequestTime = systemTime();
+    }
+
+    if (!coalesce) {
+        Mutex::Autolock afLock(&mAfEventLock);
+        mAfPending |= AF_CMD_START;
+        mAfEvent.broadcast();
     }
 
     LOGV("autoFocus X");
@@ -4051,6 +5639,129 @@ status_t QualcommCameraHardware::cancelAutoFocus()
     return rc;
 }
 
+bool QualcommCameraHardware::setBracketExposure(int numerator)
+{
+    int16_t numerator16 = (int16_t)(numerator & 0x0000ffff);
+    uint16_t denominator16 = EXPOSURE_COMPENSATION_DENOMINATOR;
+    uint32_t value = numerator16 << 16 | denominator16;
+    return native_set_parm(CAMERA_SET_PARM_EXPOSURE_COMPENSATION,
+                           sizeof(value), (void *)&value);
+}
+
+/* Capture all but the last of count frames into mBracketHeap. With
+ * evSteps, each frame gets its own exposure compensation and the last one
+ * is programmed before returning; without, the exposure is left alone.
+ * The last frame is taken through the normal snapshot path and merged in
+ * receiveRawPicture.
+ */
+bool QualcommCameraHardware::captureBracket(int count, const int *evSteps)
+{
+    LOGV("%s E", __FUNCTION__);
+    mBracketCaptured = 0;
+    mBracketStartTime = systemTime();
+
+    int frameSize = mRawHeap->mBufferSize;
+    if (mBracketHeap == NULL || mBracketHeap->mBufferSize != frameSize ||
+        mBracketHeap->mNumBuffers < count - 1) {
+        mBracketHeap.clear();
+        mBracketHeap = new AshmemPool(frameSize,
+                                      count - 1,
+                                      frameSize,
+                                      "bracket");
+        if (!mBracketHeap->initialized()) {
+            // Parked preview pools count against the same memory budget.
+            mBracketHeap.clear();
+            flushPmemPoolCache();
+            mBracketHeap = new AshmemPool(frameSize,
+                                          count - 1,
+                                          frameSize,
+                                          "bracket");
+        }
+        if (!mBracketHeap->initialized()) {
+            mBracketHeap.clear();
+            mBracketHeap = NULL;
+            LOGE("%s: error initializing mBracketHeap", __FUNCTION__);
+            return false;
+        }
+    }
+
+    for (int i = 0; i < count - 1; i++) {
+        if (evSteps != NULL && !setBracketExposure(evSteps[i])) {
+            LOGE("%s: failed to set exposure for frame %d", __FUNCTION__, i);
+            return false;
+        }
+        if (!native_ctrl(native_start_snapshot)) {
+            LOGE("%s: capture of frame %d failed", __FUNCTION__, i);
+            return false;
+        }
+        bool captured = native_get_picture(mCameraControlFd, &mCrop);
+        // Each frame is its own snapshot; the VFE must leave snapshot
+        // mode before it is started again.
+        native_stop_snapshot(mCameraControlFd);
+        if (!captured) {
+            LOGE("%s: capture of frame %d failed", __FUNCTION__, i);
+            return false;
+        }
+        memcpy((uint8_t *)mBracketHeap->mHeap->base() +
+               i * mBracketHeap->mAlignedBufferSize,
+               mRawHeap->mHeap->base(), frameSize);
+        mBracketCaptured++;
+    }
+
+    if (evSteps != NULL && !setBracketExposure(evSteps[count - 1])) {
+        LOGE("%s: failed to set exposure for the last frame", __FUNCTION__);
+        return false;
+    }
+    LOGV("%s X", __FUNCTION__);
+    return true;
+}
+
+/* Merge the captured frames with the one just delivered in mRawHeap. The
+ * frames are walked with the dimensions the VFE wrote them at, so padded
+ * rows and strides line up with the buffer layout.
+ */
+void QualcommCameraHardware::mergeBracket()
+{
+    int width = mDimension.orig_picture_dx, height = mDimension.orig_picture_dy;
+    if (mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO) {
+        width = CEILING32(width);
+        height = CEILING32(height);
+    }
+    if (mRawHeap->mCbCrOffset + width * height / 2 > mRawHeap->mBufferSize) {
+        LOGE("%s: %dx%d does not fit the %d byte frames, not merging",
+             __FUNCTION__, width, height, mRawHeap->mBufferSize);
+        mBracketCaptured = 0;
+        return;
+    }
+
+    fusion_job job;
+    job.dst = (uint8_t *)mRawHeap->mHeap->base();
+    job.numFrames = mBracketCaptured + 1;
+    for (int i = 0; i < mBracketCaptured; i++)
+        job.src[i] = (uint8_t *)mBracketHeap->mHeap->base() +
+                     i * mBracketHeap->mAlignedBufferSize;
+    job.src[mBracketCaptured] = job.dst;
+    job.width = width;
+    job.yOffset = mRawHeap->myOffset;
+    job.cbcrOffset = mRawHeap->mCbCrOffset;
+
+    nsecs_t start = systemTime();
+    int peak = mBracketHeap->mHeap->getSize() + mRawHeap->mHeap->getSize();
+    if (mBracketMerge == BRACKET_MERGE_DENOISE)
+        peak += denoise_frames(&job, height, HAL_WORKER_THREADS);
+    else
+        fuse_exposures(&job, height, HAL_WORKER_THREADS);
+    nsecs_t end = systemTime();
+
+    LOGI("%s: %d frames %dx%d, capture %lld ms, merge %lld ms, "
+         "total %lld ms, peak %d KB",
+         mBracketMerge == BRACKET_MERGE_DENOISE ? "denoise" : "bracket",
+         job.numFrames, width, height,
+         ns2ms(start - mBracketStartTime), ns2ms(end - start),
+         ns2ms(end - mBracketStartTime), peak / 1024);
+    mBracketCaptured = 0;
+}
+
 void QualcommCameraHardware::runSnapshotThread(void *data)
 {
     bool ret = true;
@@ -4062,21 +5773,46 @@ void QualcommCameraHardware::runSnapshotThread(void *data)
         LOGE("FATAL ERROR: could not dlopen liboemcamera.so: %s", dlerror());
     }
 
+    bool bracketing = (mSnapshotFormat == PICTURE_FORMAT_JPEG) &&
+                      (mBracketMode == CAMERA_BRACKETING_EXPOSURE) &&
+                      (mBracketCount > 1);
+    bool denoising = !bracketing &&
+                     (mSnapshotFormat == PICTURE_FORMAT_JPEG) &&
+                     useMultiFrameDenoise();
+    if (bracketing) {
+        mBracketMerge = BRACKET_MERGE_FUSION;
+        if (!captureBracket(mBracketCount, mBracketSteps)) {
+            LOGE("main: exposure bracket capture failed, taking a single frame");
+            mBracketCaptured = 0;
+        }
+    } else if (denoising) {
+        mBracketMerge = BRACKET_MERGE_DENOISE;
+        if (!captureBracket(mDenoiseFrames, NULL)) {
+            LOGE("main: denoise burst capture failed, taking a single frame");
+            mBracketCaptured = 0;
+        }
+    }
+
     if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
-        if (native_start_snapshot(mCameraControlFd))
+        if (native_ctrl(native_start_snapshot))
             ret = receiveRawPicture();
         else {
             LOGE("main: native_start_snapshot failed!");
             ret = false;
         }
     } else if(mSnapshotFormat == PICTURE_FORMAT_RAW){
-        if(native_start_raw_snapshot(mCameraControlFd)){
+        if(native_ctrl(native_start_raw_snapshot)){
             ret = receiveRawSnapshot();
         } else {
             LOGE("main: native_start_raw_snapshot failed!");
             ret = false;
         }
     }
+    if (bracketing) {
+        // Back to the exposure compensation the application asked for.
+        setBracketExposure(getSnapshot()->exposureCompensation);
+    }
+
     mInSnapshotModeWaitLock.lock();
     mInSnapshotMode = false;
     mInSnapshotModeWait.signal();
@@ -4154,16 +5890,14 @@ status_t QualcommCameraHardware::takePicture()
         LOGV("takePicture: old snapshot thread completed.");
     }
     //mSnapshotFormat is protected by mSnapshotThreadWaitLock
-    if(mParameters.getPictureFormat() != 0 &&
-            !strcmp(mParameters.getPictureFormat(),
-                    CameraParameters::PIXEL_FORMAT_RAW))
+    if(getSnapshot()->rawPicture)
         mSnapshotFormat = PICTURE_FORMAT_RAW;
     else
         mSnapshotFormat = PICTURE_FORMAT_JPEG;
 
     if(mSnapshotFormat == PICTURE_FORMAT_JPEG){
         if(!mSnapshotPrepare){
-            if(!native_prepare_snapshot(mCameraControlFd)) {
+            if(!native_ctrl(native_prepare_snapshot)) {
                 mSnapshotThreadWaitLock.unlock();
                 return UNKNOWN_ERROR;
             }
@@ -4218,7 +5952,8 @@ void QualcommCameraHardware::set_liveshot_exifinfo()
 {
     setGpsParameters();
     //set TimeStamp
-    const char *str = mParameters.get(CameraParameters::KEY_EXIF_DATETIME);
+    sp<param_snapshot> snap = getSnapshot();
+    const char *str = snap->dateTime;
     if(str != NULL) {
         strlcpy(dateTime, str, 20);
         addExifTag(EXIFTAGID_EXIF_DATE_TIME_ORIGINAL, EXIF_ASCII,
@@ -4235,9 +5970,35 @@ status_t QualcommCameraHardware::takeLiveSnapshot()
         return NO_ERROR;
     }
 
-    if( (mCurrentTarget != TARGET_MSM7630) && (mCurrentTarget != TARGET_MSM8660)) {
-        LOGI("LiveSnapshot not supported on this target");
-        liveshot_state = LIVESHOT_STOPPED;
+    bool hwLiveShot = (mCurrentTarget == TARGET_MSM7630) ||
+                      (mCurrentTarget == TARGET_MSM8660);
+#if DLOPEN_LIBMMCAMERA
+    hwLiveShot = hwLiveShot && (LINK_set_liveshot_params != NULL);
+#endif
+    if (!hwLiveShot) {
+        /* No VFE liveshot: grab the next video frame and encode it with
+         * the jpeg encoder on a side thread instead. */
+        int width, height, frameSize;
+        if( (mCurrentTarget == TARGET_MSM7630) || (mCurrentTarget == TARGET_QSD8250) ||
+            (mCurrentTarget == TARGET_MSM8660) ) {
+            width = videoWidth;
+            height = videoHeight;
+            frameSize = mRecordFrameSize;
+        } else {
+            width = previewWidth;
+            height = previewHeight;
+            frameSize = mPreviewFrameSize;
+        }
+        liveshot_state = LIVESHOT_IN_PROGRESS;
+        if (!initSoftLiveSnapshot(width, height, frameSize)) {
+            LOGE("takeLiveSnapshot: software liveshot init failed. Not taking Live Snapshot.");
+            liveshot_state = LIVESHOT_STOPPED;
+            return UNKNOWN_ERROR;
+        }
+        mLiveShotThreadWaitLock.lock();
+        mLiveShotPending = true;
+        mLiveShotThreadWaitLock.unlock();
+        LOGV("takeLiveSnapshot: X (software, waiting for next video frame)");
         return NO_ERROR;
     }
 
@@ -4260,7 +6021,7 @@ status_t QualcommCameraHardware::takeLiveSnapshot()
         return NO_ERROR;
     }
 
-    if(!native_start_liveshot(mCameraControlFd)) {
+    if(!native_ctrl(native_start_liveshot)) {
         LOGE("native_start_liveshot failed");
         liveshot_state = LIVESHOT_STOPPED;
         mJpegHeap.clear();
@@ -4301,6 +6062,218 @@ bool QualcommCameraHardware::initLiveSnapshot(int videowidth, int videoheight)
     return true;
 }
 
+bool QualcommCameraHardware::initSoftLiveSnapshot(int width, int height, int frameSize)
+{
+    LOGV("initSoftLiveSnapshot E");
+
+    if (frameSize <= 0) {
+        LOGE("initSoftLiveSnapshot X failed: invalid frame size %d", frameSize);
+        return false;
+    }
+
+    // A previous software liveshot may still be tearing down.
+    mLiveShotThreadWaitLock.lock();
+    while (mLiveShotThreadRunning) {
+        LOGV("initSoftLiveSnapshot: waiting for old liveshot thread to complete.");
+        mLiveShotThreadWait.wait(mLiveShotThreadWaitLock);
+    }
+    mLiveShotThreadWaitLock.unlock();
+
+    if (!initLiveSnapshot(width, height))
+        return false;
+
+    if (mLiveShotHeap == NULL || mLiveShotHeap->mBufferSize != frameSize) {
+        mLiveShotHeap.clear();
+        int CbCrOffset = PAD_TO_WORD(width * height);
+        mLiveShotHeap =
+            allocPmemPool("/dev/pmem_adsp",
+                          MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
+                          MSM_PMEM_MAINIMG,
+                          frameSize,
+                          1,
+                          frameSize,
+                          CbCrOffset,
+                          0,
+                          "liveshot");
+        if (!mLiveShotHeap->initialized()) {
+            mLiveShotHeap.clear();
+            mLiveShotHeap = NULL;
+            mJpegHeap.clear();
+            mJpegHeap = NULL;
+            LOGE("initSoftLiveSnapshot X failed: error initializing mLiveShotHeap.");
+            return false;
+        }
+    }
+    mLiveShotWidth = width;
+    mLiveShotHeight = height;
+
+    LOGV("initSoftLiveSnapshot X");
+    return true;
+}
+
+void QualcommCameraHardware::deinitSoftLiveSnapshot()
+{
+    LOGV("deinitSoftLiveSnapshot E");
+
+    mLiveShotThreadWaitLock.lock();
+    mLiveShotPending = false;
+    while (mLiveShotThreadRunning) {
+        LOGV("deinitSoftLiveSnapshot: waiting for liveshot thread to complete.");
+        mLiveShotThreadWait.wait(mLiveShotThreadWaitLock);
+    }
+    mLiveShotThreadWaitLock.unlock();
+
+    if (mLiveShotHeap != NULL) {
+        mLiveShotHeap.clear();
+        mLiveShotHeap = NULL;
+    }
+    LOGV("deinitSoftLiveSnapshot X");
+}
+
+/* Called from the video (or preview) callback path with the frame that is
+ * about to be handed to the encoder. Frames from the record heap are pinned:
+ * the copy happens on the liveshot thread, and releaseRecordingFrame() leaves
+ * the buffer with us until the copy is done. Preview heap frames are recycled
+ * as soon as the callback returns, so those are copied here (buf != NULL).
+ * Must be called with mLiveShotThreadWaitLock held and mLiveShotPending set.
+ */
+bool QualcommCameraHardware::startLiveShotThread(struct msm_frame *frame,
+                                                 const uint8_t *buf)
+{
+    mLiveShotPending = false;
+    if (mLiveShotHeap == NULL) {
+        LOGE("startLiveShotThread: no liveshot heap");
+        liveshot_state = LIVESHOT_STOPPED;
+        return false;
+    }
+
+    if (buf != NULL) {
+        memcpy(mLiveShotHeap->mHeap->base(), buf, mLiveShotHeap->mFrameSize);
+        mLiveShotFrame = NULL;
+    } else {
+        mLiveShotFrame = frame;
+    }
+    mLiveShotFrameReleased = false;
+
+    pthread_t thr;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    mLiveShotThreadRunning = !pthread_create(&thr, &attr,
+                                             liveshot_thread, NULL);
+    if (!mLiveShotThreadRunning) {
+        LOGE("startLiveShotThread: could not create liveshot thread");
+        mLiveShotFrame = NULL;
+        liveshot_state = LIVESHOT_STOPPED;
+    }
+    return mLiveShotThreadRunning;
+}
+
+void QualcommCameraHardware::runLiveShotThread(void *data)
+{
+    CAMERA_HAL_UNUSED(data);
+    LOGV("runLiveShotThread E");
+    nsecs_t start = systemTime();
+
+    // Take a copy of the pinned record buffer, then hand it back to the
+    // driver if the encoder already released it while we held it.
+    mLiveShotThreadWaitLock.lock();
+    struct msm_frame *frame = mLiveShotFrame;
+    mLiveShotThreadWaitLock.unlock();
+    if (frame != NULL) {
+        memcpy(mLiveShotHeap->mHeap->base(), (uint8_t *)frame->buffer,
+               mLiveShotHeap->mFrameSize);
+
+        mLiveShotThreadWaitLock.lock();
+        bool released = mLiveShotFrameReleased;
+        mLiveShotFrame = NULL;
+        mLiveShotFrameReleased = false;
+        mLiveShotThreadWaitLock.unlock();
+
+        if (released) {
+            mFrameThreadWaitLock.lock();
+            if (mFrameThreadRunning)
+                freeVideoFrame(frame);
+            mFrameThreadWaitLock.unlock();
+        }
+    }
+    nsecs_t copied = systemTime();
+
+    cam_ctrl_dimension_t dimension = mDimension;
+    dimension.picture_width = dimension.orig_picture_dx = mLiveShotWidth;
+    dimension.picture_height = dimension.orig_picture_dy = mLiveShotHeight;
+    dimension.thumbnail_width = dimension.ui_thumbnail_width = 0;
+    dimension.thumbnail_height = dimension.ui_thumbnail_height = 0;
+    dimension.main_img_format = mDimension.enc_format;
+    common_crop_t crop;
+    memset(&crop, 0, sizeof(crop));
+
+    bool encoded = false;
+    mJpegSize = 0;
+    mJpegThreadWaitLock.lock();
+    if (LINK_jpeg_encoder_init()) {
+        mJpegThreadRunning = true;
+        mLiveShotEncoding = true;
+        mJpegThreadWaitLock.unlock();
+
+        int jpeg_quality = getSnapshot()->jpegQuality;
+        if (jpeg_quality <= 0) jpeg_quality = 85;
+        LINK_jpeg_encoder_setMainImageQuality(jpeg_quality);
+        set_liveshot_exifinfo();
+
+        if (LINK_jpeg_encoder_encode(&dimension, NULL, 0,
+                                     (uint8_t *)mLiveShotHeap->mHeap->base(),
+                                     mLiveShotHeap->mHeap->getHeapID(),
+                                     &crop, exif_data, exif_table_numEntries)) {
+            mJpegThreadWaitLock.lock();
+            while (mJpegThreadRunning) {
+                LOGV("runLiveShotThread: waiting for jpeg thread to complete.");
+                mJpegThreadWait.wait(mJpegThreadWaitLock);
+            }
+            mJpegThreadWaitLock.unlock();
+            encoded = true;
+        } else {
+            LOGE("runLiveShotThread: jpeg_encoder_encode failed.");
+            mJpegThreadWaitLock.lock();
+            mJpegThreadRunning = false;
+            mJpegThreadWaitLock.unlock();
+        }
+        LINK_jpeg_encoder_join();
+        mLiveShotEncoding = false;
+    } else {
+        LOGE("runLiveShotThread: jpeg_encoder_init failed.");
+        mJpegThreadWaitLock.unlock();
+    }
+
+    LOGI("runLiveShotThread: %dx%d copy %lld ms, encode %lld ms (%s)",
+         mLiveShotWidth, mLiveShotHeight,
+         ns2ms(copied - start), ns2ms(systemTime() - copied),
+         encoded ? "ok" : "failed");
+
+    exif_table_numEntries = 0;
+    mJpegHeap.clear();
+    mJpegHeap = NULL;
+    liveshot_state = encoded ? LIVESHOT_DONE : LIVESHOT_STOPPED;
+
+    mLiveShotThreadWaitLock.lock();
+    mLiveShotThreadRunning = false;
+    mLiveShotThreadWait.signal();
+    mLiveShotThreadWaitLock.unlock();
+
+    LOGV("runLiveShotThread X");
+}
+
+void *liveshot_thread(void *user)
+{
+    LOGV("liveshot_thread E");
+    sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
+    if (obj != 0) {
+        obj->runLiveShotThread(user);
+    }
+    else LOGW("not starting liveshot thread: the object went away!");
+    LOGV("liveshot_thread X");
+    return NULL;
+}
 
 status_t QualcommCameraHardware::cancelPicture()
 {
@@ -4322,6 +6295,140 @@ status_t QualcommCameraHardware::cancelPicture()
     return rc;
 }
 
+static const char *const preview_size_keys[] = {
+    CameraParameters::KEY_PREVIEW_SIZE, NULL };
+static const char *const record_size_keys[] = {
+    CameraParameters::KEY_VIDEO_SIZE, CameraParameters::KEY_PREVIEW_SIZE, NULL };
+static const char *const picture_size_keys[] = {
+    CameraParameters::KEY_PICTURE_SIZE, NULL };
+static const char *const thumbnail_size_keys[] = {
+    CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH,
+    CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT, NULL };
+static const char *const jpeg_quality_keys[] = {
+    CameraParameters::KEY_JPEG_QUALITY,
+    CameraParameters::KEY_JPEG_THUMBNAIL_QUALITY, NULL };
+static const char *const picture_format_keys[] = {
+    CameraParameters::KEY_PICTURE_FORMAT, NULL };
+static const char *const raw_format_keys[] = {
+    "raw-format", "raw-container", "raw-black-level", NULL };
+static const char *const bracketing_keys[] = {
+    "exposure-bracketing", "exposure-bracketing-steps", NULL };
+static const char *const denoise_keys[] = {
+    "multi-frame-denoise", "multi-frame-denoise-frames", NULL };
+static const char *const preview_format_keys[] = {
+    CameraParameters::KEY_PREVIEW_FORMAT, NULL };
+static const char *const effect_keys[] = {
+    CameraParameters::KEY_EFFECT, CameraParameters::KEY_WHITE_BALANCE, NULL };
+static const char *const gps_keys[] = {
+    CameraParameters::KEY_GPS_LATITUDE, CameraParameters::KEY_GPS_LATITUDE_REF,
+    CameraParameters::KEY_GPS_LONGITUDE, CameraParameters::KEY_GPS_LONGITUDE_REF,
+    CameraParameters::KEY_GPS_ALTITUDE, CameraParameters::KEY_GPS_ALTITUDE_REF,
+    CameraParameters::KEY_GPS_TIMESTAMP, CameraParameters::KEY_GPS_STATUS,
+    CameraParameters::KEY_GPS_PROCESSING_METHOD,
+    CameraParameters::KEY_EXIF_DATETIME, NULL };
+static const char *const rotation_keys[] = {
+    CameraParameters::KEY_ROTATION, NULL };
+static const char *const zoom_keys[] = { "zoom", NULL };
+static const char *const orientation_keys[] = { "orientation", NULL };
+static const char *const sharpness_keys[] = {
+    CameraParameters::KEY_SHARPNESS, NULL };
+static const char *const saturation_keys[] = {
+    CameraParameters::KEY_SATURATION, CameraParameters::KEY_EFFECT, NULL };
+static const char *const continuous_af_keys[] = {
+    CameraParameters::KEY_CONTINUOUS_AF, NULL };
+static const char *const touch_af_aec_keys[] = {
+    CameraParameters::KEY_TOUCH_AF_AEC, "touchAfAec-dx", "touchAfAec-dy",
+    "touch-index-aec", "touch-index-af", NULL };
+static const char *const contrast_keys[] = {
+    CameraParameters::KEY_CONTRAST, CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const str_textures_keys[] = { "strtextures", NULL };
+static const char *const skin_tone_keys[] = { "skinToneEnhancement", NULL };
+static const char *const antibanding_keys[] = {
+    CameraParameters::KEY_ANTIBANDING, NULL };
+static const char *const fps_range_keys[] = {
+    CameraParameters::KEY_PREVIEW_FPS_RANGE, NULL };
+static const char *const frame_rate_keys[] = {
+    CameraParameters::KEY_PREVIEW_FRAME_RATE, CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const frame_rate_mode_keys[] = {
+    "preview-frame-rate-mode", CameraParameters::KEY_PREVIEW_FRAME_RATE,
+    CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const auto_exposure_keys[] = {
+    CameraParameters::KEY_AUTO_EXPOSURE, CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const white_balance_keys[] = {
+    CameraParameters::KEY_WHITE_BALANCE, CameraParameters::KEY_EFFECT,
+    CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const flash_keys[] = {
+    CameraParameters::KEY_FLASH_MODE, CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const focus_mode_keys[] = {
+    CameraParameters::KEY_FOCUS_MODE, CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const brightness_keys[] = {
+    CameraParameters::KEY_BRIGHTNESS, CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const iso_keys[] = {
+    CameraParameters::KEY_ISO_MODE, CameraParameters::KEY_SCENE_MODE, NULL };
+static const char *const scene_detect_keys[] = {
+    CameraParameters::KEY_SCENE_DETECT, NULL };
+static const char *const selectable_zone_af_keys[] = {
+    CameraParameters::KEY_SELECTABLE_ZONE_AF, CameraParameters::KEY_CONTINUOUS_AF,
+    CameraParameters::KEY_FOCUS_MODE, NULL };
+
+/* Parameter handlers in dependency order. A handler lists every key its
+ * result depends on, including keys owned by earlier handlers (record size
+ * follows preview size, white balance and effect gate each other), so each
+ * runs at most once per setParameters. */
+const QualcommCameraHardware::param_handler QualcommCameraHardware::kParamHandlers[] = {
+    { "preview-size", &QualcommCameraHardware::setPreviewSize, preview_size_keys, false },
+    { "video-size", &QualcommCameraHardware::setRecordSize, record_size_keys, false },
+    { "picture-size", &QualcommCameraHardware::setPictureSize, picture_size_keys, false },
+    { "thumbnail-size", &QualcommCameraHardware::setJpegThumbnailSize, thumbnail_size_keys, false },
+    { "jpeg-quality", &QualcommCameraHardware::setJpegQuality, jpeg_quality_keys, false },
+    { "picture-format", &QualcommCameraHardware::setPictureFormat, picture_format_keys, false },
+    { "raw-format", &QualcommCameraHardware::setRawFormat, raw_format_keys, false },
+    { "exposure-bracketing", &QualcommCameraHardware::setExposureBracketing, bracketing_keys, false },
+    { "multi-frame-denoise", &QualcommCameraHardware::setMultiFrameDenoise, denoise_keys, false },
+    { "preview-format", &QualcommCameraHardware::setPreviewFormat, preview_format_keys, false },
+    { "effect", &QualcommCameraHardware::setEffect, effect_keys, false },
+    { "gps", &QualcommCameraHardware::setGpsLocation, gps_keys, false },
+    { "rotation", &QualcommCameraHardware::setRotation, rotation_keys, false },
+    { "zoom", &QualcommCameraHardware::setZoom, zoom_keys, false },
+    { "orientation", &QualcommCameraHardware::setOrientation, orientation_keys, false },
+    { "sharpness", &QualcommCameraHardware::setSharpness, sharpness_keys, false },
+    { "saturation", &QualcommCameraHardware::setSaturation, saturation_keys, false },
+    { "continuous-af", &QualcommCameraHardware::setContinuousAf, continuous_af_keys, false },
+    { "touch-af-aec", &QualcommCameraHardware::setTouchAfAec, touch_af_aec_keys, false },
+    { "scene-detect", &QualcommCameraHardware::setSceneDetect, scene_detect_keys, false },
+    { "contrast", &QualcommCameraHardware::setContrast, contrast_keys, false },
+    { "strtextures", &QualcommCameraHardware::setStrTextures, str_textures_keys, false },
+    { "skin-tone", &QualcommCameraHardware::setSkinToneEnhancement, skin_tone_keys, false },
+    { "antibanding", &QualcommCameraHardware::setAntibanding, antibanding_keys, false },
+    { "fps-range", &QualcommCameraHardware::setPreviewFpsRange, fps_range_keys, false },
+    { "frame-rate", &QualcommCameraHardware::setPreviewFrameRate, frame_rate_keys, true },
+    { "frame-rate-mode", &QualcommCameraHardware::setPreviewFrameRateMode, frame_rate_mode_keys, true },
+    { "auto-exposure", &QualcommCameraHardware::setAutoExposure, auto_exposure_keys, true },
+    { "whitebalance", &QualcommCameraHardware::setWhiteBalance, white_balance_keys, true },
+    { "flash-mode", &QualcommCameraHardware::setFlash, flash_keys, true },
+    { "focus-mode", &QualcommCameraHardware::setFocusMode, focus_mode_keys, true },
+    { "brightness", &QualcommCameraHardware::setBrightness, brightness_keys, true },
+    { "iso", &QualcommCameraHardware::setISOValue, iso_keys, true },
+    //selectableZoneAF needs to be invoked after continuous AF
+    { "selectable-zone-af", &QualcommCameraHardware::setSelectableZoneAf, selectable_zone_af_keys, false },
+};
+#define PARAM_HANDLER_COUNT \
+    (int)(sizeof(QualcommCameraHardware::kParamHandlers) / \
+          sizeof(QualcommCameraHardware::kParamHandlers[0]))
+
+static bool params_changed(const CameraParameters& incoming,
+                           const CameraParameters& applied,
+                           const char *const *keys)
+{
+    for (; *keys != NULL; keys++) {
+        const char *a = incoming.get(*keys);
+        const char *b = applied.get(*keys);
+        if (a != b && (a == NULL || b == NULL || strcmp(a, b)))
+            return true;
+    }
+    return false;
+}
+
 status_t QualcommCameraHardware::setParameters(const CameraParameters& params)
 {
     LOGV("setParameters: E params = %p", &params);
@@ -4329,6 +6436,7 @@ status_t QualcommCameraHardware::setParameters(const CameraParameters& params)
 
     Mutex::Autolock l(&mLock);
     status_t rc, final_rc = NO_ERROR;
+    nsecs_t start = systemTime();
 
     if (mSnapshotThreadRunning) {
         if ((rc = setPreviewSize(params)))  final_rc = rc;
@@ -4336,62 +6444,100 @@ status_t QualcommCameraHardware::setParameters(const CameraParameters& params)
         if ((rc = setPictureSize(params)))  final_rc = rc;
         if ((rc = setJpegThumbnailSize(params))) final_rc = rc;
         if ((rc = setJpegQuality(params)))  final_rc = rc;
+        publishParameters();
         return final_rc;
     }
-#define CHECK_RESULT if (final_rc) { LOGV("Param set error at line %d", __LINE__); final_rc = NO_ERROR; }
-
-    if ((rc = setPreviewSize(params))) final_rc = rc; CHECK_RESULT;
-    if ((rc = setRecordSize(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setPictureSize(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setJpegThumbnailSize(params))) final_rc = rc; CHECK_RESULT;
-    if ((rc = setJpegQuality(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setPictureFormat(params))) final_rc = rc; CHECK_RESULT;
-    if ((rc = setRecordSize(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setPreviewFormat(params)))   final_rc = rc; CHECK_RESULT;
-    if ((rc = setEffect(params)))       final_rc = rc; CHECK_RESULT;
-    if ((rc = setGpsLocation(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setRotation(params)))     final_rc = rc; CHECK_RESULT;
-    if ((rc = setZoom(params)))         final_rc = rc; CHECK_RESULT;
-    if ((rc = setOrientation(params)))  final_rc = rc; CHECK_RESULT;
-    //if ((rc = setLensshadeValue(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setPictureFormat(params))) final_rc = rc; CHECK_RESULT;
-    if ((rc = setSharpness(params)))    final_rc = rc; CHECK_RESULT;
-    if ((rc = setSaturation(params)))   final_rc = rc; CHECK_RESULT;
-    if ((rc = setContinuousAf(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setSelectableZoneAf(params)))   final_rc = rc; CHECK_RESULT;
-    if ((rc = setTouchAfAec(params)))   final_rc = rc; CHECK_RESULT;
-    //if ((rc = setSceneMode(params)))    final_rc = rc; CHECK_RESULT;
-    if ((rc = setContrast(params)))     final_rc = rc; CHECK_RESULT;
-    if ((rc = setRecordSize(params)))  final_rc = rc; CHECK_RESULT;
-    //if ((rc = setSceneDetect(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setStrTextures(params)))   final_rc = rc; CHECK_RESULT;
-    if ((rc = setPreviewFormat(params)))   final_rc = rc; CHECK_RESULT;
-    if ((rc = setSkinToneEnhancement(params)))   final_rc = rc; CHECK_RESULT;
-    if ((rc = setAntibanding(params)))  final_rc = rc; CHECK_RESULT;
-    if ((rc = setPreviewFpsRange(params)))  final_rc = rc; CHECK_RESULT;
 
+    /* The first call, re-applying mParameters itself, and the first call
+     * after preview starts go through every handler; otherwise a handler
+     * runs only if one of its keys differs from the applied value. */
+    bool applyAll = !initdefaultP || &params == &mParameters || mApplyAllParams;
     const char *str = params.get(CameraParameters::KEY_SCENE_MODE);
     int32_t value = attr_lookup(scenemode, sizeof(scenemode) / sizeof(str_map), str);
+    bool bestshotOff = (value != NOT_FOUND) && (value == CAMERA_BESTSHOT_OFF);
+    int applied = 0, skipped = 0, ioctlsSkipped = 0;
+    int oldPreviewWidth = previewWidth, oldPreviewHeight = previewHeight;
+    int oldPreviewFormat = mPreviewFormat;
+    int ioctlsStart = mSetParmCount;
+    // handlerFailed, mParamHandlerIoctls and mParmHandlerFailed are
+    // indexed by handler.
+    COMPILE_TIME_ASSERT_FUNCTION_SCOPE(PARAM_HANDLER_COUNT <= PARAM_HANDLER_MAX);
+    bool handlerFailed[PARAM_HANDLER_MAX];
+    // Handlers record their keys before the batch has been flushed; a
+    // rejected handler gets its old values back so the next call retries.
+    // The same goes for the members a handler compares against to skip its
+    // command. The rest of the handler state, the sizes in mDimension among
+    // it, goes to the driver with startPreview() and not in the batch, so
+    // its handlers cannot be rejected here.
+    CameraParameters before = mParameters;
+    int oldBrightness = mBrightness;
+    int oldSkinTone = mSkinToneEnhancement;
+    int oldHJR = mHJR;
+
+    beginParmBatch();
+    for (int i = 0; i < PARAM_HANDLER_COUNT; i++) {
+        const param_handler *handler = &kParamHandlers[i];
+        if (handler->bestshotOffOnly && !bestshotOff)
+            continue;
+        if (!applyAll && !params_changed(params, mParameters, handler->keys)) {
+            skipped++;
+            ioctlsSkipped += mParamHandlerIoctls[i];
+            continue;
+        }
+        int ioctls = mSetParmCount;
+        mParmHandler = i;
+        if ((rc = (this->*handler->apply)(params)))
+            LOGV("Param set error in %s: %d", handler->name, rc);
+        mParamHandlerIoctls[i] = mSetParmCount - ioctls;
+        applied++;
+    }
+    mParmHandler = -1;
+    int failed = endParmBatch(handlerFailed);
+    for (int i = 0; failed && i < PARAM_HANDLER_COUNT; i++) {
+        if (!handlerFailed[i])
+            continue;
+        LOGE("setParameters: %s rejected by the driver", kParamHandlers[i].name);
+        for (const char *const *key = kParamHandlers[i].keys; *key; key++) {
+            const char *old = before.get(*key);
+            if (old)
+                mParameters.set(*key, old);
+            else
+                mParameters.remove(*key);
+        }
+        if (kParamHandlers[i].apply == &QualcommCameraHardware::setBrightness)
+            mBrightness = oldBrightness;
+        else if (kParamHandlers[i].apply == &QualcommCameraHardware::setSkinToneEnhancement)
+            mSkinToneEnhancement = oldSkinTone;
+        else if (kParamHandlers[i].apply == &QualcommCameraHardware::setISOValue)
+            mHJR = oldHJR;
+    }
+    mApplyAllParams = false;
 
-    if((value != NOT_FOUND) && (value == CAMERA_BESTSHOT_OFF)) {
-        if ((rc = setPreviewFrameRate(params))) final_rc = rc; CHECK_RESULT;
-        if ((rc = setPreviewFrameRateMode(params))) final_rc = rc; CHECK_RESULT;
-        if ((rc = setAutoExposure(params))) final_rc = rc; CHECK_RESULT;
-        //if ((rc = setExposureCompensation(params))) final_rc = rc; CHECK_RESULT;
-        if ((rc = setWhiteBalance(params))) final_rc = rc; CHECK_RESULT;
-        if ((rc = setFlash(params)))        final_rc = rc; CHECK_RESULT;
-        if ((rc = setFocusMode(params)))    final_rc = rc; CHECK_RESULT;
-        if ((rc = setBrightness(params)))   final_rc = rc; CHECK_RESULT;
-        if ((rc = setISOValue(params)))  final_rc = rc; CHECK_RESULT;
+    // A new preview layout takes effect right away rather than on the
+    // application's next stop/start.
+    if (mCameraRunning && mPreviewInitialized && !recordingEnabled() &&
+        (previewWidth != oldPreviewWidth || previewHeight != oldPreviewHeight ||
+         mPreviewFormat != oldPreviewFormat)) {
+        if ((rc = reconfigurePreview()) != NO_ERROR)
+            final_rc = rc;
     }
-    //selectableZoneAF needs to be invoked after continuous AF
-    if ((rc = setSelectableZoneAf(params)))   final_rc = rc; CHECK_RESULT;
+
     if(params.getInt("shutter-sound-enable") == 0){
         mParameters.set("shutter-sound-enable", 0);
     }else{
         mParameters.set("shutter-sound-enable", 1);
 }
 
+    mParamIoctlsIssued += mSetParmCount - ioctlsStart;
+    mParamIoctlsSkipped += ioctlsSkipped;
+    mParamIoctlsFailed += failed;
+    LOGV("setParameters: %d handlers applied, %d skipped, %d ioctls issued "
+         "(%d failed), %d avoided", applied, skipped, mSetParmCount - ioctlsStart,
+         failed, ioctlsSkipped);
+
+    publishParameters();
+    mSetParamsCalls++;
+    mSetParamsTime += systemTime() - start;
     initdefaultP=1;
     LOGV("setParameters: X, ret: %d", final_rc);
     return final_rc;
@@ -4400,7 +6546,60 @@ status_t QualcommCameraHardware::setParameters(const CameraParameters& params)
 CameraParameters QualcommCameraHardware::getParameters() const
 {
     LOGV("getParameters: EX");
-    return mParameters;
+    sp<param_snapshot> snap = getSnapshot();
+    CameraParameters params = snap != NULL ? snap->params : mParameters;
+    // The newest AF metric, read-only, for focus peaking or manual focus.
+    af_sharpness sharp;
+    if (getAfSharpness(&sharp, 1) == 1)
+        params.set("af-sharpness", (int)sharp.value);
+    // The last scene the detector settled on, by its scene-mode name.
+    if (mSceneDetectOn) {
+        int scene = mSceneCurrent;
+        const char *name = CameraParameters::SCENE_MODE_AUTO;
+        for (size_t i = 0; i < sizeof(scenemode) / sizeof(str_map); i++) {
+            if (scenemode[i].val == scene) {
+                name = scenemode[i].desc;
+                break;
+            }
+        }
+        params.set("scene-detected", name);
+    }
+    return params;
+}
+
+// O(1): a reference to the current version, never a copy of it.
+sp<param_snapshot> QualcommCameraHardware::getSnapshot() const
+{
+    Mutex::Autolock l(&mSnapshotLock);
+    return mSnapshot;
+}
+
+// Called by the writers of mParameters, under mLock or before the object
+// is shared, once the new values are complete.
+void QualcommCameraHardware::publishParameters()
+{
+    sp<param_snapshot> snap = new param_snapshot;
+
+    snap->version = ++mSnapshotVersion;
+    snap->params = mParameters;
+    const CameraParameters &params = snap->params;
+    params.getPreviewSize(&snap->previewWidth, &snap->previewHeight);
+    params.getPictureSize(&snap->pictureWidth, &snap->pictureHeight);
+    snap->thumbnailWidth = params.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_WIDTH);
+    snap->thumbnailHeight = params.getInt(CameraParameters::KEY_JPEG_THUMBNAIL_HEIGHT);
+    snap->jpegQuality = params.getInt("jpeg-quality");
+    snap->thumbnailQuality = params.getInt("jpeg-thumbnail-quality");
+    snap->rotation = params.getInt("rotation");
+    snap->exposureCompensation = params.getInt(CameraParameters::KEY_EXPOSURE_COMPENSATION);
+    snap->focalLength = params.getFloat(CameraParameters::KEY_FOCAL_LENGTH);
+    const char *format = params.getPictureFormat();
+    snap->rawPicture = format != NULL &&
+        !strcmp(format, CameraParameters::PIXEL_FORMAT_RAW);
+    snap->focusMode = params.get(CameraParameters::KEY_FOCUS_MODE);
+    snap->dateTime = params.get(CameraParameters::KEY_EXIF_DATETIME);
+
+    Mutex::Autolock l(&mSnapshotLock);
+    mSnapshot = snap;
 }
 
 status_t QualcommCameraHardware::setHistogramOn()
@@ -4413,6 +6612,7 @@ status_t QualcommCameraHardware::setHistogramOn()
         mStatsWaitLock.unlock();
         return NO_ERROR;
      }
+    mStatsFromDriver = false;
 
     if (mStatHeap != NULL) {
         LOGV("setHistogram on: clearing old mStatHeap.");
@@ -4525,15 +6725,13 @@ status_t QualcommCameraHardware::sendCommand(int32_t command, int32_t arg1,
                                         LOGI("face detection support is not available");
                                         return NO_ERROR;
                                    }
-//                                   setFaceDetection("on");
-//                                   return runFaceDetection();
+                                   return setFaceDetection("on");
       case CAMERA_CMD_STOP_FACE_DETECTION:
                                    if(supportsFaceDetection() == false){
                                         LOGI("face detection support is not available");
                                         return NO_ERROR;
                                    }
-//                                  setFaceDetection("off");
-//                                   return runFaceDetection();
+                                   return setFaceDetection("off");
       case CAMERA_CMD_HISTOGRAM_ON:
                                    LOGV("histogram set to on");
                                    return setHistogramOn();
@@ -4781,12 +6979,36 @@ void QualcommCameraHardware::receiveLiveSnapshot(uint32_t jpeg_size)
     LOGV("receiveLiveSnapshot X");
 }
 
+/* Clean a preview or record frame out of the CPU cache as it goes back
+ * to the VFE. Frames of uncached pools are left alone.
+ */
+void QualcommCameraHardware::cleanFrame(struct msm_frame *frame)
+{
+    sp<PmemPool> pools[] = { mPreviewHeap, mRecordHeap };
+    for (unsigned i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        if (pools[i] == NULL || pools[i]->mHeap == NULL || !pools[i]->mCached)
+            continue;
+        ssize_t offset = (ssize_t)frame->buffer - (ssize_t)pools[i]->mHeap->base();
+        if (offset >= 0 && offset < (ssize_t)pools[i]->mHeap->getSize()) {
+            pools[i]->clean(offset / pools[i]->mAlignedBufferSize);
+            return;
+        }
+    }
+}
+
+// Return a frame to the free queue of the VFE.
+void QualcommCameraHardware::freeVideoFrame(struct msm_frame *frame)
+{
+    cleanFrame(frame);
+    LINK_camframe_free_video(frame);
+}
+
 void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
 {
     LOGV("receivePreviewFrame E");
     if (!mCameraRunning) {
         LOGE("ignoring preview callback--camera has been stopped");
-        LINK_camframe_free_video(frame);
+        freeVideoFrame(frame);
         return;
     }
 
@@ -4794,6 +7016,27 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
         debugShowPreviewFPS();
     }
 
+    if (UNLIKELY(mOpenTime != 0)) {
+        LOGI("open to first preview frame %lld ms, %d KB HAL memory live",
+             ns2ms(systemTime() - mOpenTime), mem_account_live() / 1024);
+        mOpenTime = 0;
+    }
+
+    nsecs_t now = systemTime();
+    mReconfigLock.lock();
+    if (UNLIKELY(mReconfigGapStart != 0)) {
+        mReconfigGapLast = now - mReconfigGapStart;
+        if (mReconfigGapLast > mReconfigGapMax)
+            mReconfigGapMax = mReconfigGapLast;
+        mReconfigGapStart = 0;
+        LOGI("preview reconfiguration: %lld ms from the last old frame to the "
+             "first new one", ns2ms(mReconfigGapLast));
+    }
+    mLastPreviewFrameTime = now;
+    mReconfigLock.unlock();
+    if (UNLIKELY(mAfWaiting))
+        signalAfEvent(false);
+
     mCallbackLock.lock();
     int msgEnabled = mMsgEnabled;
     data_callback pcb = mDataCallback;
@@ -4810,6 +7053,34 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
     ssize_t offset_addr =
         (ssize_t)frame->buffer - (ssize_t)mPreviewHeap->mHeap->base();
     ssize_t offset = offset_addr / mPreviewHeap->mAlignedBufferSize;
+    mPreviewHeap->invalidate(offset);
+    if (UNLIKELY(mCacheBenchFrames > 0))
+        benchmarkFrameRead((const uint8_t *)frame->buffer, mPreviewFrameSize,
+                           mPreviewHeap->mCached);
+    if (mSharpThreadRunning && (mSharpEnabled || mAfBusy))
+        queueSharpness((const uint8_t *)frame->buffer,
+                       mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO ?
+                           CEILING32(previewWidth) : previewWidth,
+                       previewWidth, previewHeight,
+                       nsecs_t(frame->ts.tv_sec)*1000000000LL + frame->ts.tv_nsec);
+    if (mHistThreadRunning && mStatsOn == CAMERA_HISTOGRAM_ENABLE &&
+            mSendData && !mStatsFromDriver)
+        queueHistogram((const uint8_t *)frame->buffer,
+                       mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO ?
+                           CEILING32(previewWidth) : previewWidth,
+                       previewWidth, previewHeight);
+    if (mFdThreadRunning && mFaceDetectOn == true)
+        queueFaceDetection((const uint8_t *)frame->buffer,
+                           mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO ?
+                               CEILING32(previewWidth) : previewWidth,
+                           previewWidth, previewHeight);
+    if (mSceneDetectOn)
+        detectScene((const uint8_t *)frame->buffer,
+                    mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO ?
+                        CEILING32(previewWidth) : previewWidth,
+                    previewWidth, previewHeight, frame->cbcr_off,
+                    mPreviewFormat == CAMERA_YUV_420_NV21_ADRENO ?
+                        2 * CEILING32(previewWidth/2) : previewWidth);
 
     common_crop_t *crop = (common_crop_t *) (frame->cropinfo);
 
@@ -4920,6 +7191,11 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
 
     if( (mCurrentTarget != TARGET_MSM7630 ) &&  (mCurrentTarget != TARGET_QSD8250) && (mCurrentTarget != TARGET_MSM8660)) {
         if(rcb != NULL && (msgEnabled & CAMERA_MSG_VIDEO_FRAME)) {
+            mLiveShotThreadWaitLock.lock();
+            if (mLiveShotPending)
+                startLiveShotThread(NULL,
+                    (uint8_t *)mPreviewHeap->mBuffers[offset]->pointer());
+            mLiveShotThreadWaitLock.unlock();
             rcb(timeStamp, CAMERA_MSG_VIDEO_FRAME, mPreviewHeap->mBuffers[offset], rdata);
             Mutex::Autolock rLock(&mRecordFrameLock);
             if (mReleasedRecordingFrame != true) {
@@ -4933,7 +7209,7 @@ void QualcommCameraHardware::receivePreviewFrame(struct msm_frame *frame)
 #if 0
     if ( mCurrentTarget == TARGET_MSM8660 ) {
         mMetaDataWaitLock.lock();
-        if (mFaceDetectOn == true && mSendMetaData == true) {
+        if (mFaceDetectOn == true && mSendMetaData == true && mMetaDataHeap != NULL) {
             mSendMetaData = false;
             fd_roi_t *fd = (fd_roi_t *)(frame->roi_info.info);
             int faces_detected = fd->rect_num;
@@ -4979,6 +7255,17 @@ void QualcommCameraHardware::receiveCameraStats(camstats_type stype, camera_prev
     if(mOverlay == NULL) {
        return;
     }
+    mStatsWaitLock.lock();
+    mStatsFromDriver = true;
+    mStatsWaitLock.unlock();
+    sendStats(histinfo->max_value, (const uint32_t *)histinfo->buffer);
+  //  LOGV("receiveCameraStats X");
+}
+
+// Fills the next mStatHeap buffer with a histogram and sends it, if the
+// client asked for one since the last.
+void QualcommCameraHardware::sendStats(uint32_t maxValue, const uint32_t *bins)
+{
     mCallbackLock.lock();
     int msgEnabled = mMsgEnabled;
     data_callback scb = mDataCallback;
@@ -4989,25 +7276,172 @@ void QualcommCameraHardware::receiveCameraStats(camstats_type stype, camera_prev
       mStatsWaitLock.unlock();
       return;
     }
-    if(!mSendData) {
+    if(!mSendData || mStatHeap == NULL) {
         mStatsWaitLock.unlock();
      } else {
         mSendData = false;
         mCurrent = (mCurrent+1)%3;
+        // setHistogramOff() may drop the heap while the callback runs.
+        sp<AshmemPool> statHeap = mStatHeap;
+        int current = mCurrent;
     // The first element of the array will contain the maximum hist value provided by driver.
-        *(uint32_t *)(mStatHeap->mHeap->base()+ (mStatHeap->mBufferSize * mCurrent)) = histinfo->max_value;
-        memcpy((uint32_t *)((unsigned int)mStatHeap->mHeap->base()+ (mStatHeap->mBufferSize * mCurrent)+ sizeof(int32_t)), (uint32_t *)histinfo->buffer,(sizeof(int32_t) * 256));
+        *(uint32_t *)(statHeap->mHeap->base()+ (statHeap->mBufferSize * current)) = maxValue;
+        memcpy((uint32_t *)((unsigned int)statHeap->mHeap->base()+ (statHeap->mBufferSize * current)+ sizeof(int32_t)), bins,(sizeof(int32_t) * 256));
 
         mStatsWaitLock.unlock();
 
         if (scb != NULL && (msgEnabled & CAMERA_MSG_STATS_DATA))
-            scb(CAMERA_MSG_STATS_DATA, mStatHeap->mBuffers[mCurrent],
+            scb(CAMERA_MSG_STATS_DATA, statHeap->mBuffers[current],
                 sdata);
      }
-  //  LOGV("receiveCameraStats X");
 }
 
-bool QualcommCameraHardware::initRecord()
+/* Adds every step-th sample of each row to the 256 bin histogram. Four
+ * partial histograms take consecutive samples so that runs of equal values
+ * do not serialise on one counter; with NEON the samples of a 2 or 4 step
+ * come out of one de-interleaving load.
+ */
+static void histogram_rows(const uint8_t *src, int stride, int width, int rows,
+                           int step, uint32_t *bins)
+{
+    uint32_t part[4][256];
+    memset(part, 0, sizeof(part));
+
+    for (int y = 0; y < rows; y++) {
+        const uint8_t *p = src + y * stride;
+        int x = 0;
+#ifdef HAL_USE_NEON
+        if (step == 2 || step == 4) {
+            for (; x + 16 * step <= width; x += 16 * step) {
+                uint8x16_t v = step == 2 ? vld2q_u8(p + x).val[0] : vld4q_u8(p + x).val[0];
+                uint8_t lane[16];
+                vst1q_u8(lane, v);
+                for (int i = 0; i < 16; i += 4) {
+                    part[0][lane[i]]++;
+                    part[1][lane[i + 1]]++;
+                    part[2][lane[i + 2]]++;
+                    part[3][lane[i + 3]]++;
+                }
+            }
+        }
+#endif
+        for (; x + 4 * step <= width; x += 4 * step) {
+            part[0][p[x]]++;
+            part[1][p[x + step]]++;
+            part[2][p[x + 2 * step]]++;
+            part[3][p[x + 3 * step]]++;
+        }
+        for (; x < width; x += step)
+            part[0][p[x]]++;
+    }
+    for (int i = 0; i < 256; i++)
+        bins[i] = part[0][i] + part[1][i] + part[2][i] + part[3][i];
+}
+
+void *histogram_thread(void *user)
+{
+    LOGV("histogram_thread E");
+    ((QualcommCameraHardware *)user)->runHistogramThread();
+    LOGV("histogram_thread X");
+    return NULL;
+}
+
+void QualcommCameraHardware::runHistogramThread()
+{
+    uint32_t bins[256];
+
+    mHistLock.lock();
+    while (true) {
+        while (!mHistExit && !mHistQueued)
+            mHistWait.wait(mHistLock);
+        if (mHistExit)
+            break;
+        // mHistBuf is not touched again before mHistQueued is cleared.
+        int width = mHistWidth, rows = mHistRows, step = mHistStep;
+        mHistLock.unlock();
+        nsecs_t start = systemTime();
+        histogram_rows(mHistBuf, width, width, rows, step, bins);
+        uint32_t maxValue = 0;
+        for (int i = 0; i < 256; i++)
+            if (bins[i] > maxValue)
+                maxValue = bins[i];
+        nsecs_t elapsed = systemTime() - start;
+        mStatsWaitLock.lock();
+        bool fromDriver = mStatsFromDriver;
+        mStatsWaitLock.unlock();
+        if (!fromDriver)
+            sendStats(maxValue, bins);
+        mHistLock.lock();
+        mHistFrames++;
+        mHistTimeTotal += elapsed;
+        mHistQueued = false;
+    }
+    mHistLock.unlock();
+}
+
+void QualcommCameraHardware::startHistogramThread()
+{
+    if (mHistThreadRunning)
+        return;
+    mHistExit = false;
+    mHistQueued = false;
+    mHistThreadRunning =
+        !pthread_create(&mHistThread, NULL, histogram_thread, this);
+    if (!mHistThreadRunning)
+        LOGE("%s: histogram thread creation failed", __FUNCTION__);
+}
+
+void QualcommCameraHardware::stopHistogramThread()
+{
+    if (!mHistThreadRunning)
+        return;
+    mHistLock.lock();
+    mHistExit = true;
+    mHistWait.signal();
+    mHistLock.unlock();
+    pthread_join(mHistThread, NULL);
+    mHistThreadRunning = false;
+    free(mHistBuf);
+    mHistBuf = NULL;
+    mHistBufSize = 0;
+}
+
+// Copies every step-th luma row of a preview frame for the histogram
+// thread. The step is the smallest of 1, 2, 4 and 8 that keeps the samples
+// within HISTOGRAM_SAMPLE_BUDGET, so the cost per frame is bounded for
+// every preview size.
+void QualcommCameraHardware::queueHistogram(const uint8_t *luma, int stride,
+                                            int width, int height)
+{
+    Mutex::Autolock l(&mHistLock);
+    if (mHistQueued) {
+        mHistDropped++;
+        return;
+    }
+    int step = 1;
+    while (step < 8 && (width / step) * (height / step) > HISTOGRAM_SAMPLE_BUDGET)
+        step *= 2;
+    int rows = (height + step - 1) / step;
+    int bytes = width * rows;
+    if (bytes > mHistBufSize) {
+        free(mHistBuf);
+        mHistBuf = (uint8_t *)malloc(bytes);
+        mHistBufSize = mHistBuf ? bytes : 0;
+        if (mHistBuf == NULL) {
+            LOGE("%s: out of memory", __FUNCTION__);
+            return;
+        }
+    }
+    for (int r = 0; r < rows; r++)
+        memcpy(mHistBuf + r * width, luma + r * step * stride, width);
+    mHistWidth = width;
+    mHistRows = rows;
+    mHistStep = step;
+    mHistQueued = true;
+    mHistWait.signal();
+}
+
+bool QualcommCameraHardware::initRecord()
 {
     const char *pmem_region;
     int CbCrOffset;
@@ -5053,12 +7487,11 @@ bool QualcommCameraHardware::initRecord()
 
     if (mRecordHeap != NULL) {
         LOGI("%s: Clearing previous mPreviewHeap", __FUNCTION__);
-        mRecordHeap.clear();
+        recyclePmemPool(mRecordHeap);
     }
 
-    mRecordHeap = new PmemPool(pmem_region,
-                               MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-                                mCameraControlFd,
+    mRecordHeap = getPmemPool(pmem_region,
+                               previewPoolFlags(),
                                 MSM_PMEM_VIDEO,
                                 recordBufferSize,
                                 kRecordBufferCount,
@@ -5103,10 +7536,10 @@ bool QualcommCameraHardware::initRecord()
     if(mVpeEnabled) {
         //If VPE is enabled, the VPE buffer shouldn't be added to Free Q initally.
         for(int i=ACTIVE_VIDEO_BUFFERS+1;i <kRecordBufferCount-1; i++)
-            LINK_camframe_free_video(&recordframes[i]);
+            freeVideoFrame(&recordframes[i]);
     } else {
         for(int i=ACTIVE_VIDEO_BUFFERS+1;i <kRecordBufferCount; i++)
-            LINK_camframe_free_video(&recordframes[i]);
+            freeVideoFrame(&recordframes[i]);
     }
     LOGV("initRecord X");
 
@@ -5186,7 +7619,7 @@ status_t QualcommCameraHardware::startRecording()
         }
         if( ( mCurrentTarget == TARGET_MSM7630 ) || (mCurrentTarget == TARGET_QSD8250) || (mCurrentTarget == TARGET_MSM8660))  {
             LOGV(" in startREcording : calling native_start_recording");
-            native_start_recording(mCameraControlFd);
+            native_ctrl(native_start_recording);
             recordingState = 1;
             // Remove the left out frames in busy Q and them in free Q.
             // this should be done before starting video_thread so that,
@@ -5194,7 +7627,7 @@ status_t QualcommCameraHardware::startRecording()
             LOGV("frames in busy Q = %d", g_busy_frame_queue.num_of_frames);
             while((g_busy_frame_queue.num_of_frames) >0){
                 msm_frame* vframe = cam_frame_get_video ();
-                LINK_camframe_free_video(vframe);
+                freeVideoFrame(vframe);
             }
             LOGV("frames in busy Q = %d after deQueing", g_busy_frame_queue.num_of_frames);
 
@@ -5202,7 +7635,7 @@ status_t QualcommCameraHardware::startRecording()
             for(int cnt = 0; cnt < kRecordBufferCount; cnt++) {
                 if(record_buffers_tracking_flag[cnt] == true) {
                     LOGI("Dangling buffer: offset = %d, buffer = %d", cnt, (unsigned int)recordframes[cnt].buffer);
-                    LINK_camframe_free_video(&recordframes[cnt]);
+                    freeVideoFrame(&recordframes[cnt]);
                     record_buffers_tracking_flag[cnt] = false;
                 }
             }
@@ -5229,6 +7662,7 @@ void QualcommCameraHardware::stopRecording()
 {
     LOGV("stopRecording: E");
     Mutex::Autolock l(&mLock);
+    deinitSoftLiveSnapshot();
     {
         mRecordFrameLock.lock();
         mReleasedRecordingFrame = true;
@@ -5246,7 +7680,7 @@ void QualcommCameraHardware::stopRecording()
         mVideoThreadWaitLock.lock();
         mVideoThreadExit = 1;
         mVideoThreadWaitLock.unlock();
-        native_stop_recording(mCameraControlFd);
+        native_ctrl(native_stop_recording);
 
         pthread_mutex_lock(&(g_busy_frame_queue.mut));
         pthread_cond_signal(&(g_busy_frame_queue.wait));
@@ -5293,7 +7727,15 @@ void QualcommCameraHardware::releaseRecordingFrame(
             if(mFrameThreadRunning ) {
                 //Reset the track flag for this frame buffer
                 record_buffers_tracking_flag[cnt] = false;
-                LINK_camframe_free_video(releaseframe);
+                // A buffer pinned for live snapshot is returned by the
+                // liveshot thread once it has been copied.
+                mLiveShotThreadWaitLock.lock();
+                bool pinned = (mLiveShotFrame == releaseframe);
+                if (pinned)
+                    mLiveShotFrameReleased = true;
+                mLiveShotThreadWaitLock.unlock();
+                if (!pinned)
+                    freeVideoFrame(releaseframe);
             }
 
             mFrameThreadWaitLock.unlock();
@@ -5314,6 +7756,18 @@ bool QualcommCameraHardware::recordingEnabled()
     return mCameraRunning && mDataCallbackTimestamp && (mMsgEnabled & CAMERA_MSG_VIDEO_FRAME);
 }
 
+// For values getParameters() reports that change on their own; see
+// CAMERA_MSG_PARAMS_CHANGED.
+void QualcommCameraHardware::notifyParamsChanged()
+{
+    mCallbackLock.lock();
+    notify_callback cb = mNotifyCallback;
+    void *data = mCallbackCookie;
+    mCallbackLock.unlock();
+    if (cb)
+        cb(CAMERA_MSG_PARAMS_CHANGED, 0, 0, data);
+}
+
 void QualcommCameraHardware::notifyShutter(common_crop_t *crop, bool mPlayShutterSoundOnly)
 {
     LOGV("%s E", __FUNCTION__);
@@ -5402,10 +7856,9 @@ void QualcommCameraHardware::notifyShutter(common_crop_t *crop, bool mPlayShutte
 
         //For streaming textures, we need to pass the main image in all the cases.
         if(strTexturesOn == true) {
-            int rawWidth, rawHeight;
-            mParameters.getPictureSize(&rawWidth, &rawHeight);
-            size.width = rawWidth;
-            size.height = rawHeight;
+            sp<param_snapshot> snap = getSnapshot();
+            size.width = snap->pictureWidth;
+            size.height = snap->pictureHeight;
             mDisplayHeap = mRawHeap;
         }
 
@@ -5431,6 +7884,236 @@ static void receive_shutter_callback(common_crop_t *crop)
     LOGV("receive_shutter_callback: X");
 }
 
+/* Minimal little-endian TIFF/DNG writer. Entries must be added in
+ * ascending tag order; values that do not fit in the 4-byte entry field
+ * go to a data area that follows the IFD. The pixel strip is placed after
+ * that, so the caller can write the pixels in place.
+ */
+#define DNG_MAX_ENTRIES 40
+#define DNG_MAX_DATA 1024
+#define DNG_HEADER_ALIGN 64
+
+enum {
+    TIFF_BYTE = 1, TIFF_ASCII = 2, TIFF_SHORT = 3, TIFF_LONG = 4,
+    TIFF_RATIONAL = 5, TIFF_SRATIONAL = 10
+};
+
+struct dng_entry {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    uint32_t value;    // inline value, or offset into the data area
+    bool inData;
+};
+
+struct dng_ifd {
+    dng_entry entries[DNG_MAX_ENTRIES];
+    int numEntries;
+    uint8_t data[DNG_MAX_DATA];
+    uint32_t dataSize;
+};
+
+static int dng_type_size(uint16_t type)
+{
+    switch (type) {
+        case TIFF_SHORT: return 2;
+        case TIFF_LONG: return 4;
+        case TIFF_RATIONAL:
+        case TIFF_SRATIONAL: return 8;
+        default: return 1;
+    }
+}
+
+static bool dng_add(dng_ifd *ifd, uint16_t tag, uint16_t type,
+                    uint32_t count, const void *value)
+{
+    if (ifd->numEntries >= DNG_MAX_ENTRIES) {
+        LOGE("dng_add: too many entries, dropping tag %d", tag);
+        return false;
+    }
+    dng_entry *e = &ifd->entries[ifd->numEntries];
+    uint32_t size = count * dng_type_size(type);
+    e->tag = tag;
+    e->type = type;
+    e->count = count;
+    e->value = 0;
+    e->inData = size > 4;
+    if (!e->inData) {
+        memcpy(&e->value, value, size);
+    } else {
+        uint32_t offset = (ifd->dataSize + 1) & ~1;
+        if (offset + size > DNG_MAX_DATA) {
+            LOGE("dng_add: data area full, dropping tag %d", tag);
+            return false;
+        }
+        memcpy(ifd->data + offset, value, size);
+        e->value = offset;
+        ifd->dataSize = offset + size;
+    }
+    ifd->numEntries++;
+    return true;
+}
+
+static bool dng_add_short(dng_ifd *ifd, uint16_t tag, uint16_t value)
+{
+    return dng_add(ifd, tag, TIFF_SHORT, 1, &value);
+}
+
+static bool dng_add_long(dng_ifd *ifd, uint16_t tag, uint32_t value)
+{
+    return dng_add(ifd, tag, TIFF_LONG, 1, &value);
+}
+
+static bool dng_add_ascii(dng_ifd *ifd, uint16_t tag, const char *str)
+{
+    return dng_add(ifd, tag, TIFF_ASCII, strlen(str) + 1, str);
+}
+
+// Bytes an IFD and its data area take, padded so the next IFD starts on a
+// word boundary.
+static uint32_t dng_ifd_size(const dng_ifd *ifd)
+{
+    return 2 + ifd->numEntries * 12 + 4 + ((ifd->dataSize + 1) & ~1);
+}
+
+/* The header is the main IFD, then the EXIF IFD it points to through tag
+ * 34665, if any, each followed by its data area.
+ */
+static uint32_t dng_header_size(const dng_ifd *ifd, const dng_ifd *exif)
+{
+    uint32_t size = 8 + dng_ifd_size(ifd) + (exif != NULL ? dng_ifd_size(exif) : 0);
+    return (size + DNG_HEADER_ALIGN - 1) & ~(DNG_HEADER_ALIGN - 1);
+}
+
+static uint32_t dng_exif_offset(const dng_ifd *ifd)
+{
+    return 8 + dng_ifd_size(ifd);
+}
+
+static void dng_write_ifd(const dng_ifd *ifd, uint8_t *out, uint32_t offset)
+{
+    uint32_t dataStart = offset + 2 + ifd->numEntries * 12 + 4;
+    uint16_t n = ifd->numEntries;
+    uint32_t nextIfd = 0;
+
+    memcpy(out + offset, &n, 2);
+    uint8_t *p = out + offset + 2;
+    for (int i = 0; i < n; i++, p += 12) {
+        const dng_entry *e = &ifd->entries[i];
+        uint32_t value = e->inData ? dataStart + e->value : e->value;
+        memcpy(p, &e->tag, 2);
+        memcpy(p + 2, &e->type, 2);
+        memcpy(p + 4, &e->count, 4);
+        memcpy(p + 8, &value, 4);
+    }
+    memcpy(p, &nextIfd, 4);
+    memcpy(out + dataStart, ifd->data, ifd->dataSize);
+}
+
+static void dng_write_header(const dng_ifd *ifd, const dng_ifd *exif,
+                             uint8_t *out)
+{
+    uint32_t ifdOffset = 8;
+
+    memset(out, 0, dng_header_size(ifd, exif));
+    memcpy(out, "II*", 4);
+    memcpy(out + 4, &ifdOffset, 4);
+    dng_write_ifd(ifd, out, ifdOffset);
+    if (exif != NULL)
+        dng_write_ifd(exif, out, dng_exif_offset(ifd));
+}
+
+/* Single-scale exposure fusion of YUV420 semi-planar frames. Each pixel
+ * is weighted by how well exposed its luma is, using a parabola around
+ * mid-grey (1..257) that the NEON path can evaluate exactly. Chroma
+ * samples take the weight of the co-sited luma pixel, so the chroma pass
+ * must run before the luma pass when the output aliases an input.
+ */
+static inline uint32_t fusion_weight(uint8_t y)
+{
+    int d = (int)y - 128;
+    return 257 - ((d * d) >> 6);
+}
+
+static void fusion_luma_rows(void *ctx, int rowStart, int rowEnd)
+{
+    fusion_job *job = (fusion_job *)ctx;
+    const int n = job->numFrames;
+
+    for (int y = rowStart; y < rowEnd; y++) {
+        int line = job->yOffset + y * job->width;
+        uint8_t *out = job->dst + line;
+        int x = 0;
+#ifdef HAL_USE_NEON
+        const uint16x8_t vMax = vdupq_n_u16(257);
+        const uint8x8_t vMid = vdup_n_u8(128);
+        for (; x + 8 <= job->width; x += 8) {
+            uint16x8_t sumW = vdupq_n_u16(0);
+            uint32x4_t sumLo = vdupq_n_u32(0), sumHi = vdupq_n_u32(0);
+            for (int i = 0; i < n; i++) {
+                uint8x8_t p = vld1_u8(job->src[i] + line + x);
+                int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(p, vMid));
+                uint16x8_t d2 = vshrq_n_u16(vreinterpretq_u16_s16(vmulq_s16(d, d)), 6);
+                uint16x8_t w = vsubq_u16(vMax, d2);
+                uint16x8_t p16 = vmovl_u8(p);
+                sumW = vaddq_u16(sumW, w);
+                sumLo = vmlal_u16(sumLo, vget_low_u16(w), vget_low_u16(p16));
+                sumHi = vmlal_u16(sumHi, vget_high_u16(w), vget_high_u16(p16));
+            }
+            float32x4_t wLo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(sumW)));
+            float32x4_t wHi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(sumW)));
+            float32x4_t rLo = vrecpeq_f32(wLo);
+            float32x4_t rHi = vrecpeq_f32(wHi);
+            rLo = vmulq_f32(rLo, vrecpsq_f32(wLo, rLo));
+            rHi = vmulq_f32(rHi, vrecpsq_f32(wHi, rHi));
+            float32x4_t half = vdupq_n_f32(0.5f);
+            uint32x4_t oLo = vcvtq_u32_f32(vmlaq_f32(half, vcvtq_f32_u32(sumLo), rLo));
+            uint32x4_t oHi = vcvtq_u32_f32(vmlaq_f32(half, vcvtq_f32_u32(sumHi), rHi));
+            uint16x8_t o16 = vcombine_u16(vqmovn_u32(oLo), vqmovn_u32(oHi));
+            vst1_u8(out + x, vqmovn_u16(o16));
+        }
+#endif
+        for (; x < job->width; x++) {
+            uint32_t sumW = 0, sum = 0;
+            for (int i = 0; i < n; i++) {
+                uint8_t p = job->src[i][line + x];
+                uint32_t w = fusion_weight(p);
+                sumW += w;
+                sum += w * p;
+            }
+            out[x] = (sum + sumW / 2) / sumW;
+        }
+    }
+}
+
+static void fusion_chroma_rows(void *ctx, int rowStart, int rowEnd)
+{
+    fusion_job *job = (fusion_job *)ctx;
+    const int n = job->numFrames;
+
+    for (int y = rowStart; y < rowEnd; y++) {
+        int cline = job->cbcrOffset + y * job->width;
+        int yline = job->yOffset + 2 * y * job->width;
+        for (int x = 0; x + 1 < job->width; x += 2) {
+            uint32_t sumW = 0, sumV = 0, sumU = 0;
+            for (int i = 0; i < n; i++) {
+                uint32_t w = fusion_weight(job->src[i][yline + x]);
+                sumW += w;
+                sumV += w * job->src[i][cline + x];
+                sumU += w * job->src[i][cline + x + 1];
+            }
+            job->dst[cline + x] = (sumV + sumW / 2) / sumW;
+            job->dst[cline + x + 1] = (sumU + sumW / 2) / sumW;
+        }
+    }
+}
+
+static void fuse_exposures(fusion_job *job, int height, int numThreads)
+{
+    run_stripes(fusion_chroma_rows, job, height / 2, numThreads);
+    run_stripes(fusion_luma_rows, job, height, numThreads);
+}
+
 // Crop the picture in place.
 static void crop_yuv420(uint32_t width, uint32_t height,
                  uint32_t cropped_width, uint32_t cropped_height,
@@ -5546,6 +8229,136 @@ static void crop_yuv420(uint32_t width, uint32_t height,
     }
 }
 
+/* Wrap the raw snapshot in a DNG. The header goes at the start of
+ * mDngHeap and the sensor data is unpacked straight from the raw pmem
+ * heap into the strip that follows it. Returns the file size, 0 on error.
+ */
+uint32_t QualcommCameraHardware::writeDngSnapshot()
+{
+    LOGV("%s E", __FUNCTION__);
+    uint32_t width = mDimension.raw_picture_width * 4 / 5;
+    uint32_t height = mDimension.raw_picture_height;
+    uint32_t stripSize = width * height * sizeof(uint16_t);
+    dng_ifd *ifd = new dng_ifd[2];
+    dng_ifd *exif = ifd + 1;
+    memset(ifd, 0, 2 * sizeof(*ifd));
+
+    // CFAPattern colours are 0 red, 1 green, 2 blue, in raster order.
+    char value[PROPERTY_VALUE_MAX];
+    int bayer = sensorType != NULL ? sensorType->bayerOrder : CAMERA_BAYER_RGGB;
+    property_get("persist.camera.hal.bayer", value, "");
+    if (value[0] != '\0') {
+        int order = attr_lookup(bayer_orders,
+                                sizeof(bayer_orders) / sizeof(str_map), value);
+        if (order != NOT_FOUND)
+            bayer = order;
+    }
+    uint8_t cfaPattern[4] = { 0, 1, 1, 2 };
+    switch (bayer) {
+        case CAMERA_BAYER_BGGR: memcpy(cfaPattern, "\2\1\1\0", 4); break;
+        case CAMERA_BAYER_GRBG: memcpy(cfaPattern, "\1\0\2\1", 4); break;
+        case CAMERA_BAYER_GBRG: memcpy(cfaPattern, "\1\2\0\1", 4); break;
+    }
+    static const uint16_t cfaDim[2] = { 2, 2 };
+    static const uint8_t dngVersion[4] = { 1, 3, 0, 0 };
+    static const uint8_t dngBackwardVersion[4] = { 1, 1, 0, 0 };
+    // No per-sensor calibration is available; identity matrix, neutral WB.
+    static const int32_t colorMatrix[18] = { 1, 1, 0, 1, 0, 1,
+                                             0, 1, 1, 1, 0, 1,
+                                             0, 1, 0, 1, 1, 1 };
+    static const uint32_t asShotNeutral[6] = { 1, 1, 1, 1, 1, 1 };
+
+    // Active area: the largest snapshot size the sensor supports, centred.
+    uint32_t cropW = width, cropH = height;
+    if (sensorType != NULL) {
+        if ((uint32_t)sensorType->max_supported_snapshot_width < width)
+            cropW = sensorType->max_supported_snapshot_width;
+        if ((uint32_t)sensorType->max_supported_snapshot_height < height)
+            cropH = sensorType->max_supported_snapshot_height;
+    }
+    uint32_t cropOrigin[2] = { (width - cropW) / 2, (height - cropH) / 2 };
+    uint32_t cropSize[2] = { cropW, cropH };
+
+    sp<param_snapshot> snap = getSnapshot();
+    uint16_t orientation = 1;
+    switch (snap->rotation) {
+        case 90: orientation = 6; break;
+        case 180: orientation = 3; break;
+        case 270: orientation = 8; break;
+    }
+
+    const char *dt = snap->dateTime;
+    char dateTimeStr[20];
+    if (dt != NULL) {
+        strlcpy(dateTimeStr, dt, sizeof(dateTimeStr));
+    } else {
+        time_t now = time(NULL);
+        strftime(dateTimeStr, sizeof(dateTimeStr), "%Y:%m:%d %H:%M:%S",
+                 localtime(&now));
+    }
+    int focalLengthValue = (int) (snap->focalLength * FOCAL_LENGTH_DECIMAL_PRECISON);
+    uint32_t focal[2] = { (uint32_t)focalLengthValue, FOCAL_LENGTH_DECIMAL_PRECISON };
+    uint16_t bitsPerSample = 16;
+    uint16_t black = mRawBlackLevel;
+
+    dng_add_long(ifd, 254, 0);                            // NewSubFileType
+    dng_add_long(ifd, 256, width);                        // ImageWidth
+    dng_add_long(ifd, 257, height);                       // ImageLength
+    dng_add(ifd, 258, TIFF_SHORT, 1, &bitsPerSample);     // BitsPerSample
+    dng_add_short(ifd, 259, 1);                           // Compression
+    dng_add_short(ifd, 262, 32803);                       // PhotometricInterpretation: CFA
+    dng_add_ascii(ifd, 271, "Qualcomm");                  // Make
+    dng_add_ascii(ifd, 272, mSensorInfo.name);            // Model
+    int stripOffsetsEntry = ifd->numEntries;
+    dng_add_long(ifd, 273, 0);                            // StripOffsets, patched below
+    dng_add_short(ifd, 274, orientation);                 // Orientation
+    dng_add_short(ifd, 277, 1);                           // SamplesPerPixel
+    dng_add_long(ifd, 278, height);                       // RowsPerStrip
+    dng_add_long(ifd, 279, stripSize);                    // StripByteCounts
+    dng_add_short(ifd, 284, 1);                           // PlanarConfiguration
+    dng_add_ascii(ifd, 305, "QualcommCameraHardware");    // Software
+    dng_add_ascii(ifd, 306, dateTimeStr);                 // DateTime
+    dng_add(ifd, 33421, TIFF_SHORT, 2, cfaDim);           // CFARepeatPatternDim
+    dng_add(ifd, 33422, TIFF_BYTE, 4, cfaPattern);        // CFAPattern
+    int exifEntry = ifd->numEntries;
+    dng_add_long(ifd, 34665, 0);                          // ExifIFD, patched below
+    dng_add(ifd, 50706, TIFF_BYTE, 4, dngVersion);        // DNGVersion
+    dng_add(ifd, 50707, TIFF_BYTE, 4, dngBackwardVersion);// DNGBackwardVersion
+    dng_add_ascii(ifd, 50708, mSensorInfo.name);          // UniqueCameraModel
+    dng_add_long(ifd, 50714, 0);                          // BlackLevel, already subtracted
+    dng_add_long(ifd, 50717, RAW_WHITE_LEVEL - black);    // WhiteLevel
+    dng_add(ifd, 50719, TIFF_LONG, 2, cropOrigin);        // DefaultCropOrigin
+    dng_add(ifd, 50720, TIFF_LONG, 2, cropSize);          // DefaultCropSize
+    dng_add(ifd, 50721, TIFF_SRATIONAL, 9, colorMatrix);  // ColorMatrix1
+    dng_add(ifd, 50728, TIFF_RATIONAL, 3, asShotNeutral); // AsShotNeutral
+
+    dng_add_ascii(exif, 36867, dateTimeStr);              // DateTimeOriginal
+    dng_add(exif, 37386, TIFF_RATIONAL, 1, focal);        // FocalLength
+
+    uint32_t headerSize = dng_header_size(ifd, exif);
+    ifd->entries[stripOffsetsEntry].value = headerSize;
+    ifd->entries[exifEntry].value = dng_exif_offset(ifd);
+    if (headerSize + stripSize > (uint32_t)mDngHeap->mBufferSize) {
+        LOGE("%s: dng of %d bytes does not fit in %d", __FUNCTION__,
+             headerSize + stripSize, mDngHeap->mBufferSize);
+        delete[] ifd;
+        return 0;
+    }
+
+    uint8_t *out = (uint8_t *)mDngHeap->mHeap->base();
+    dng_write_header(ifd, exif, out);
+    delete[] ifd;
+
+    nsecs_t start = systemTime();
+    unpack_mipi10((uint8_t *)mRawSnapShotPmemHeap->mHeap->base(),
+                  (uint16_t *)(out + headerSize),
+                  mDimension.raw_picture_width, width, height,
+                  black, HAL_WORKER_THREADS);
+    LOGI("%s: %dx%d, header %d bytes, pixels in %lld ms", __FUNCTION__,
+         width, height, headerSize, ns2ms(systemTime() - start));
+    return headerSize + stripSize;
+}
+
 bool QualcommCameraHardware::receiveRawSnapshot(){
     LOGV("receiveRawSnapshot E");
 
@@ -5567,8 +8380,27 @@ bool QualcommCameraHardware::receiveRawSnapshot(){
          */
         notifyShutter(&mCrop, FALSE);
 
+        sp<MemoryBase> rawBuffer = mRawSnapShotPmemHeap->mBuffers[0];
+        if (mDngHeap != NULL) {
+            uint32_t dngSize = writeDngSnapshot();
+            if (dngSize > 0)
+                rawBuffer = new MemoryBase(mDngHeap->mHeap, 0, dngSize);
+        } else if (mRawUnpackedHeap != NULL) {
+            int stride = mDimension.raw_picture_width;
+            nsecs_t start = systemTime();
+            unpack_mipi10((uint8_t *)mRawSnapShotPmemHeap->mHeap->base(),
+                          (uint16_t *)mRawUnpackedHeap->mHeap->base(),
+                          stride, stride * 4 / 5,
+                          mDimension.raw_picture_height,
+                          mRawBlackLevel, HAL_WORKER_THREADS);
+            LOGI("receiveRawSnapshot: unpacked %dx%d in %lld ms",
+                 stride * 4 / 5, mDimension.raw_picture_height,
+                 ns2ms(systemTime() - start));
+            rawBuffer = mRawUnpackedHeap->mBuffers[0];
+        }
+
         if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE))
-           mDataCallback(CAMERA_MSG_COMPRESSED_IMAGE, mRawSnapShotPmemHeap->mBuffers[0],
+           mDataCallback(CAMERA_MSG_COMPRESSED_IMAGE, rawBuffer,
                 mCallbackCookie);
 
     }
@@ -5591,6 +8423,8 @@ bool QualcommCameraHardware::receiveRawPicture()
             return false;
         }
         mSnapshotDone = FALSE;
+        if (mBracketCaptured > 0)
+            mergeBracket();
         mCrop.in1_w &= ~1;
         mCrop.in1_h &= ~1;
         mCrop.in2_w &= ~1;
@@ -5620,7 +8454,8 @@ bool QualcommCameraHardware::receiveRawPicture()
                     //is used for postview rather than for thumbnail. (thumbnail is generated from main image).
                     //overlay's setCrop will take of cropping while displaying postview.
                     crop_yuv420(mCrop.out1_w, mCrop.out1_h, (mCrop.in1_w + jpegPadding), (mCrop.in1_h + jpegPadding),
-                            (uint8_t *)mThumbnailHeap->mHeap->base(), mThumbnailHeap->mName);
+                            (uint8_t *)mThumbnailHeap->mHeap->base() + mThumbnailHeap->mBaseOffset,
+                            mThumbnailHeap->mName);
                 }
             }
 
@@ -5674,7 +8509,7 @@ bool QualcommCameraHardware::receiveRawPicture()
             }
 
             LOGV(" Queueing Postview for display ");
-            mOverlay->queueBuffer((void *)0);
+            mOverlay->queueBuffer((void *)mDisplayHeap->mBaseOffset);
             }
             mOverlayLock.unlock();
         }
@@ -5743,7 +8578,16 @@ void QualcommCameraHardware::receiveJpegPicture(void)
 
     int index = 0;
 
-    if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
+    if (mLiveShotEncoding) {
+        if (mDataCallback && (mMsgEnabled & MEDIA_RECORDER_MSG_COMPRESSED_IMAGE)) {
+            sp<MemoryBase> buffer = new
+                MemoryBase(mJpegHeap->mHeap, 0, mJpegSize);
+            mDataCallback(MEDIA_RECORDER_MSG_COMPRESSED_IMAGE, buffer, mCallbackCookie);
+            buffer = NULL;
+        }
+        else LOGV("Liveshot callback was cancelled--not delivering image.");
+    }
+    else if (mDataCallback && (mMsgEnabled & CAMERA_MSG_COMPRESSED_IMAGE)) {
         // The reason we do not allocate into mJpegHeap->mBuffers[offset] is
         // that the JPEG image's size will probably change from one snapshot
         // to the next, so we cannot reuse the MemoryBase object.
@@ -6387,87 +9231,319 @@ status_t QualcommCameraHardware::setSelectableZoneAf(const CameraParameters& par
 
 status_t QualcommCameraHardware::setTouchAfAec(const CameraParameters& params)
 {
+    int xAec, yAec, xAf, yAf;
+
+    params.getTouchIndexAec(&xAec, &yAec);
+    params.getTouchIndexAf(&xAf, &yAf);
+    const char *str = params.get(CameraParameters::KEY_TOUCH_AF_AEC);
+    int value = NOT_FOUND;
+    if (str != NULL)
+        value = attr_lookup(touchafaec, sizeof(touchafaec) / sizeof(str_map), str);
+    if (value == NOT_FOUND) {
+        // Only sensors that take the touch ROI ever checked the key.
+        if (!mHasAutoFocusSupport || !strcmp(sensorType->name, "5mp_triumph"))
+            return NO_ERROR;
+        LOGE("Invalid Touch AF/AEC value: %s", (str == NULL) ? "NULL" : str);
+        return BAD_VALUE;
+    }
+
+    //Dx,Dy will be same as defined in res/layout/camera.xml
+    //passed down to HAL in a key.value pair.
+
+    int FOCUS_RECTANGLE_DX = params.getInt("touchAfAec-dx");
+    int FOCUS_RECTANGLE_DY = params.getInt("touchAfAec-dy");
+
+    cam_set_aec_roi_t aec_roi_value;
+    roi_info_t af_roi_value;
+
+    memset(&af_roi_value, 0, sizeof(roi_info_t));
+
+    //If touch AF/AEC is enabled and touch event has occured then
+    //call the ioctl with valid values.
+
+    if (value == true 
+            && (xAec >= 0 && yAec >= 0)
+            && (xAf >= 0 && yAf >= 0)) {
+        //Set Touch AEC params (Pass the center co-ordinate)
+        aec_roi_value.aec_roi_enable = AEC_ROI_ON;
+        aec_roi_value.aec_roi_type = AEC_ROI_BY_COORDINATE;
+        aec_roi_value.aec_roi_position.coordinate.x = xAec;
+        aec_roi_value.aec_roi_position.coordinate.y = yAec;
+
+        //Set Touch AF params (Pass the top left co-ordinate)
+        af_roi_value.num_roi = 1;
+        if ((xAf-(FOCUS_RECTANGLE_DX/2)) < 0)
+            af_roi_value.roi[0].x = 1;
+        else
+            af_roi_value.roi[0].x = xAf - (FOCUS_RECTANGLE_DX/2);
+
+        if ((yAf-(FOCUS_RECTANGLE_DY/2)) < 0)
+            af_roi_value.roi[0].y = 1;
+        else
+            af_roi_value.roi[0].y = yAf - (FOCUS_RECTANGLE_DY/2);
+
+        af_roi_value.roi[0].dx = FOCUS_RECTANGLE_DX;
+        af_roi_value.roi[0].dy = FOCUS_RECTANGLE_DY;
+    }
+    else {
+        //Set Touch AEC params
+        aec_roi_value.aec_roi_enable = AEC_ROI_OFF;
+        aec_roi_value.aec_roi_type = AEC_ROI_BY_COORDINATE;
+        aec_roi_value.aec_roi_position.coordinate.x = DONT_CARE_COORDINATE;
+        aec_roi_value.aec_roi_position.coordinate.y = DONT_CARE_COORDINATE;
+
+        //Set Touch AF params
+        af_roi_value.num_roi = 0;
+        af_roi_value.roi[0].x =270;
+        af_roi_value.roi[0].y =190;
+        af_roi_value.roi[0].dx = 100;
+        af_roi_value.roi[0].dy = 100;
+    }
+    // The software sharpness metric follows the touch on every sensor,
+    // whether or not the driver takes the ROI.
+    setSharpnessRoi(af_roi_value);
+
     /* Don't know the AEC_ROI_* values */
     if((!strcmp(sensorType->name, "5mp_triumph"))) {
         LOGI("Parameter TouchAfAec is not supported for this sensor");
         return NO_ERROR;
     }
     if(mHasAutoFocusSupport){
-        int xAec, yAec, xAf, yAf;
+        mParameters.set(CameraParameters::KEY_TOUCH_AF_AEC, str);
+        mParameters.setTouchIndexAec(xAec, yAec);
+        mParameters.setTouchIndexAf(xAf, yAf);
+        native_set_parm(CAMERA_SET_PARM_AEC_ROI, sizeof(cam_set_aec_roi_t), (void *)&aec_roi_value);
+        queueAutoFocusRoi(af_roi_value);
+    }
+    return NO_ERROR;
+}
 
-        params.getTouchIndexAec(&xAec, &yAec);
-        params.getTouchIndexAf(&xAf, &yAf);
-        const char *str = params.get(CameraParameters::KEY_TOUCH_AF_AEC);
+// Where the build installs the cascade made by tools/face_cascade_convert
+#define FACE_CASCADE_PATH       "/system/etc/camera/face_cascade.bin"
 
-        if (str != NULL) {
-            int value = attr_lookup(touchafaec,
-                    sizeof(touchafaec) / sizeof(str_map), str);
-            if (value != NOT_FOUND) {
+void *face_thread(void *user)
+{
+    LOGV("face_thread E");
+    ((QualcommCameraHardware *)user)->runFaceThread();
+    LOGV("face_thread X");
+    return NULL;
+}
 
-                //Dx,Dy will be same as defined in res/layout/camera.xml
-                //passed down to HAL in a key.value pair.
-
-                int FOCUS_RECTANGLE_DX = params.getInt("touchAfAec-dx");
-                int FOCUS_RECTANGLE_DY = params.getInt("touchAfAec-dy");
-                mParameters.set(CameraParameters::KEY_TOUCH_AF_AEC, str);
-                mParameters.setTouchIndexAec(xAec, yAec);
-                mParameters.setTouchIndexAf(xAf, yAf);
-
-                cam_set_aec_roi_t aec_roi_value;
-                roi_info_t af_roi_value;
-
-                memset(&af_roi_value, 0, sizeof(roi_info_t));
-
-                //If touch AF/AEC is enabled and touch event has occured then
-                //call the ioctl with valid values.
-
-                if (value == true 
-                        && (xAec >= 0 && yAec >= 0)
-                        && (xAf >= 0 && yAf >= 0)) {
-                    //Set Touch AEC params (Pass the center co-ordinate)
-                    aec_roi_value.aec_roi_enable = AEC_ROI_ON;
-                    aec_roi_value.aec_roi_type = AEC_ROI_BY_COORDINATE;
-                    aec_roi_value.aec_roi_position.coordinate.x = xAec;
-                    aec_roi_value.aec_roi_position.coordinate.y = yAec;
-
-                    //Set Touch AF params (Pass the top left co-ordinate)
-                    af_roi_value.num_roi = 1;
-                    if ((xAf-(FOCUS_RECTANGLE_DX/2)) < 0)
-                        af_roi_value.roi[0].x = 1;
-                    else
-                        af_roi_value.roi[0].x = xAf - (FOCUS_RECTANGLE_DX/2);
-
-                    if ((yAf-(FOCUS_RECTANGLE_DY/2)) < 0)
-                        af_roi_value.roi[0].y = 1;
-                    else
-                        af_roi_value.roi[0].y = yAf - (FOCUS_RECTANGLE_DY/2);
-
-                    af_roi_value.roi[0].dx = FOCUS_RECTANGLE_DX;
-                    af_roi_value.roi[0].dy = FOCUS_RECTANGLE_DY;
-                }
-                else {
-                    //Set Touch AEC params
-                    aec_roi_value.aec_roi_enable = AEC_ROI_OFF;
-                    aec_roi_value.aec_roi_type = AEC_ROI_BY_COORDINATE;
-                    aec_roi_value.aec_roi_position.coordinate.x = DONT_CARE_COORDINATE;
-                    aec_roi_value.aec_roi_position.coordinate.y = DONT_CARE_COORDINATE;
-
-                    //Set Touch AF params
-                    af_roi_value.num_roi = 0;
-                    af_roi_value.roi[0].x =270;
-                    af_roi_value.roi[0].y =190;
-                    af_roi_value.roi[0].dx = 100;
-                    af_roi_value.roi[0].dy = 100;
-                }
-                native_set_parm(CAMERA_SET_PARM_AEC_ROI, sizeof(cam_set_aec_roi_t), (void *)&aec_roi_value);
-                native_set_parm(CAMERA_SET_PARM_AF_ROI, sizeof(roi_info_t), (void*)&af_roi_value);
+void QualcommCameraHardware::runFaceThread()
+{
+    uint8_t *work = NULL;
+    int workSize = 0;
+
+    mFdLock.lock();
+    while (true) {
+        while (!mFdExit && !mFdQueued)
+            mFdWait.wait(mFdLock);
+        if (mFdExit)
+            break;
+        // mFdBuf is not touched again before mFdQueued is cleared.
+        int width = mFdWidth, height = mFdHeight;
+        nsecs_t queued = mFdQueuedTime;
+        mFdLock.unlock();
+
+        nsecs_t start = systemTime();
+        int bw = width / 4, bh = height / 4;
+        int need = bw * bh + face_scratch_size(bw, bh);
+        if (need > workSize) {
+            free(work);
+            work = (uint8_t *)malloc(need);
+            workSize = work ? need : 0;
+        }
+        int rects[FACE_METADATA_FACES * 4];
+        int scores[FACE_METADATA_FACES];
+        int ids[FACE_METADATA_FACES];
+        int n = 0;
+        if (work != NULL) {
+            face_downscale_base(mFdBuf, width, bw, bh, work);
+            n = face_detect(mFaceCascade, work, bw, bh, work + bw * bh,
+                            rects, scores, FACE_METADATA_FACES);
+            for (int i = 0; i < n * 4; i++)
+                rects[i] *= 4;
+        } else {
+            LOGE("%s: out of memory", __FUNCTION__);
+        }
+        trackFaces(rects, n, ids);
+        sendFaces(rects, scores, ids, n);
+        nsecs_t end = systemTime();
+
+        mFdLock.lock();
+        nsecs_t elapsed = end - start;
+        mFdNextTime = start + elapsed * 100 / mFdBudget;
+        mFdFrames++;
+        mFdFaces += n;
+        mFdLastFaces = n;
+        mFdTimeTotal += elapsed;
+        if (elapsed > mFdTimeMax)
+            mFdTimeMax = elapsed;
+        mFdLatencyTotal += end - queued;
+        mFdQueued = false;
+    }
+    mFdLock.unlock();
+    free(work);
+}
+
+void QualcommCameraHardware::startFaceThread()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    if (mFdThreadRunning)
+        return;
+    if (mFaceCascade == NULL) {
+        property_get("persist.camera.hal.fdcascade", value, FACE_CASCADE_PATH);
+        mFaceCascade = face_cascade_load(value);
+        if (mFaceCascade == NULL)
+            return;
+    }
+    property_get("persist.camera.hal.fdbudget", value, "25");
+    mFdBudget = atoi(value);
+    if (mFdBudget < 1 || mFdBudget > 100)
+        mFdBudget = 25;
+    mFdExit = false;
+    mFdQueued = false;
+    mFdThreadRunning =
+        !pthread_create(&mFdThread, NULL, face_thread, this);
+    if (!mFdThreadRunning)
+        LOGE("%s: face detection thread creation failed", __FUNCTION__);
+}
+
+void QualcommCameraHardware::stopFaceThread()
+{
+    if (!mFdThreadRunning)
+        return;
+    mFdLock.lock();
+    mFdExit = true;
+    mFdWait.signal();
+    mFdLock.unlock();
+    pthread_join(mFdThread, NULL);
+    mFdThreadRunning = false;
+    free(mFdBuf);
+    mFdBuf = NULL;
+    mFdBufSize = 0;
+}
+
+// Copies rows 4k+1 and 4k+2 of the preview luma for the face thread, unless
+// the thread is busy or the CPU budget says to skip this frame.
+void QualcommCameraHardware::queueFaceDetection(const uint8_t *luma, int stride,
+                                                int width, int height)
+{
+    Mutex::Autolock l(&mFdLock);
+    nsecs_t now = systemTime();
+    if (mFdQueued || now < mFdNextTime) {
+        mFdSkipped++;
+        return;
+    }
+    int rows = height / 4;
+    int bytes = width * rows * 2;
+    if (bytes > mFdBufSize) {
+        free(mFdBuf);
+        mFdBuf = (uint8_t *)malloc(bytes);
+        mFdBufSize = mFdBuf ? bytes : 0;
+        if (mFdBuf == NULL) {
+            LOGE("%s: out of memory", __FUNCTION__);
+            return;
+        }
+    }
+    for (int r = 0; r < rows; r++) {
+        memcpy(mFdBuf + 2 * r * width, luma + (4 * r + 1) * stride, width);
+        memcpy(mFdBuf + (2 * r + 1) * width, luma + (4 * r + 2) * stride, width);
+    }
+    if (mFdStartTime == 0)
+        mFdStartTime = now;
+    mFdWidth = width;
+    mFdHeight = height;
+    mFdQueuedTime = now;
+    mFdQueued = true;
+    mFdWait.signal();
+}
+
+/* Gives each face the id of the face of the previous result whose
+ * rectangle holds its centre, or a new one. Runs on the face thread only.
+ */
+void QualcommCameraHardware::trackFaces(const int *rects, int count, int *ids)
+{
+    bool taken[FACE_METADATA_FACES];
+    memset(taken, 0, sizeof(taken));
+    for (int i = 0; i < count; i++) {
+        int cx = rects[4 * i] + rects[4 * i + 2] / 2;
+        int cy = rects[4 * i + 1] + rects[4 * i + 3] / 2;
+        ids[i] = 0;
+        for (int j = 0; j < FACE_METADATA_FACES; j++) {
+            const int *prev = mFdPrevRects + 4 * j;
+            if (!taken[j] && mFdPrevIds[j] &&
+                    cx >= prev[0] && cx < prev[0] + prev[2] &&
+                    cy >= prev[1] && cy < prev[1] + prev[3]) {
+                ids[i] = mFdPrevIds[j];
+                taken[j] = true;
+                break;
             }
-            return NO_ERROR;
         }
-        LOGE("Invalid Touch AF/AEC value: %s", (str == NULL) ? "NULL" : str);
-        return BAD_VALUE;
+        if (ids[i] == 0) {
+            ids[i] = mFdNextId;
+            mFdNextId = mFdNextId == INT_MAX ? 1 : mFdNextId + 1;
+        }
     }
-    return NO_ERROR;
+    memcpy(mFdPrevRects, rects, count * 4 * sizeof(int));
+    for (int j = 0; j < FACE_METADATA_FACES; j++)
+        mFdPrevIds[j] = j < count ? ids[j] : 0;
+}
+
+/* Publishes faces as a face_metadata: x, y, dx, dy in preview pixels, a
+ * score and an id per face. mSendMetaData is cleared while the callback
+ * runs, and results arriving meanwhile are dropped; each result goes to
+ * the other buffer of mMetaDataHeap, so the one handed to the previous
+ * callback is not rewritten under a client still reading it.
+ */
+void QualcommCameraHardware::sendFaces(const int *rects, const int *scores,
+                                       const int *ids, int count)
+{
+    face_metadata meta;
+
+    meta.values = count * 4;
+    for (int i = 0; i < FACE_METADATA_FACES; i++) {
+        for (int k = 0; k < 4; k++)
+            meta.rect[i][k] = i < count ? rects[4 * i + k] : -1;
+        meta.score[i] = i < count ? scores[i] : 0;
+        meta.id[i] = i < count ? ids[i] : 0;
+    }
+
+    mCallbackLock.lock();
+    int msgEnabled = mMsgEnabled;
+    data_callback mcb = mDataCallback;
+    void *mdata = mCallbackCookie;
+    mCallbackLock.unlock();
+
+    if (mcb == NULL || !(msgEnabled & CAMERA_MSG_PREVIEW_METADATA))
+        return;
+
+    mMetaDataWaitLock.lock();
+    if (mFaceDetectOn != true || mMetaDataHeap == NULL) {
+        mMetaDataWaitLock.unlock();
+        return;
+    }
+    if (!mSendMetaData) {
+        mFdUnsent++;
+        mMetaDataWaitLock.unlock();
+        return;
+    }
+    mSendMetaData = false;
+    // setFaceDetection() may drop the heap while the callback runs.
+    sp<AshmemPool> metaDataHeap = mMetaDataHeap;
+    mMetaDataIndex = (mMetaDataIndex + 1) % metaDataHeap->mNumBuffers;
+    int index = mMetaDataIndex;
+    memcpy((uint8_t *)metaDataHeap->mHeap->base() +
+           index * metaDataHeap->mAlignedBufferSize, &meta, sizeof(meta));
+    mMetaDataWaitLock.unlock();
+
+    mcb(CAMERA_MSG_PREVIEW_METADATA, metaDataHeap->mBuffers[index], mdata);
+
+    mMetaDataWaitLock.lock();
+    if (mFaceDetectOn == true && metaDataHeap == mMetaDataHeap)
+        mSendMetaData = true;
+    mMetaDataWaitLock.unlock();
 }
 
 status_t QualcommCameraHardware::setFaceDetection(const char *str)
@@ -6481,9 +9557,35 @@ status_t QualcommCameraHardware::setFaceDetection(const char *str)
                                     sizeof(facedetection) / sizeof(str_map), str);
         if (value != NOT_FOUND) {
             mMetaDataWaitLock.lock();
+            // The metadata heap only exists while face detection is on.
+            if (value == true && mMetaDataHeap == NULL) {
+                // Two buffers, see sendFaces()
+                mMetaDataHeap =
+                    new AshmemPool(sizeof(face_metadata),
+                                   2,
+                                   sizeof(face_metadata),
+                                   "metadata");
+                if (!mMetaDataHeap->initialized()) {
+                    mMetaDataHeap.clear();
+                    mMetaDataHeap = NULL;
+                    mMetaDataWaitLock.unlock();
+                    LOGE("setFaceDetection: error initializing mMetaDataHeap");
+                    return NO_MEMORY;
+                }
+            } else if (value != true && mMetaDataHeap != NULL) {
+                mMetaDataHeap.clear();
+                mMetaDataHeap = NULL;
+            }
+            if (value == true && mFaceDetectOn != true)
+                mSendMetaData = true;
+            else if (value != true)
+                mSendMetaData = false;
             mFaceDetectOn = value;
             mMetaDataWaitLock.unlock();
+            // Called from sendCommand(), outside setParameters().
+            Mutex::Autolock l(&mLock);
             mParameters.set(CameraParameters::KEY_FACE_DETECTION, str);
+            publishParameters();
             return NO_ERROR;
         }
     }
@@ -6527,39 +9629,242 @@ status_t  QualcommCameraHardware::setISOValue(const CameraParameters& params) {
     return BAD_VALUE;
 }
 
-status_t QualcommCameraHardware::setSceneDetect(const CameraParameters& params)
+/* Software scene detection. The statistics grid holds, per cell, the
+ * sums of luma, of pixels at or above SCENE_BRIGHT_LEVEL and of the two
+ * chroma planes, over every rowStep-th row. The classes and their tests,
+ * in priority order, with the exit threshold of the current scene relaxed
+ * so that it does not flicker at the boundary:
+ *
+ *   night      the frame mean luma is low
+ *   backlight  the border is much brighter than the centre and a fair
+ *              part of the frame is near saturation
+ *   portrait   the face detector sees a face, or skin tones fill the centre
+ *   landscape  the top of the frame is bright and blue
+ */
+#define SCENE_BRIGHT_LEVEL      235
+#define SCENE_HOLD_FRAMES       5
+
+struct scene_stats {
+    uint32_t luma[SCENE_GRID_H][SCENE_GRID_W];
+    uint32_t bright[SCENE_GRID_H][SCENE_GRID_W];
+    uint32_t cr[SCENE_GRID_H][SCENE_GRID_W];
+    uint32_t cb[SCENE_GRID_H][SCENE_GRID_W];
+    uint32_t lumaCount[SCENE_GRID_H];       // samples per cell of a grid row
+    uint32_t chromaCount[SCENE_GRID_H];
+};
+
+// Sums n luma samples and counts those at or above SCENE_BRIGHT_LEVEL.
+static void scene_sum_luma(const uint8_t *p, int n, uint32_t *sum, uint32_t *bright)
+{
+    int x = 0;
+    uint32_t s = 0, b = 0;
+#ifdef HAL_USE_NEON
+    // The 16 bit sums and 8 bit counts are flushed every 128 steps.
+    const uint8x16_t level = vdupq_n_u8(SCENE_BRIGHT_LEVEL);
+    while (x + 16 <= n) {
+        uint16x8_t acc = vdupq_n_u16(0);
+        uint8x16_t cnt = vdupq_n_u8(0);
+        for (int i = 0; i < 128 && x + 16 <= n; i++, x += 16) {
+            uint8x16_t v = vld1q_u8(p + x);
+            acc = vpadalq_u8(acc, v);
+            cnt = vsubq_u8(cnt, vcgeq_u8(v, level));
+        }
+        uint32x4_t s4 = vpaddlq_u16(acc);
+        uint64x2_t s2 = vpaddlq_u32(s4);
+        s += vgetq_lane_u64(s2, 0) + vgetq_lane_u64(s2, 1);
+        uint64x2_t b2 = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(cnt)));
+        b += vgetq_lane_u64(b2, 0) + vgetq_lane_u64(b2, 1);
+    }
+#endif
+    for (; x < n; x++) {
+        s += p[x];
+        b += p[x] >= SCENE_BRIGHT_LEVEL;
+    }
+    *sum += s;
+    *bright += b;
+}
+
+// Sums n interleaved Cr,Cb pairs of an NV21 chroma row.
+static void scene_sum_chroma(const uint8_t *p, int n, uint32_t *cr, uint32_t *cb)
 {
+    int x = 0;
+    uint32_t r = 0, b = 0;
+#ifdef HAL_USE_NEON
+    while (x + 16 <= n) {
+        uint16x8_t accR = vdupq_n_u16(0), accB = vdupq_n_u16(0);
+        for (int i = 0; i < 128 && x + 16 <= n; i++, x += 16) {
+            uint8x16x2_t v = vld2q_u8(p + 2 * x);
+            accR = vpadalq_u8(accR, v.val[0]);
+            accB = vpadalq_u8(accB, v.val[1]);
+        }
+        uint64x2_t r2 = vpaddlq_u32(vpaddlq_u16(accR));
+        uint64x2_t b2 = vpaddlq_u32(vpaddlq_u16(accB));
+        r += vgetq_lane_u64(r2, 0) + vgetq_lane_u64(r2, 1);
+        b += vgetq_lane_u64(b2, 0) + vgetq_lane_u64(b2, 1);
+    }
+#endif
+    for (; x < n; x++) {
+        r += p[2 * x];
+        b += p[2 * x + 1];
+    }
+    *cr += r;
+    *cb += b;
+}
+
+static void scene_grid(const uint8_t *frame, int stride, int width, int height,
+                       int cbcrOffset, int cbcrStride, int rowStep,
+                       scene_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    int cellW = width / SCENE_GRID_W;
+    for (int y = 0; y < height; y += rowStep) {
+        int gy = y * SCENE_GRID_H / height;
+        const uint8_t *row = frame + y * stride;
+        for (int gx = 0; gx < SCENE_GRID_W; gx++)
+            scene_sum_luma(row + gx * cellW, cellW, &st->luma[gy][gx], &st->bright[gy][gx]);
+        st->lumaCount[gy] += cellW;
+
+        if ((y & 1) == 0) {
+            const uint8_t *c = frame + cbcrOffset + (y / 2) * cbcrStride;
+            for (int gx = 0; gx < SCENE_GRID_W; gx++)
+                scene_sum_chroma(c + gx * cellW, cellW / 2, &st->cr[gy][gx], &st->cb[gy][gx]);
+            st->chromaCount[gy] += cellW / 2;
+        }
+    }
+}
+
+static int scene_classify(const scene_stats *st, int current, int faces)
+{
+    int all = 0, centre = 0, border = 0;
+    uint32_t bright = 0, samples = 0;
+    int nAll = 0, nCentre = 0, nBorder = 0, skinCells = 0;
+    int topY = 0, topCr = 0, topCb = 0, nTop = 0;
+
+    for (int gy = 0; gy < SCENE_GRID_H; gy++) {
+        if (st->lumaCount[gy] == 0)
+            continue;
+        for (int gx = 0; gx < SCENE_GRID_W; gx++) {
+            int y = st->luma[gy][gx] / st->lumaCount[gy];
+            int cr = st->chromaCount[gy] ? st->cr[gy][gx] / st->chromaCount[gy] : 128;
+            int cb = st->chromaCount[gy] ? st->cb[gy][gx] / st->chromaCount[gy] : 128;
+            all += y;
+            nAll++;
+            bright += st->bright[gy][gx];
+            samples += st->lumaCount[gy];
+            bool inCentre = gx >= SCENE_GRID_W / 4 && gx < SCENE_GRID_W * 3 / 4 &&
+                            gy >= SCENE_GRID_H / 3 && gy < SCENE_GRID_H * 2 / 3;
+            bool onBorder = gx == 0 || gx == SCENE_GRID_W - 1 ||
+                            gy == 0 || gy == SCENE_GRID_H - 1;
+            if (inCentre) {
+                centre += y;
+                nCentre++;
+                if (y > 60 && cr >= 135 && cr <= 175 && cb >= 80 && cb <= 125)
+                    skinCells++;
+            } else if (onBorder) {
+                border += y;
+                nBorder++;
+            }
+            if (gy < SCENE_GRID_H / 3) {
+                topY += y;
+                topCr += cr;
+                topCb += cb;
+                nTop++;
+            }
+        }
+    }
+    if (samples == 0)
+        return current;
+    all /= nAll;
+    centre = nCentre ? centre / nCentre : all;
+    border = nBorder ? border / nBorder : all;
+    if (nTop) {
+        topY /= nTop;
+        topCr /= nTop;
+        topCb /= nTop;
+    }
+    int brightPct = bright * 100 / samples;
+
+    if (all < (current == CAMERA_BESTSHOT_NIGHT ? 55 : 40))
+        return CAMERA_BESTSHOT_NIGHT;
+    if (border - centre > (current == CAMERA_BESTSHOT_BACKLIGHT ? 35 : 50) &&
+            brightPct >= (current == CAMERA_BESTSHOT_BACKLIGHT ? 5 : 10))
+        return CAMERA_BESTSHOT_BACKLIGHT;
+    if (faces > 0 || skinCells >= (current == CAMERA_BESTSHOT_PORTRAIT ? 1 : 2))
+        return CAMERA_BESTSHOT_PORTRAIT;
+    if (topY > (current == CAMERA_BESTSHOT_LANDSCAPE ? 100 : 120) &&
+            topCb > topCr + (current == CAMERA_BESTSHOT_LANDSCAPE ? 4 : 8))
+        return CAMERA_BESTSHOT_LANDSCAPE;
+    return CAMERA_BESTSHOT_OFF;
+}
+
+// Runs on the frame thread. The row step doubles while a frame takes more
+// than mSceneBudgetUs and halves again when it takes under a quarter of it.
+void QualcommCameraHardware::detectScene(const uint8_t *frame, int stride,
+                                         int width, int height,
+                                         int cbcrOffset, int cbcrStride)
+{
+    scene_stats st;
+    nsecs_t start = systemTime();
+    scene_grid(frame, stride, width, height, cbcrOffset, cbcrStride,
+               mSceneRowStep, &st);
+    mFdLock.lock();
+    int faces = mFaceDetectOn == true ? mFdLastFaces : 0;
+    mFdLock.unlock();
+    int scene = scene_classify(&st, mSceneCurrent, faces);
+    nsecs_t elapsed = systemTime() - start;
+
+    mSceneFrames++;
+    mSceneTimeTotal += elapsed;
+    if (elapsed > mSceneTimeMax)
+        mSceneTimeMax = elapsed;
+    if (ns2us(elapsed) > mSceneBudgetUs && mSceneRowStep < 64)
+        mSceneRowStep *= 2;
+    else if (ns2us(elapsed) < mSceneBudgetUs / 4 && mSceneRowStep > 2)
+        mSceneRowStep /= 2;
+
+    if (scene == mSceneCurrent) {
+        mSceneCandidateFrames = 0;
+        return;
+    }
+    if (scene != mSceneCandidate) {
+        mSceneCandidate = scene;
+        mSceneCandidateFrames = 0;
+    }
+    if (++mSceneCandidateFrames < SCENE_HOLD_FRAMES)
+        return;
+
+    mSceneCurrent = scene;
+    mSceneCandidateFrames = 0;
+    mSceneChanges++;
+    LOGV("%s: scene %d", __FUNCTION__, scene);
+    // getParameters() reports the scene as scene-detected.
+    notifyParamsChanged();
+    mCallbackLock.lock();
+    bool enabled = mNotifyCallback && (mMsgEnabled & CAMERA_MSG_SCENE_DETECT);
+    notify_callback cb = mNotifyCallback;
+    void *data = mCallbackCookie;
+    mCallbackLock.unlock();
+    if (enabled)
+        cb(CAMERA_MSG_SCENE_DETECT, scene, 0, data);
+}
 
-    bool retParm1, retParm2;
+status_t QualcommCameraHardware::setSceneDetect(const CameraParameters& params)
+{
     if (supportsSceneDetection()) {
-        if((!strcmp(sensorType->name, "2mp")) ||
-	   (!strcmp(sensorType->name, "5mp_triumph")) ||
-	   (!strcmp(sensorType->name, "ov7692"))) {
-            LOGI("Parameter Auto Scene Detection is not supported for this sensor");
-            return NO_ERROR;
-        }
         const char *str = params.get(CameraParameters::KEY_SCENE_DETECT);
         if (str != NULL) {
             int32_t value = attr_lookup(scenedetect, sizeof(scenedetect) / sizeof(str_map), str);
             if (value != NOT_FOUND) {
                 mParameters.set(CameraParameters::KEY_SCENE_DETECT, str);
-
-                retParm1 = native_set_parm(CAMERA_SET_PARM_BL_DETECTION_ENABLE, sizeof(value),
-                                           (void *)&value);
-
-                retParm2 = native_set_parm(CAMERA_SET_PARM_SNOW_DETECTION_ENABLE, sizeof(value),
-                                           (void *)&value);
-
-                //All Auto Scene detection modes should be all ON or all OFF.
-                if(retParm1 == false || retParm2 == false) {
-                    value = !value;
-                    retParm1 = native_set_parm(CAMERA_SET_PARM_BL_DETECTION_ENABLE, sizeof(value),
-                                               (void *)&value);
-
-                    retParm2 = native_set_parm(CAMERA_SET_PARM_SNOW_DETECTION_ENABLE, sizeof(value),
-                                               (void *)&value);
+                if (value && !mSceneDetectOn) {
+                    char prop[PROPERTY_VALUE_MAX];
+                    property_get("persist.camera.hal.scenebudget", prop, "300");
+                    mSceneBudgetUs = atoi(prop) > 0 ? atoi(prop) : 300;
+                    mSceneCurrent = mSceneCandidate = CAMERA_BESTSHOT_OFF;
+                    mSceneCandidateFrames = 0;
                 }
-                return (retParm1 && retParm2) ? NO_ERROR : UNKNOWN_ERROR;
+                mSceneDetectOn = value;
+                return NO_ERROR;
             }
         }
         LOGE("Invalid auto scene detection value: %s", (str == NULL) ? "NULL" : str);
@@ -6700,7 +10005,10 @@ status_t QualcommCameraHardware::setZoom(const CameraParameters& params)
 
     LOGV("Set zoom=%d", zoom_level);
     if(mMaxZoom==-1) {
-	    if(native_get_maxzoom(mCameraControlFd, (void *)&mMaxZoom) == true){
+	    beginParmSync();
+	    bool found = native_get_maxzoom(mCameraControlFd, (void *)&mMaxZoom);
+	    endParmSync();
+	    if(found){
 		LOGD("Maximum zoom value is %d", mMaxZoom);
 		mParameters.set("zoom-supported", "true");
 	    } else {
@@ -6774,7 +10082,7 @@ status_t QualcommCameraHardware:: getFocusState(void)
         NULL) == MM_CAMERA_SUCCESS) {
         return NO_ERROR;
     }
-    LOGE("%s: getFocusState not finished!!!", __FUNCTION__);
+    LOGV("%s: getFocusState not finished", __FUNCTION__);
     return BAD_VALUE;
 }
 
@@ -6814,6 +10122,135 @@ status_t QualcommCameraHardware::setPictureFormat(const CameraParameters& params
     return NO_ERROR;
 }
 
+status_t QualcommCameraHardware::setRawFormat(const CameraParameters& params)
+{
+    LOGV("%s E", __FUNCTION__);
+    const char *str = params.get("raw-format");
+
+    if(str != NULL){
+        int32_t value = attr_lookup(raw_formats,
+                                    sizeof(raw_formats) / sizeof(str_map), str);
+        if(value == NOT_FOUND){
+            LOGE("Invalid Raw Format value: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("raw-format", str);
+        mRawFormat = value;
+    }
+
+    str = params.get("raw-black-level");
+    if(str != NULL){
+        int black = params.getInt("raw-black-level");
+        if((black < 0) || (black > MAX_RAW_BLACK_LEVEL)){
+            LOGE("Invalid Raw black level: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("raw-black-level", black);
+        mRawBlackLevel = black;
+    }
+
+    str = params.get("raw-container");
+    if(str != NULL){
+        int32_t value = attr_lookup(raw_containers,
+                                    sizeof(raw_containers) / sizeof(str_map), str);
+        if(value == NOT_FOUND){
+            LOGE("Invalid Raw container value: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("raw-container", str);
+        mRawContainer = value;
+    }
+    return NO_ERROR;
+}
+
+status_t QualcommCameraHardware::setExposureBracketing(const CameraParameters& params)
+{
+    LOGV("%s E", __FUNCTION__);
+    const char *str = params.get("exposure-bracketing");
+
+    if(str != NULL){
+        int32_t value = attr_lookup(bracketing_modes,
+                                    sizeof(bracketing_modes) / sizeof(str_map), str);
+        if(value == NOT_FOUND){
+            LOGE("Invalid exposure bracketing value: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("exposure-bracketing", str);
+        mBracketMode = value;
+    }
+
+    // Comma separated exposure compensation numerators, one per frame.
+    str = params.get("exposure-bracketing-steps");
+    if(str != NULL){
+        int steps[MAX_BRACKET_FRAMES];
+        int count = 0;
+        const char *p = str;
+        while (*p != '\0') {
+            char *end;
+            int step = (int)strtol(p, &end, 10);
+            if (end == p || count >= MAX_BRACKET_FRAMES ||
+                step < EXPOSURE_COMPENSATION_MINIMUM_NUMERATOR ||
+                step > EXPOSURE_COMPENSATION_MAXIMUM_NUMERATOR ||
+                (*end != ',' && *end != '\0')) {
+                LOGE("Invalid exposure bracketing steps: %s", str);
+                return BAD_VALUE;
+            }
+            steps[count++] = step;
+            p = (*end == ',') ? end + 1 : end;
+        }
+        if (count < 2) {
+            LOGE("Exposure bracketing needs at least 2 steps: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("exposure-bracketing-steps", str);
+        memcpy(mBracketSteps, steps, count * sizeof(int));
+        mBracketCount = count;
+    }
+    return NO_ERROR;
+}
+
+status_t QualcommCameraHardware::setMultiFrameDenoise(const CameraParameters& params)
+{
+    LOGV("%s E", __FUNCTION__);
+    const char *str = params.get("multi-frame-denoise");
+
+    if(str != NULL){
+        int32_t value = attr_lookup(multi_frame_denoise_modes,
+                                    sizeof(multi_frame_denoise_modes) / sizeof(str_map), str);
+        if(value == NOT_FOUND){
+            LOGE("Invalid multi frame denoise value: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("multi-frame-denoise", str);
+        mDenoiseMode = value;
+    }
+
+    str = params.get("multi-frame-denoise-frames");
+    if(str != NULL){
+        int frames = params.getInt("multi-frame-denoise-frames");
+        if((frames < 2) || (frames > MAX_BRACKET_FRAMES)){
+            LOGE("Invalid multi frame denoise frame count: %s", str);
+            return BAD_VALUE;
+        }
+        mParameters.set("multi-frame-denoise-frames", frames);
+        mDenoiseFrames = frames;
+    }
+    return NO_ERROR;
+}
+
+bool QualcommCameraHardware::useMultiFrameDenoise()
+{
+    if (mDenoiseMode == MULTI_FRAME_DENOISE_ON)
+        return true;
+    if (mDenoiseMode == MULTI_FRAME_DENOISE_NIGHT) {
+        const char *scene = mParameters.get(CameraParameters::KEY_SCENE_MODE);
+        return scene != NULL &&
+               (!strcmp(scene, CameraParameters::SCENE_MODE_NIGHT) ||
+                !strcmp(scene, CameraParameters::SCENE_MODE_NIGHT_PORTRAIT));
+    }
+    return false;
+}
+
 QualcommCameraHardware::MMCameraDL::MMCameraDL(){
     LOGV("MMCameraDL: E");
     libmmcamera = NULL;
@@ -6857,13 +10294,128 @@ sp<QualcommCameraHardware::MMCameraDL> QualcommCameraHardware::MMCameraDL::getIn
     return mmCamera;
 }
 
+/* Memory accountant. Every MemPool charges the bytes it maps to one
+ * account for its type (ashmem, pmem) and one for its region, and
+ * releases them on destruction. Live and peak usage go to dump(). With
+ * persist.camera.hal.membudget set (in KB), pools that would take the
+ * total over the budget fail to initialize instead of allocating.
+ */
+#define MEM_ACCOUNT_MAX 8
+
+struct mem_account {
+    const char *name;
+    int pools;
+    int current;
+    int peak;
+};
+
+static Mutex mem_account_lock;
+static mem_account mem_accounts[MEM_ACCOUNT_MAX];
+static int mem_account_total;
+static int mem_account_peak;
+static int mem_account_budget;  // bytes, 0 for no limit
+static int mem_account_denied;
+
+static mem_account *mem_account_get(const char *name)
+{
+    for (int i = 0; i < MEM_ACCOUNT_MAX; i++) {
+        if (mem_accounts[i].name == NULL) {
+            mem_accounts[i].name = name;
+            return &mem_accounts[i];
+        }
+        if (!strcmp(mem_accounts[i].name, name))
+            return &mem_accounts[i];
+    }
+    return NULL;
+}
+
+static void mem_account_charge(const char *name, int bytes)
+{
+    mem_account *acct = mem_account_get(name);
+    if (acct == NULL)
+        return;
+    acct->pools += bytes > 0 ? 1 : -1;
+    acct->current += bytes;
+    if (acct->current > acct->peak)
+        acct->peak = acct->current;
+}
+
+static void mem_account_set_budget(int kbytes)
+{
+    Mutex::Autolock l(&mem_account_lock);
+    mem_account_budget = kbytes > 0 ? kbytes * 1024 : 0;
+    if (mem_account_budget)
+        LOGI("camera memory budget %d KB", kbytes);
+}
+
+static int mem_account_live(void)
+{
+    Mutex::Autolock l(&mem_account_lock);
+    return mem_account_total;
+}
+
+// Whether bytes more would fit in the budget.
+static bool mem_account_fits(int bytes)
+{
+    Mutex::Autolock l(&mem_account_lock);
+    return mem_account_budget == 0 || mem_account_total + bytes <= mem_account_budget;
+}
+
+static void mem_account_dump(int fd)
+{
+    const size_t SIZE = 256;
+    char buffer[SIZE];
+    String8 result;
+    Mutex::Autolock l(&mem_account_lock);
+
+    snprintf(buffer, 255, "memory: %d KB live, %d KB peak, budget %d KB, %d denied\n",
+             mem_account_total / 1024, mem_account_peak / 1024,
+             mem_account_budget / 1024, mem_account_denied);
+    result.append(buffer);
+    for (int i = 0; i < MEM_ACCOUNT_MAX && mem_accounts[i].name != NULL; i++) {
+        snprintf(buffer, 255, "  %s: %d pools, %d KB live, %d KB peak\n",
+                 mem_accounts[i].name, mem_accounts[i].pools,
+                 mem_accounts[i].current / 1024, mem_accounts[i].peak / 1024);
+        result.append(buffer);
+    }
+    write(fd, result.string(), result.size());
+}
+
+bool QualcommCameraHardware::MemPool::account(const char *type, const char *region,
+                                              int bytes, bool enforce)
+{
+    Mutex::Autolock l(&mem_account_lock);
+    if (enforce && mem_account_budget > 0 &&
+        mem_account_total + bytes > mem_account_budget) {
+        mem_account_denied++;
+        LOGE("MemPool %s: %d KB from %s would exceed the camera memory budget "
+             "(%d KB live of %d KB)", mName, bytes / 1024, region,
+             mem_account_total / 1024, mem_account_budget / 1024);
+        return false;
+    }
+    mAccountType = type;
+    mAccountRegion = region;
+    mAccountedBytes = bytes;
+    mem_account_charge(type, bytes);
+    if (strcmp(type, region))
+        mem_account_charge(region, bytes);
+    mem_account_total += bytes;
+    if (mem_account_total > mem_account_peak)
+        mem_account_peak = mem_account_total;
+    return true;
+}
+
 QualcommCameraHardware::MemPool::MemPool(int buffer_size, int num_buffers,
                                          int frame_size,
                                          const char *name) :
     mBufferSize(buffer_size),
     mNumBuffers(num_buffers),
     mFrameSize(frame_size),
-    mBuffers(NULL), mName(name)
+    mBaseOffset(0),
+    mBuffers(NULL), mName(name),
+    mAccountedBytes(0),
+    mAccountType(NULL),
+    mAccountRegion(NULL)
 {
     LOGV("%s E", __FUNCTION__);
     int page_size_minus_1 = getpagesize() - 1;
@@ -6882,7 +10434,7 @@ void QualcommCameraHardware::MemPool::completeInitialization()
         for (int i = 0; i < mNumBuffers; i++) {
             mBuffers[i] = new
                 MemoryBase(mHeap,
-                           i * mAlignedBufferSize,
+                           mBaseOffset + i * mAlignedBufferSize,
                            mFrameSize);
         }
     }
@@ -6907,6 +10459,9 @@ QualcommCameraHardware::AshmemPool::AshmemPool(int buffer_size, int num_buffers,
     ashmem_size += page_mask;
     ashmem_size &= ~page_mask;
 
+    if (!account("ashmem", "ashmem", ashmem_size))
+        return;
+
     mHeap = new MemoryHeapBase(ashmem_size);
 
     completeInitialization();
@@ -6935,6 +10490,10 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
                                     num_buffers,
                                     frame_size,
                                     name),
+    mPmemPool(pmem_pool),
+    mFlags(flags),
+    mCached(!(flags & MemoryHeapBase::NO_CACHING)),
+    mRegistered(false),
     mPmemType(pmem_type),
     mCbCrOffset(cbcr_offset),
     myOffset(yOffset),
@@ -6956,6 +10515,9 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
     // mAlignedBufferSize is already in 4k aligned. (do we need total size necessary to be in power of 2??)
     mAlignedSize = mAlignedBufferSize * num_buffers;
 
+    if (!account("pmem", pmem_pool, mAlignedSize))
+        return;
+
     sp<MemoryHeapBase> masterHeap =
         new MemoryHeapBase(pmem_pool, mAlignedSize, flags);
 
@@ -6986,45 +10548,7 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
              mFd,
              mSize.len);
         LOGD("mBufferSize=%d, mAlignedBufferSize=%d\n", mBufferSize, mAlignedBufferSize);
-        // Unregister preview buffers with the camera drivers.  Allow the VFE to write
-        // to all preview buffers except for the last one.
-        // Only Register the preview, snapshot and thumbnail buffers with the kernel.
-        if( (strcmp("postview", mName) != 0) ){
-            int num_buf = num_buffers;
-            if(!strcmp("preview", mName)) num_buf = kPreviewBufferCount;
-            LOGD("num_buffers = %d", num_buf);
-            for (int cnt = 0; cnt < num_buf; ++cnt) {
-                int active = 1;
-                if(pmem_type == MSM_PMEM_VIDEO){
-                     active = (cnt<ACTIVE_VIDEO_BUFFERS);
-                     //When VPE is enabled, set the last record
-                     //buffer as active and pmem type as PMEM_VIDEO_VPE
-                     //as this is a requirement from VPE operation.
-                     //No need to set this pmem type to VIDEO_VPE while unregistering,
-                     //because as per camera stack design: "the VPE AXI is also configured
-                     //when VFE is configured for VIDEO, which is as part of preview
-                     //initialization/start. So during this VPE AXI config camera stack
-                     //will lookup the PMEM_VIDEO_VPE buffer and give it as o/p of VPE and
-                     //change it's type to PMEM_VIDEO".
-                     if( (mVpeEnabled) && (cnt == kRecordBufferCount-1)) {
-                         active = 1;
-                         pmem_type = MSM_PMEM_VIDEO_VPE;
-                     }
-                     LOGV(" pmempool creating video buffers : active %d ", active);
-                }
-                else if (pmem_type == MSM_PMEM_PREVIEW){
-                     active = (cnt < (num_buf-1));
-                }
-                register_buf(mCameraControlFd,
-                         mBufferSize,
-                         mFrameSize, mCbCrOffset, myOffset,
-                         mHeap->getHeapID(),
-                         mAlignedBufferSize * cnt,
-                         (uint8_t *)mHeap->base() + mAlignedBufferSize * cnt,
-                         pmem_type,
-                         active);
-            }
-        }
+        registerBuffers(true);
 
         completeInitialization();
     }
@@ -7033,31 +10557,319 @@ QualcommCameraHardware::PmemPool::PmemPool(const char *pmem_pool,
     LOGI("%s: (%s) X ", __FUNCTION__, mName);
 }
 
-QualcommCameraHardware::PmemPool::~PmemPool()
+/* A pool of buffers carved out of an existing pmem heap at the given
+ * offset, so that several snapshot buffers can share one allocation and
+ * mapping. The kernel and the IMemory buffers see the offsets; the heap
+ * itself is kept alive by every pool carved from it.
+ */
+QualcommCameraHardware::PmemPool::PmemPool(const sp<MemoryHeapBase>& arena,
+                                           int offset,
+                                           int camera_control_fd,
+                                           int pmem_type,
+                                           int buffer_size, int num_buffers,
+                                           int frame_size, int cbcr_offset,
+                                           int yOffset, const char *name) :
+    QualcommCameraHardware::MemPool(buffer_size,
+                                    num_buffers,
+                                    frame_size,
+                                    name),
+    mPmemPool(arena->getDevice()),
+    mFlags(arena->getFlags()),
+    mCached(!(arena->getFlags() & MemoryHeapBase::NO_CACHING)),
+    mRegistered(false),
+    mPmemType(pmem_type),
+    mCbCrOffset(cbcr_offset),
+    myOffset(yOffset),
+    mCameraControlFd(dup(camera_control_fd))
 {
-    LOGI("%s: %s E", __FUNCTION__, mName);
-    if (mHeap != NULL) {
-        // Unregister preview buffers with the camera drivers.
-        //  Only Unregister the preview, snapshot and thumbnail
-        //  buffers with the kernel.
-        if( (strcmp("postview", mName) != 0) ){
-            int num_buffers = mNumBuffers;
-            if(!strcmp("preview", mName)) num_buffers = kPreviewBufferCount;
-            for (int cnt = 0; cnt < num_buffers; ++cnt) {
-                register_buf(mCameraControlFd,
-                         mBufferSize,
-                         mFrameSize,
-                         mCbCrOffset,
-                         myOffset,
-                         mHeap->getHeapID(),
-                         mAlignedBufferSize * cnt,
-                         (uint8_t *)mHeap->base() + mAlignedBufferSize * cnt,
-                         mPmemType,
-                         false,
-                         false /* unregister */);
+    LOGI("constructing MemPool %s in snapshot arena at offset %d: "
+         "%d frames @ %d bytes, buffer size %d",
+         mName, offset, num_buffers, frame_size, buffer_size);
+
+    mMMCameraDLRef = QualcommCameraHardware::MMCameraDL::getInstance();
+    mBaseOffset = offset;
+    mAlignedSize = mAlignedBufferSize * num_buffers;
+    if (offset + mAlignedSize > arena->getSize()) {
+        LOGE("%s does not fit in the snapshot arena (%d + %d > %d)",
+             mName, offset, mAlignedSize, arena->getSize());
+        return;
+    }
+    // The arena was checked against the budget as a whole when allocated.
+    account("pmem", mPmemPool != NULL ? mPmemPool : "pmem", mAlignedSize, false);
+    mHeap = arena;
+    mFd = mHeap->getHeapID();
+    mSize.offset = offset;
+    mSize.len = mAlignedSize;
+    registerBuffers(true);
+    completeInitialization();
+}
+
+// Register the buffers with the kernel, or unregister them. The VFE may
+// write to all preview buffers but the last one, and to the first
+// ACTIVE_VIDEO_BUFFERS record buffers.
+void QualcommCameraHardware::PmemPool::registerBuffers(bool reg)
+{
+    if (mHeap == NULL || mRegistered == reg)
+        return;
+    // Only register the preview, snapshot and thumbnail buffers with the kernel.
+    if ((strcmp("postview", mName) == 0) || (strcmp("liveshot", mName) == 0))
+        return;
+
+    int num_buf = mNumBuffers;
+    if(!strcmp("preview", mName)) num_buf = kPreviewBufferCount;
+    LOGD("%s: %s %d buffers", mName, reg ? "registering" : "unregistering", num_buf);
+    for (int cnt = 0; cnt < num_buf; ++cnt) {
+        if (reg)
+            clean(cnt);
+        int active = 1;
+        int pmem_type = mPmemType;
+        if (reg) {
+            if(pmem_type == MSM_PMEM_VIDEO){
+                 active = (cnt<ACTIVE_VIDEO_BUFFERS);
+                 //When VPE is enabled, set the last record
+                 //buffer as active and pmem type as PMEM_VIDEO_VPE
+                 //as this is a requirement from VPE operation.
+                 //No need to set this pmem type to VIDEO_VPE while unregistering,
+                 //because as per camera stack design: "the VPE AXI is also configured
+                 //when VFE is configured for VIDEO, which is as part of preview
+                 //initialization/start. So during this VPE AXI config camera stack
+                 //will lookup the PMEM_VIDEO_VPE buffer and give it as o/p of VPE and
+                 //change it's type to PMEM_VIDEO".
+                 if( (mVpeEnabled) && (cnt == kRecordBufferCount-1)) {
+                     active = 1;
+                     pmem_type = MSM_PMEM_VIDEO_VPE;
+                 }
+                 LOGV(" pmempool creating video buffers : active %d ", active);
+            }
+            else if (pmem_type == MSM_PMEM_PREVIEW){
+                 active = (cnt < (num_buf-1));
+            }
+        } else {
+            active = false;
+        }
+        register_buf(mCameraControlFd,
+                 mBufferSize,
+                 mFrameSize, mCbCrOffset, myOffset,
+                 mHeap->getHeapID(),
+                 mBaseOffset + mAlignedBufferSize * cnt,
+                 (uint8_t *)mHeap->base() + mBaseOffset + mAlignedBufferSize * cnt,
+                 pmem_type,
+                 active,
+                 reg);
+    }
+    mRegistered = reg;
+}
+
+/* Invalidate the CPU cache over one buffer of a cached pool, after the
+ * VFE has written it and before the CPU reads it.
+ */
+void QualcommCameraHardware::PmemPool::invalidate(int index)
+{
+    if (!mCached || mHeap == NULL || index < 0 || index >= mNumBuffers)
+        return;
+#ifdef PMEM_INV_CACHES
+    struct pmem_addr addr;
+    addr.vaddr = (unsigned long)mHeap->base();
+    addr.offset = mBaseOffset + mAlignedBufferSize * index;
+    addr.length = mBufferSize;
+    if (::ioctl(mFd, PMEM_INV_CACHES, &addr) < 0)
+        LOGE("%s: PMEM_INV_CACHES on buffer %d failed: %s", mName, index,
+             strerror(errno));
+#endif
+}
+
+/* Clean the CPU cache over one buffer of a cached pool before it goes back
+ * to the VFE. READ_ONLY only covers this mapping: the same pmem is mapped
+ * writable by the client and by libmmcamera, and speculative fills can
+ * leave lines that must not be written back over the next frame.
+ */
+void QualcommCameraHardware::PmemPool::clean(int index)
+{
+    if (!mCached || mHeap == NULL || index < 0 || index >= mNumBuffers)
+        return;
+#ifdef PMEM_CLEAN_CACHES
+    struct pmem_addr addr;
+    addr.vaddr = (unsigned long)mHeap->base();
+    addr.offset = mBaseOffset + mAlignedBufferSize * index;
+    addr.length = mBufferSize;
+    if (::ioctl(mFd, PMEM_CLEAN_CACHES, &addr) < 0)
+        LOGE("%s: PMEM_CLEAN_CACHES on buffer %d failed: %s", mName, index,
+             strerror(errno));
+#endif
+}
+
+bool QualcommCameraHardware::PmemPool::matches(const char *pmem_pool, int flags,
+                                               int pmem_type, int buffer_size,
+                                               int num_buffers, int frame_size,
+                                               int cbcr_offset, int yoffset,
+                                               const char *name) const
+{
+    return !strcmp(mPmemPool, pmem_pool) && mFlags == flags &&
+           mPmemType == pmem_type && mBufferSize == buffer_size &&
+           mNumBuffers == num_buffers && mFrameSize == frame_size &&
+           mCbCrOffset == cbcr_offset && myOffset == yoffset &&
+           !strcmp(mName, name);
+}
+
+/* Preview and record frames are read by the CPU for every callback and
+ * copy. With persist.camera.hal.cachedpreview=1 their pools are mapped
+ * cached, and each frame is invalidated when it arrives from the VFE.
+ */
+int QualcommCameraHardware::previewPoolFlags() const
+{
+#if defined(PMEM_INV_CACHES) && defined(PMEM_CLEAN_CACHES)
+    if (mCachedPreview)
+        return MemoryHeapBase::READ_ONLY;
+#endif
+    return MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING;
+}
+
+/* Time CPU reads of a frame, as the callbacks and copies do, and log the
+ * average bandwidth after a few frames. Enabled with
+ * persist.camera.hal.cachebench=1.
+ */
+void QualcommCameraHardware::benchmarkFrameRead(const uint8_t *buf, int size,
+                                                bool cached)
+{
+    const uint32_t *p = (const uint32_t *)buf;
+    uint32_t sum = 0;
+    nsecs_t start = systemTime();
+    for (int i = 0; i + 4 <= size / 4; i += 4)
+        sum += p[i] + p[i + 1] + p[i + 2] + p[i + 3];
+    nsecs_t elapsed = systemTime() - start;
+
+    mCacheBenchBytes += size;
+    mCacheBenchTime += elapsed;
+    if (--mCacheBenchFrames == 0) {
+        LOGI("frame read: %s, %lld KB in %lld us, %lld MB/s (checksum %x)",
+             cached ? "cached" : "uncached",
+             mCacheBenchBytes / 1024, ns2us(mCacheBenchTime),
+             mCacheBenchTime > 0 ? mCacheBenchBytes * 1000 / mCacheBenchTime : 0LL,
+             sum);
+    }
+}
+
+/* Allocate one pmem region for all the buffers of a snapshot. The caller
+ * carves it into pools with the arena PmemPool constructor.
+ */
+sp<MemoryHeapBase> QualcommCameraHardware::allocSnapshotArena(const char *pmem_region,
+                                                               int size)
+{
+    int flags = MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING;
+    if (!mem_account_fits(size)) {
+        LOGE("snapshot arena: %d KB would exceed the camera memory budget", size / 1024);
+        return NULL;
+    }
+    sp<MemoryHeapBase> masterHeap = new MemoryHeapBase(pmem_region, size, flags);
+    if (masterHeap->getHeapID() < 0) {
+        LOGE("failed to construct snapshot arena in pmem pool %s", pmem_region);
+        return NULL;
+    }
+    sp<MemoryHeapPmem> pmemHeap = new MemoryHeapPmem(masterHeap, flags);
+    if (pmemHeap->getHeapID() < 0) {
+        LOGE("snapshot arena in %s: could not create pmem heap", pmem_region);
+        return NULL;
+    }
+    pmemHeap->slap();
+    LOGI("snapshot arena: %d bytes from %s", size, pmem_region);
+    return pmemHeap;
+}
+
+/* Preview and record pools are parked here when preview stops instead of
+ * being freed, so a following startPreview with the same configuration
+ * skips the pmem allocation and mmap. Parked pools stay mapped but are
+ * unregistered with the kernel; they are registered again, with fresh
+ * active flags, when taken back out.
+ */
+sp<QualcommCameraHardware::PmemPool> QualcommCameraHardware::getPmemPool(
+        const char *pmem_pool, int flags, int pmem_type,
+        int buffer_size, int num_buffers, int frame_size,
+        int cbcr_offset, int yoffset, const char *name)
+{
+    {
+        Mutex::Autolock l(&mPmemPoolCacheLock);
+        for (int i = 0; i < PMEM_POOL_CACHE_SIZE; i++) {
+            if (mPmemPoolCache[i] != NULL &&
+                mPmemPoolCache[i]->matches(pmem_pool, flags, pmem_type,
+                                           buffer_size, num_buffers, frame_size,
+                                           cbcr_offset, yoffset, name)) {
+                sp<PmemPool> pool = mPmemPoolCache[i];
+                mPmemPoolCache[i].clear();
+                mPmemPoolCacheHits++;
+                LOGI("%s: reusing cached pool %s", __FUNCTION__, name);
+                pool->registerBuffers(true);
+                return pool;
+            }
+        }
+    }
+    return new PmemPool(pmem_pool, flags, mCameraControlFd, pmem_type,
+                        buffer_size, num_buffers, frame_size,
+                        cbcr_offset, yoffset, name);
+}
+
+void QualcommCameraHardware::recyclePmemPool(sp<PmemPool>& pool)
+{
+    if (pool == NULL)
+        return;
+    if (pool->initialized() && pool->getStrongCount() == 1) {
+        Mutex::Autolock l(&mPmemPoolCacheLock);
+        pool->registerBuffers(false);
+        // Replace an empty slot, or else the oldest entry.
+        int slot = PMEM_POOL_CACHE_SIZE - 1;
+        for (int i = 0; i < PMEM_POOL_CACHE_SIZE; i++) {
+            if (mPmemPoolCache[i] == NULL) {
+                slot = i;
+                break;
             }
         }
+        for (int i = slot; i > 0; i--)
+            mPmemPoolCache[i] = mPmemPoolCache[i - 1];
+        mPmemPoolCache[0] = pool;
+        LOGV("%s: parked pool %s", __FUNCTION__, pool->mName);
+    }
+    pool.clear();
+    pool = NULL;
+}
+
+void QualcommCameraHardware::flushPmemPoolCache()
+{
+    Mutex::Autolock l(&mPmemPoolCacheLock);
+    for (int i = 0; i < PMEM_POOL_CACHE_SIZE; i++) {
+        if (mPmemPoolCache[i] != NULL) {
+            LOGV("%s: freeing cached pool %s", __FUNCTION__, mPmemPoolCache[i]->mName);
+            mPmemPoolCache[i].clear();
+        }
     }
+}
+
+/* Allocate a snapshot-side pmem pool. Parked preview pools may be holding
+ * the memory or the budget it needs, so on failure they are freed and the
+ * allocation is tried once more.
+ */
+sp<QualcommCameraHardware::PmemPool> QualcommCameraHardware::allocPmemPool(
+        const char *pmem_pool, int flags, int pmem_type,
+        int buffer_size, int num_buffers, int frame_size,
+        int cbcr_offset, int yoffset, const char *name)
+{
+    sp<PmemPool> pool = new PmemPool(pmem_pool, flags, mCameraControlFd,
+                                     pmem_type, buffer_size, num_buffers,
+                                     frame_size, cbcr_offset, yoffset, name);
+    if (!pool->initialized()) {
+        LOGI("%s: retrying %s without cached preview pools", __FUNCTION__, name);
+        pool.clear();
+        flushPmemPoolCache();
+        pool = new PmemPool(pmem_pool, flags, mCameraControlFd,
+                            pmem_type, buffer_size, num_buffers,
+                            frame_size, cbcr_offset, yoffset, name);
+    }
+    return pool;
+}
+
+QualcommCameraHardware::PmemPool::~PmemPool()
+{
+    LOGI("%s: %s E", __FUNCTION__, mName);
+    // Unregister the buffers with the camera drivers.
+    registerBuffers(false);
     LOGV("destroying PmemPool %s: closing control fd %d",
          mName,
          mCameraControlFd);
@@ -7072,6 +10884,13 @@ QualcommCameraHardware::MemPool::~MemPool()
     if (mFrameSize > 0)
         delete [] mBuffers;
     mHeap.clear();
+    if (mAccountedBytes > 0) {
+        Mutex::Autolock l(&mem_account_lock);
+        mem_account_charge(mAccountType, -mAccountedBytes);
+        if (strcmp(mAccountType, mAccountRegion))
+            mem_account_charge(mAccountRegion, -mAccountedBytes);
+        mem_account_total -= mAccountedBytes;
+    }
     LOGV("destroying MemPool %s completed", mName);
 }
 
@@ -7147,6 +10966,7 @@ static void receive_camframe_callback(struct msm_frame *frame)
     sp<QualcommCameraHardware> obj = QualcommCameraHardware::getInstance();
     if (obj != 0) {
         obj->receivePreviewFrame(frame);
+        obj->cleanFrame(frame);
     }
     if (timeoutCount != 0)
     {
@@ -7333,9 +11153,8 @@ bool QualcommCameraHardware::storePreviewFrameForPostview(void) {
     if(mPostViewHeap == NULL) {
         int CbCrOffset = PAD_TO_WORD(mPreviewFrameSize * 2/3);
         mPostViewHeap =
-           new PmemPool("/dev/pmem_adsp",
+           allocPmemPool("/dev/pmem_adsp",
            MemoryHeapBase::READ_ONLY | MemoryHeapBase::NO_CACHING,
-           mCameraControlFd,
            MSM_PMEM_PREVIEW, //MSM_PMEM_OUTPUT2,
            mPreviewFrameSize,
            1,
@@ -7495,6 +11314,10 @@ void QualcommCameraHardware::getCameraInfo()
     int i, ret;
 
     LOGV("%s E", __FUNCTION__);
+    if (caps_cache_load_camera_info()) {
+        LOGV("HAL_numOfCameras: %d (cached)\n", HAL_numOfCameras);
+        return;
+    }
     int camfd = open(MSM_CAMERA_CONTROL, O_RDWR);
     if (camfd >= 0) {
         ret = ioctl(camfd, MSM_CAM_IOCTL_GET_CAMERA_INFO, &camInfo);
@@ -7519,6 +11342,13 @@ void QualcommCameraHardware::getCameraInfo()
                   HAL_cameraInfo[i].position, HAL_cameraInfo[i].sensor_mount_angle, HAL_cameraInfo[i].modes_supported);
         }
         HAL_numOfCameras = camInfo.num_cameras;
+        if (HAL_numOfCameras > 0 && HAL_numOfCameras <= MSM_MAX_CAMERA_SENSORS) {
+            caps_cache_camera_info ci;
+            memset(&ci, 0, sizeof(ci));
+            ci.num = HAL_numOfCameras;
+            memcpy(ci.info, HAL_cameraInfo, sizeof(ci.info));
+            caps_cache_store_camera_info(&ci);
+        }
     }
     LOGV("HAL_numOfCameras: %d\n", HAL_numOfCameras);
     LOGV("%s X", __FUNCTION__);
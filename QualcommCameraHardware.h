@@ -29,6 +29,8 @@ extern "C" {
 #include <linux/android_pmem.h>
 #include "msm_camera.h"
 #include "QCamera_Intf.h"
+#include "FaceDetector.h"
+#include "ImageProcessing.h"
 }
 // Extra propriatary stuff (mostly from CM)
 #define MSM_CAMERA_CONTROL "/dev/msm_camera/control0"
@@ -36,6 +38,17 @@ extern "C" {
 #define TRUE 1
 #define FALSE 0
 
+#define MAX_BRACKET_FRAMES FUSION_MAX_FRAMES
+#define PMEM_POOL_CACHE_SIZE 2
+#define PARAM_HANDLER_MAX 40    // at least the entries in kParamHandlers, checked at build time
+#define PARM_QUEUE_SIZE 32
+#define PARM_CMD_VALUE_MAX 32   // larger control values are sent synchronously
+#define PARM_DRIVER_TIMEOUT_MS 5000 // timeout_ms of a control command
+#define AF_LATENCY_BUCKETS 7    // under 50 ms, then doubling up to 1600 ms and over
+#define AF_SHARPNESS_HISTORY 8
+#define SCENE_GRID_W 8
+#define SCENE_GRID_H 6
+
 typedef struct {
 	uint32_t in1_w;
 	uint32_t out1_w;
@@ -197,6 +210,35 @@ struct board_property{
 
 namespace android {
 
+// Immutable copy of the applied parameters. setParameters publishes a new
+// version; readers outside mLock hold a reference for as long as they use
+// it, so they see one consistent set even while a newer one is applied.
+struct param_snapshot : public LightRefBase<param_snapshot> {
+    uint32_t version;
+    CameraParameters params;
+    // parsed once when published, for the capture and focus paths
+    int previewWidth, previewHeight;
+    int pictureWidth, pictureHeight;
+    int thumbnailWidth, thumbnailHeight;
+    int jpegQuality;
+    int thumbnailQuality;
+    int rotation;
+    int exposureCompensation;
+    float focalLength;
+    bool rawPicture;
+    const char *focusMode;      // into params, may be NULL
+    const char *dateTime;       // into params, may be NULL
+};
+
+// Contrast of the AF ROI in one preview frame, for a software AF search on
+// sensors that report no AF statistics. value is the Tenengrad measure: the
+// mean squared Sobel gradient magnitude of the luma over the ROI.
+struct af_sharpness {
+    nsecs_t timestamp;          // of the preview frame
+    int x, y, dx, dy;           // ROI in preview pixels
+    uint32_t value;
+};
+
 class QualcommCameraHardware : public CameraHardwareInterface {
 public:
 
@@ -244,6 +286,7 @@ public:
     static sp<QualcommCameraHardware> getInstance();
 
     void receivePreviewFrame(struct msm_frame *frame);
+    void cleanFrame(struct msm_frame *frame);
     void receiveLiveSnapshot(uint32_t jpeg_size);
     void receiveCameraStats(camstats_type stype, camera_preview_histogram_info* histinfo);
     void receiveRecordingFrame(struct msm_frame *frame);
@@ -251,8 +294,10 @@ public:
     void jpeg_set_location();
     void receiveJpegPictureFragment(uint8_t *buf, uint32_t size);
     void notifyShutter(common_crop_t *crop, bool mPlayShutterSoundOnly);
+    void notifyParamsChanged();
     void receive_camframe_error_timeout();
     static void getCameraInfo();
+    int getAfSharpness(af_sharpness *out, int max) const;
 
 private:
     QualcommCameraHardware();
@@ -266,6 +311,10 @@ private:
     void stopPreviewInternal();
     friend void *auto_focus_thread(void *user);
     void runAutoFocus();
+    bool runAutoFocusPass();
+    void startAutoFocusThread();
+    void stopAutoFocusThread();
+    void queueAutoFocusRoi(const roi_info_t &roi);
     status_t cancelAutoFocusInternal();
     bool native_set_dimension (int camfd);
     bool native_jpeg_encode (void);
@@ -326,10 +375,18 @@ private:
         int mAlignedBufferSize;
         int mNumBuffers;
         int mFrameSize;
+        int mBaseOffset;    // offset of the first buffer within mHeap
         sp<MemoryHeapBase> mHeap;
         sp<MemoryBase> *mBuffers;
 
         const char *mName;
+
+        // Bytes charged to the memory accountant and the accounts charged
+        bool account(const char *type, const char *region, int bytes,
+                     bool enforce = true);
+        int mAccountedBytes;
+        const char *mAccountType;
+        const char *mAccountRegion;
     };
 
     struct AshmemPool : public MemPool {
@@ -344,7 +401,22 @@ private:
                  int buffer_size, int num_buffers,
                  int frame_size, int cbcr_offset,
                  int yoffset, const char *name);
+        PmemPool(const sp<MemoryHeapBase>& arena, int offset,
+                 int control_camera_fd, int pmem_type,
+                 int buffer_size, int num_buffers,
+                 int frame_size, int cbcr_offset,
+                 int yoffset, const char *name);
         virtual ~PmemPool();
+        void registerBuffers(bool reg);
+        void invalidate(int index);
+        void clean(int index);
+        bool matches(const char *pmem_pool, int flags, int pmem_type,
+                     int buffer_size, int num_buffers, int frame_size,
+                     int cbcr_offset, int yoffset, const char *name) const;
+        const char *mPmemPool;
+        int mFlags;
+        bool mCached;
+        bool mRegistered;
         int mFd;
         int mPmemType;
         int mCbCrOffset;
@@ -356,6 +428,7 @@ private:
     };
 
     sp<PmemPool> mPreviewHeap;
+    sp<PmemPool> mPreviewHeapNext;  // allocated ahead of a reconfiguration
     sp<PmemPool> mRecordHeap;
     sp<PmemPool> mThumbnailHeap;
     sp<PmemPool> mRawHeap;
@@ -364,17 +437,47 @@ private:
     sp<AshmemPool> mStatHeap;
     sp<AshmemPool> mMetaDataHeap;
     sp<PmemPool> mRawSnapShotPmemHeap;
+    sp<AshmemPool> mRawUnpackedHeap;
+    sp<AshmemPool> mDngHeap;
     sp<PmemPool> mPostViewHeap;
+    // One pmem region carved into the snapshot and postview buffers
+    sp<MemoryHeapBase> mSnapshotArena;
+    sp<MemoryHeapBase> allocSnapshotArena(const char *pmem_region, int size);
 
 
     sp<MMCameraDL> mMMCameraDLRef;
 
+    // Preview and record pools parked between preview sessions
+    sp<PmemPool> mPmemPoolCache[PMEM_POOL_CACHE_SIZE];
+    Mutex mPmemPoolCacheLock;
+    int mPmemPoolCacheHits;
+    sp<PmemPool> getPmemPool(const char *pmem_pool, int flags, int pmem_type,
+                             int buffer_size, int num_buffers, int frame_size,
+                             int cbcr_offset, int yoffset, const char *name);
+    void recyclePmemPool(sp<PmemPool>& pool);
+    void flushPmemPoolCache();
+    sp<PmemPool> allocPmemPool(const char *pmem_pool, int flags, int pmem_type,
+                               int buffer_size, int num_buffers, int frame_size,
+                               int cbcr_offset, int yoffset, const char *name);
+
+    // Cached mapping of the preview and record pools
+    bool mCachedPreview;
+    int previewPoolFlags() const;
+    int mCacheBenchFrames;
+    long long mCacheBenchBytes;
+    nsecs_t mCacheBenchTime;
+    void benchmarkFrameRead(const uint8_t *buf, int size, bool cached);
+    void freeVideoFrame(struct msm_frame *frame);
+
     bool startCamera();
     bool initPreview();
+    status_t reconfigurePreview();
     bool initRecord();
     void deinitPreview();
     bool initRaw(bool initJpegHeap);
     bool initLiveSnapshot(int videowidth, int videoheight);
+    bool initSoftLiveSnapshot(int width, int height, int frameSize);
+    void deinitSoftLiveSnapshot();
     bool initRawSnapshot();
     void deinitRaw();
     void deinitRawSnapshot();
@@ -393,18 +496,115 @@ private:
     friend void *video_thread(void *user);
     void runVideoThread(void *data);
 
+    // Software live snapshot, for targets without VFE liveshot support.
+    // The next video frame is pinned (or copied, when it comes from the
+    // preview heap) and encoded on a detached thread.
+    sp<PmemPool> mLiveShotHeap;
+    bool mLiveShotPending;
+    bool mLiveShotThreadRunning;
+    bool mLiveShotEncoding;
+    bool mLiveShotFrameReleased;
+    struct msm_frame *mLiveShotFrame;
+    int mLiveShotWidth, mLiveShotHeight;
+    Mutex mLiveShotThreadWaitLock;
+    Condition mLiveShotThreadWait;
+    friend void *liveshot_thread(void *user);
+    void runLiveShotThread(void *data);
+    bool startLiveShotThread(struct msm_frame *frame, const uint8_t *buf);
+
     // For Histogram
     int mStatsOn;
     int mCurrent;
     bool mSendData;
     Mutex mStatsWaitLock;
     Condition mStatsWait;
+    bool mStatsFromDriver;      // libmmcamera delivered stats since enable
+    void sendStats(uint32_t maxValue, const uint32_t *bins);
+
+    // Software histogram, used until the driver delivers stats. The frame
+    // thread copies a subsampled set of luma rows to mHistBuf and
+    // histogram_thread bins them into mStatHeap.
+    pthread_t mHistThread;
+    bool mHistThreadRunning;
+    bool mHistExit;
+    Mutex mHistLock;
+    Condition mHistWait;
+    uint8_t *mHistBuf;
+    int mHistBufSize;
+    bool mHistQueued;
+    int mHistWidth, mHistRows, mHistStep;
+    int mHistFrames;
+    int mHistDropped;
+    nsecs_t mHistTimeTotal;
+    friend void *histogram_thread(void *user);
+    void runHistogramThread();
+    void startHistogramThread();
+    void stopHistogramThread();
+    void queueHistogram(const uint8_t *luma, int stride, int width, int height);
 
     //For Face Detection
     int mFaceDetectOn;
-    bool mSendMetaData;
+    bool mSendMetaData;         // no metadata callback is in progress
+    int mMetaDataIndex;         // buffer of mMetaDataHeap handed out last
     Mutex mMetaDataWaitLock;
 
+    // Software face detection. With a cascade loaded, the frame thread
+    // hands every 4th pair of luma rows to face_thread, which builds a 1/4
+    // scale pyramid, runs the cascade and publishes the faces through
+    // mMetaDataHeap. Frames are skipped so that detection stays within
+    // mFdBudget percent of one core.
+    face_cascade *mFaceCascade;
+    pthread_t mFdThread;
+    bool mFdThreadRunning;
+    bool mFdExit;
+    Mutex mFdLock;
+    Condition mFdWait;
+    uint8_t *mFdBuf;
+    int mFdBufSize;
+    bool mFdQueued;
+    int mFdWidth, mFdHeight;    // of the preview frame in mFdBuf
+    nsecs_t mFdQueuedTime;
+    nsecs_t mFdNextTime;        // no frame is taken before this
+    int mFdBudget;
+    int mFdFrames;
+    int mFdSkipped;
+    int mFdUnsent;              // results dropped during a metadata callback
+    int mFdFaces;
+    int mFdLastFaces;           // in the latest processed frame
+    int mFdPrevRects[FACE_METADATA_FACES * 4];  // faces of the last result
+    int mFdPrevIds[FACE_METADATA_FACES];
+    int mFdNextId;
+    nsecs_t mFdStartTime;
+    nsecs_t mFdTimeTotal;
+    nsecs_t mFdTimeMax;
+    nsecs_t mFdLatencyTotal;
+    friend void *face_thread(void *user);
+    void runFaceThread();
+    void startFaceThread();
+    void stopFaceThread();
+    void queueFaceDetection(const uint8_t *luma, int stride, int width, int height);
+    void trackFaces(const int *rects, int count, int *ids);
+    void sendFaces(const int *rects, const int *scores, const int *ids,
+                   int count);
+
+    // Software scene detection. With scene-detect on, receivePreviewFrame
+    // sums luma, bright pixels and chroma over a SCENE_GRID_W x
+    // SCENE_GRID_H grid, skipping rows so the work stays within
+    // mSceneBudgetUs, and classifies the grid. A scene is reported once it
+    // has won SCENE_HOLD_FRAMES frames in a row.
+    bool mSceneDetectOn;
+    int mSceneRowStep;
+    int mSceneBudgetUs;
+    int mSceneCurrent;          // camera_bestshot_mode_type
+    int mSceneCandidate;
+    int mSceneCandidateFrames;
+    int mSceneFrames;
+    int mSceneChanges;
+    nsecs_t mSceneTimeTotal;
+    nsecs_t mSceneTimeMax;
+    void detectScene(const uint8_t *frame, int stride, int width, int height,
+                     int cbcrOffset, int cbcrStride);
+
     bool mShutterPending;
     Mutex mShutterLock;
 
@@ -428,7 +628,64 @@ private:
     void debugShowVideoFPS() const;
 
     int mSnapshotFormat;
+    int mRawFormat;
+    uint16_t mRawBlackLevel;
+    int mRawContainer;
+
+    // Exposure bracketing
+    int mBracketMode;
+    int mBracketCount;
+    int mBracketSteps[MAX_BRACKET_FRAMES];
+    int mBracketCaptured;
+    nsecs_t mBracketStartTime;
+    sp<AshmemPool> mBracketHeap;
+    int mBracketMerge;
+    bool setBracketExposure(int numerator);
+    bool captureBracket(int count, const int *evSteps);
+    void mergeBracket();
+
+    // Multi-frame denoise, captured and merged through the bracket path
+    int mDenoiseMode;
+    int mDenoiseFrames;
+    bool useMultiFrameDenoise();
     bool mFirstFrame;
+    nsecs_t mOpenTime;    // cleared once the first preview frame arrives
+    mutable Mutex mReconfigLock; // frame thread vs. reconfigurePreview()
+    nsecs_t mLastPreviewFrameTime;
+    nsecs_t mReconfigGapStart;  // last frame before a reconfiguration
+    int mReconfigCount;
+    nsecs_t mReconfigGapLast;
+    nsecs_t mReconfigGapMax;
+
+    // Camera open is split into independent tasks started from the
+    // constructor; startCamera() and initDefaultParameters() join them
+    // only where a result is needed.
+    enum {
+        OPEN_TASK_SENSOR,     // control device open
+        OPEN_TASK_SYMBOLS,    // dlopen and libmmcamera symbol binding
+        OPEN_TASK_FB,         // framebuffer open on non-MDP targets
+        OPEN_TASK_CAPS,       // sensor-independent capability strings
+        OPEN_TASK_MAX
+    };
+    struct open_task {
+        QualcommCameraHardware *obj;
+        int id;
+        pthread_t thread;
+        bool running;
+        bool ok;
+        nsecs_t elapsed;
+    };
+    open_task mOpenTasks[OPEN_TASK_MAX];
+    nsecs_t mConfigInitTime;
+    friend void *open_task_thread(void *user);
+    bool runOpenTask(int id);
+    void startOpenTask(int id);
+    bool joinOpenTask(int id);
+    bool bindLibmmcamera();
+    void initStaticCapabilityStrings();
+    bool loadCapabilityCache();
+    void storeCapabilityCache();
+    void logOpenBreakdown(nsecs_t defaultsTime);
     void hasAutoFocusSupport();
     void filterPictureSizes();
     void filterPreviewSizes();
@@ -464,6 +721,9 @@ private:
     status_t setLensshadeValue(const CameraParameters& params);
     status_t setISOValue(const CameraParameters& params);
     status_t setPictureFormat(const CameraParameters& params);
+    status_t setRawFormat(const CameraParameters& params);
+    status_t setExposureBracketing(const CameraParameters& params);
+    status_t setMultiFrameDenoise(const CameraParameters& params);
     status_t setSharpness(const CameraParameters& params);
     status_t setContrast(const CameraParameters& params);
     status_t setSaturation(const CameraParameters& params);
@@ -475,6 +735,95 @@ private:
     status_t setPreviewFormat(const CameraParameters& params);
     status_t setSelectableZoneAf(const CameraParameters& params);
     void setGpsParameters();
+
+    sp<param_snapshot> getSnapshot() const;
+    void publishParameters();
+    mutable Mutex mSnapshotLock;
+    sp<param_snapshot> mSnapshot;
+    uint32_t mSnapshotVersion;
+
+    // setParameters only runs the handlers whose keys differ from the
+    // applied values in mParameters, in the order of kParamHandlers.
+    struct param_handler {
+        const char *name;
+        status_t (QualcommCameraHardware::*apply)(const CameraParameters& params);
+        const char *const *keys;    // NULL terminated
+        bool bestshotOffOnly;       // applied only when the scene mode is off
+    };
+    static const param_handler kParamHandlers[];
+    int mParamHandlerIoctls[PARAM_HANDLER_MAX]; // ioctls issued when last run
+    int mSetParmCount;
+    int mParamIoctlsIssued;
+    int mParamIoctlsSkipped;
+    int mParamIoctlsFailed;
+    int mSetParamsCalls;
+    nsecs_t mSetParamsTime;
+    bool mApplyAllParams;
+
+    // Control executor. parm_thread issues the commands sent through
+    // native_set_parm(): callers queue a command and wait on its sequence
+    // number for at most mParmDeadline, never less than the driver's own
+    // timeout. A command that misses its deadline is skipped if it has not
+    // been issued yet. Between beginParmBatch() and endParmBatch() the
+    // calling thread does not wait per command, so the commands are
+    // pipelined behind its own work.
+    // Preview, video, snapshot, recording and zoom query commands are
+    // issued on the calling thread between beginParmSync() and
+    // endParmSync(), which hold parm_thread idle. Autofocus runs on its own
+    // fd, and the COMMAND_2 aborts (AF cancel, snapshot stop) have no
+    // response to wait for, so those stay direct. CAMERA_EXIT is sent
+    // after stopParmThread().
+    struct parm_cmd {
+        uint32_t seq;
+        cam_ctrl_type type;
+        uint16_t length;
+        uint8_t value[PARM_CMD_VALUE_MAX];
+        int handler;    // index in kParamHandlers, -1 outside setParameters
+        pthread_t owner;
+        bool batched;
+        bool cancelled; // timed out before parm_thread issued it
+        bool late;      // timed out while in the driver
+        nsecs_t queued;
+        int rc;         // ioctl return value
+        int status;     // driver status of the command
+        int err;        // errno of a failed ioctl
+    };
+    parm_cmd mParmQueue[PARM_QUEUE_SIZE];
+    uint32_t mParmSeq;          // sequence number of the next command
+    uint32_t mParmDone;         // commands before this one have completed
+    int mParmFailed;            // batched commands rejected in this batch
+    bool mParmHandlerFailed[PARAM_HANDLER_MAX]; // handlers with one of them
+    bool mParmBatchOpen;
+    bool mParmIssuing;          // mParmDone is in the driver
+    bool mParmSyncHeld;         // a caller is issuing on its own thread
+    pthread_t mParmBatchThread;
+    int mParmHandler;
+    nsecs_t mParmDeadline;
+    bool mParmThreadRunning;
+    bool mParmThreadExit;
+    pthread_t mParmThread;
+    Mutex mParmLock;
+    Condition mParmWait;
+    int mParmMaxDepth;
+    int mParmTimeouts;
+    uint32_t mParmCompleted;
+    nsecs_t mParmLatencyTotal;
+    nsecs_t mParmLatencyMax;
+    friend void *parm_thread(void *user);
+    void runParmThread();
+    void startParmThread();
+    void stopParmThread();
+    bool inParmBatch();
+    void beginParmBatch();
+    int endParmBatch(bool *failedHandlers);
+    bool queueParm(cam_ctrl_type type, uint16_t length, void *value, uint32_t *seq);
+    bool waitParm(uint32_t seq, int *rc, int *status, int *err);
+    void cancelParm(uint32_t last);
+    void drainParm();
+    void beginParmSync();
+    void endParmSync();
+    bool native_ctrl(bool (*command)(int camfd));
+    int issueParm(cam_ctrl_type type, uint16_t length, void *value, int *status);
     bool storePreviewFrameForPostview();
     bool isValidDimension(int w, int h);
     status_t updateFocusDistances(const char *focusmode);
@@ -488,6 +837,7 @@ private:
 
     bool receiveRawPicture(void);
     bool receiveRawSnapshot(void);
+    uint32_t writeDngSnapshot(void);
 
     Mutex mCallbackLock;
     Mutex mOverlayLock;
@@ -516,10 +866,58 @@ private:
     struct msm_camsensor_info mSensorInfo;
     cam_ctrl_dimension_t mDimension;
     bool mAutoFocusThreadRunning;
-    Mutex mAutoFocusThreadLock;
-    int mAutoFocusFd;
-
-    Mutex mAfLock;
+    pthread_t mAutoFocusThread;
+    int mAutoFocusFd;           // held open while the AF thread runs
+
+    // The AF thread lives for the camera session and takes its work from
+    // mAfPending: a start request, the latest AF ROI, or exit. Requests that
+    // arrive before the thread picks them up collapse into one, and a start
+    // that arrives during a pass restarts it with a single callback.
+    // During a pass the thread re-checks the focus state when a preview
+    // frame arrives, since that is when the AF statistics move, or when a
+    // request or cancel comes in, instead of sleeping a fixed 100 ms.
+    Mutex mAfEventLock;
+    Condition mAfEvent;
+    int mAfPending;             // AF_CMD_* bits
+    roi_info_t mAfRoi;
+    bool mAfBusy;               // a pass is in progress
+    volatile bool mAfWaiting;
+    bool mAfCancelled;
+    int mAfCoalesced;
+    bool waitAfEvent(nsecs_t deadline);
+    void signalAfEvent(bool cancel);
+    nsecs_t mAfRequestTime;
+    int mAfLatencyHist[AF_LATENCY_BUCKETS];    // autoFocus() to callback
+    int mAfStateChecks;
+
+    // Contrast AF metric. While an AF pass runs, or on every frame with
+    // persist.camera.hal.afmetric=1 (the default without autofocus),
+    // receivePreviewFrame copies the AF ROI luma to mSharpBuf for
+    // sharpness_thread, or drops the frame if the thread is still busy
+    // with the previous one. getParameters() reports the newest value as
+    // af-sharpness.
+    pthread_t mSharpThread;
+    bool mSharpThreadRunning;
+    bool mSharpExit;
+    bool mSharpEnabled;
+    mutable Mutex mSharpLock;
+    Condition mSharpWait;
+    uint8_t *mSharpBuf;         // ROI plus a one pixel border
+    int mSharpBufSize;
+    bool mSharpQueued;
+    af_sharpness mSharpPending;
+    int mSharpRoi[4];           // x, y, dx, dy; dx 0 selects the centre
+    af_sharpness mSharpHistory[AF_SHARPNESS_HISTORY];
+    int mSharpCount;
+    int mSharpDropped;
+    nsecs_t mSharpTimeTotal;
+    friend void *sharpness_thread(void *user);
+    void runSharpnessThread();
+    void startSharpnessThread();
+    void stopSharpnessThread();
+    void setSharpnessRoi(const roi_info_t &roi);
+    void queueSharpness(const uint8_t *luma, int stride, int width, int height,
+                        nsecs_t timestamp);
 
     pthread_t mFrameThread;
     pthread_t mVideoThread;
@@ -31,6 +31,8 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include <cutils/log.h>
 #include "Overlay.h"
@@ -38,7 +40,10 @@
 #include <hardware/camera.h>
 #include <binder/IMemory.h>
 #include "CameraHardwareInterface.h"
+#include "FaceDetector.h"
 #include <cutils/properties.h>
+#include <cutils/atomic.h>
+#include <utils/Timers.h>
 
 using android::sp;
 using android::Overlay;
@@ -54,6 +59,7 @@ using android::HAL_getNumberOfCameras;
 using android::HAL_openCameraHardware;
 #endif
 using android::CameraHardwareInterface;
+using android::face_metadata;
 
 #ifdef BOARD_USE_FROYO_LIBCAMERA
 extern "C" android::sp<android::CameraHardwareInterface> openCameraHardware(int id);
@@ -105,8 +111,31 @@ typedef struct priv_camera_device {
     int preview_height;
     sp<Overlay> overlay;
     gralloc_module_t const *gralloc;
+    /* parameter cache, see params_touch() */
+    pthread_mutex_t params_lock;
+    volatile int32_t params_gen;
+    struct param_blob *params_get;
+    struct param_blob *params_set;
+    int params_set_rv;
+    time_t params_date;
+    char params_date_str[20];
+    unsigned params_get_hits;
+    unsigned params_get_misses;
+    unsigned params_set_skips;
 } priv_camera_device_t;
 
+/* Flattened parameter string handed out by camera_get_parameters() and
+ * remembered by camera_set_parameters(). Strings returned to the framework
+ * are shared and reference counted; camera_put_parameters() drops the
+ * reference instead of freeing them. */
+typedef struct param_blob {
+    int32_t refs;
+    int32_t gen;
+    time_t date;
+    size_t length;
+    char data[1];
+} param_blob_t;
+
 
 static struct {
     int type;
@@ -123,6 +152,8 @@ static struct {
     {0x0100, "CAMERA_MSG_COMPRESSED_IMAGE"},
     {0x0200, "CAMERA_MSG_RAW_IMAGE_NOTIFY"},
     {0x0400, "CAMERA_MSG_PREVIEW_METADATA"},
+    {0x10000, "CAMERA_MSG_SCENE_DETECT"}, //vendor, outside ALL_MSGS
+    {0x20000, "CAMERA_MSG_PARAMS_CHANGED"}, //vendor, never forwarded
     {0x0000, "CAMERA_MSG_ALL_MSGS"}, //0xFFFF
     {0x0000, "NULL"},
 };
@@ -139,6 +170,53 @@ static void dump_msg(const char *tag, int msg_type)
 #endif
 }
 
+/*******************************************************************
+ * parameter cache
+ *******************************************************************/
+
+/* Every call that may change the HAL parameters bumps params_gen. The
+ * cached get string and the last accepted set string are only valid for
+ * the generation they were built at, so polling between state changes
+ * costs a reference count, or a string compare on set, and no allocation. */
+static void params_touch(priv_camera_device_t *dev)
+{
+    android_atomic_inc(&dev->params_gen);
+}
+
+static param_blob_t *param_blob_alloc(const char *str, size_t length)
+{
+    param_blob_t *blob;
+
+    blob = (param_blob_t *)malloc(offsetof(param_blob_t, data) + length + 1);
+    if (!blob)
+        return NULL;
+    blob->refs = 1;
+    blob->gen = 0;
+    blob->date = 0;
+    blob->length = length;
+    memcpy(blob->data, str, length);
+    blob->data[length] = '\0';
+    return blob;
+}
+
+/* called with params_lock held */
+static void param_blob_put(param_blob_t *blob)
+{
+    if (blob && --blob->refs == 0)
+        free(blob);
+}
+
+static const char *params_exif_date(priv_camera_device_t *dev, time_t date)
+{
+    if (date != dev->params_date) {
+        if (strftime(dev->params_date_str, sizeof(dev->params_date_str),
+                     "%Y-%m-%d %H.%M.%S", localtime(&date)) == 0)
+            dev->params_date_str[0] = '\0';
+        dev->params_date = date;
+    }
+    return dev->params_date_str;
+}
+
 /*******************************************************************
  * overlay hook
  *******************************************************************/
@@ -175,6 +253,37 @@ static void wrap_set_crop_hook(void *data,
     window->set_crop(window, x, y, w, h);
 }
 
+/* The HAL restarts a running preview in place when setParameters()
+ * changes its size; it resizes the overlay while no frames are flowing so
+ * the window geometry and the copy size follow before the first new frame. */
+static void wrap_resize_input_hook(void *data,
+                                   uint32_t width, uint32_t height)
+{
+    priv_camera_device_t* dev = NULL;
+    preview_stream_ops* window = NULL;
+    ALOGV("%s+++: %p %ux%u", __FUNCTION__, data, width, height);
+
+    if(!data)
+        return;
+
+    dev = (priv_camera_device_t*) data;
+
+    window = dev->window;
+
+    if (window == 0)
+        return;
+
+    if (window->set_buffers_geometry(window, width, height,
+                                     HAL_PIXEL_FORMAT_YCrCb_420_SP)) {
+        ALOGE("%s: could not set buffers geometry to %ux%u",
+             __FUNCTION__, width, height);
+        return;
+    }
+
+    dev->preview_width = width;
+    dev->preview_height = height;
+}
+
 //QiSS ME for preview
 static void wrap_queue_buffer_hook(void *data, void* buffer)
 {
@@ -332,12 +441,63 @@ static void wrap_notify_callback(int32_t msg_type, int32_t ext1,
 
     dev = (priv_camera_device_t*) user;
 
+    /* focus, zoom and scene events may come with parameter updates */
+    params_touch(dev);
+
+    /* only meant for the cache above, the framework does not know it */
+    if (msg_type == CAMERA_MSG_PARAMS_CHANGED)
+        return;
+
     if (dev->notify_callback)
         dev->notify_callback(msg_type, ext1, ext2, dev->user);
 
     ALOGV("%s---", __FUNCTION__);
 }
 
+/* The HAL reports faces in preview pixels (see face_metadata); the
+ * framework wants them in the -1000..1000 preview coordinates of
+ * camera_frame_metadata_t. faces must hold FACE_METADATA_FACES entries. */
+static bool wrap_face_metadata(priv_camera_device_t *dev,
+                               const sp<IMemory>& dataPtr,
+                               camera_frame_metadata_t *metadata,
+                               camera_face_t *faces)
+{
+    ssize_t offset;
+    size_t size;
+    sp<IMemoryHeap> heap;
+    int width = dev->preview_width;
+    int height = dev->preview_height;
+
+    heap = dataPtr->getMemory(&offset, &size);
+    if (heap == 0 || size < sizeof(face_metadata) || width <= 0 || height <= 0)
+        return false;
+
+    const face_metadata *meta =
+        (const face_metadata *)((char *)(heap->base()) + offset);
+    int count = meta->values / 4;
+    if (count < 0 || count > FACE_METADATA_FACES)
+        return false;
+
+    for (int i = 0; i < count; i++) {
+        const int32_t *r = meta->rect[i];
+        camera_face_t *face = &faces[i];
+        int32_t edges[4] = { r[0], r[1], r[0] + r[2], r[1] + r[3] };
+        for (int k = 0; k < 4; k++) {
+            int v = edges[k] * 2000 / (k & 1 ? height : width) - 1000;
+            face->rect[k] = v < -1000 ? -1000 : v > 1000 ? 1000 : v;
+        }
+        face->score = meta->score[i];
+        face->id = meta->id[i];
+        /* no landmarks */
+        face->left_eye[0] = face->left_eye[1] = -2000;
+        face->right_eye[0] = face->right_eye[1] = -2000;
+        face->mouth[0] = face->mouth[1] = -2000;
+    }
+    metadata->number_of_faces = count;
+    metadata->faces = faces;
+    return true;
+}
+
 //QiSS ME for capture
 static void wrap_data_callback(int32_t msg_type, const sp<IMemory>& dataPtr,
                                void* user)
@@ -361,8 +521,16 @@ static void wrap_data_callback(int32_t msg_type, const sp<IMemory>& dataPtr,
 
     data = wrap_memory_data(dev, dataPtr);
 
+    /* faces only reach applications with a camera_frame_metadata_t */
+    camera_frame_metadata_t metadata;
+    camera_face_t faces[FACE_METADATA_FACES];
+    camera_frame_metadata_t *pmetadata = NULL;
+    if (msg_type == CAMERA_MSG_PREVIEW_METADATA &&
+            wrap_face_metadata(dev, dataPtr, &metadata, faces))
+        pmetadata = &metadata;
+
     if (dev->data_callback)
-        dev->data_callback(msg_type, data, 0, NULL, dev->user);
+        dev->data_callback(msg_type, data, 0, pmetadata, dev->user);
 
     if ( NULL != data ) {
         data->release(data);
@@ -503,7 +671,8 @@ int camera_set_preview_window(struct camera_device * device,
         dev->overlay =  new Overlay(wrap_set_fd_hook,
                                     wrap_set_crop_hook,
                                     wrap_queue_buffer_hook,
-                                    (void *)dev);
+                                    (void *)dev,
+                                    wrap_resize_input_hook);
     }
     gCameraHals[dev->cameraid]->setOverlay(dev->overlay);
 
@@ -613,6 +782,7 @@ int camera_start_preview(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     rv = gCameraHals[dev->cameraid]->startPreview();
+    params_touch(dev);
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
@@ -630,6 +800,7 @@ void camera_stop_preview(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     gCameraHals[dev->cameraid]->stopPreview();
+    params_touch(dev);
     ALOGI("%s---", __FUNCTION__);
 }
 
@@ -684,6 +855,7 @@ int camera_start_recording(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     rv = gCameraHals[dev->cameraid]->startRecording();
+    params_touch(dev);
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
@@ -704,6 +876,7 @@ void camera_stop_recording(struct camera_device * device)
 
     //QiSS ME force start preview when recording stop
     gCameraHals[dev->cameraid]->startPreview();
+    params_touch(dev);
 
     ALOGI("%s---", __FUNCTION__);
 }
@@ -762,6 +935,7 @@ int camera_auto_focus(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     rv = gCameraHals[dev->cameraid]->autoFocus();
+    params_touch(dev);
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
@@ -780,6 +954,7 @@ int camera_cancel_auto_focus(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     rv = gCameraHals[dev->cameraid]->cancelAutoFocus();
+    params_touch(dev);
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
@@ -803,6 +978,7 @@ int camera_take_picture(struct camera_device * device)
         CAMERA_MSG_COMPRESSED_IMAGE);
 
     rv = gCameraHals[dev->cameraid]->takePicture();
+    params_touch(dev);
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
@@ -821,6 +997,7 @@ int camera_cancel_picture(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     rv = gCameraHals[dev->cameraid]->cancelPicture();
+    params_touch(dev);
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
@@ -831,51 +1008,72 @@ int camera_set_parameters(struct camera_device * device, const char *params)
     int rv = -EINVAL;
     priv_camera_device_t* dev = NULL;
     CameraParameters camParams;
+    param_blob_t *blob;
+    int32_t gen;
 
     ALOGI("%s+++: device %p", __FUNCTION__, device);
 
-    if(!device)
+    if(!device || !params)
         return rv;
 
     dev = (priv_camera_device_t*) device;
 
-    String8 params_str8(params);
+    /* Add timestamp */
+    char str[20];
+    const time_t date = time(NULL) + 1;
+
+    /* The same string within the same second, with nothing in between
+     * that could have changed the HAL state, is a no-op. */
+    pthread_mutex_lock(&dev->params_lock);
+    blob = dev->params_set;
+    if (blob && blob->gen == dev->params_gen && blob->date == date &&
+        !strcmp(blob->data, params)) {
+        dev->params_set_skips++;
+        rv = dev->params_set_rv;
+        pthread_mutex_unlock(&dev->params_lock);
+        ALOGI("%s--- unchanged, rv %d", __FUNCTION__, rv);
+        return rv;
+    }
+    strcpy(str, params_exif_date(dev, date));
+    pthread_mutex_unlock(&dev->params_lock);
+
+    size_t length = strlen(params);
+    String8 params_str8(params, length);
     camParams.unflatten(params_str8);
+    if (str[0])
+        camParams.set(CameraParameters::KEY_EXIF_DATETIME, str);
 
 #ifdef DUMP_PARAMS
     camParams.dump();
 #endif
 
-    /* Add timestamp */
-    char str[20] = { 0 };
-    const time_t date = time(NULL) + 1;
-    if (strftime(str, sizeof(str), "%Y-%m-%d %H.%M.%S", localtime(&date)) > 0)
-        camParams.set(CameraParameters::KEY_EXIF_DATETIME, str);
-
     rv = gCameraHals[dev->cameraid]->setParameters(camParams);
+    gen = android_atomic_inc(&dev->params_gen) + 1;
 
 #ifdef DUMP_PARAMS
     camParams.dump();
 #endif
 
+    blob = rv == 0 ? param_blob_alloc(params, length) : NULL;
+    if (blob) {
+        blob->gen = gen;
+        blob->date = date;
+    }
+    pthread_mutex_lock(&dev->params_lock);
+    param_blob_put(dev->params_set);
+    dev->params_set = blob;
+    dev->params_set_rv = rv;
+    pthread_mutex_unlock(&dev->params_lock);
+
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
 }
 
-char* camera_get_parameters(struct camera_device * device)
+static param_blob_t *camera_build_parameters(priv_camera_device_t *dev)
 {
-    char* params = NULL;
-    priv_camera_device_t* dev = NULL;
     String8 params_str8;
     CameraParameters camParams;
 
-    ALOGI("%s+++: device %p", __FUNCTION__, device);
-
-    if(!device)
-        return NULL;
-
-    dev = (priv_camera_device_t*) device;
-
     camParams = gCameraHals[dev->cameraid]->getParameters();
 
 #ifdef DUMP_PARAMS
@@ -897,21 +1095,73 @@ char* camera_get_parameters(struct camera_device * device)
     camParams.set("orientation", "landscape");
 
     params_str8 = camParams.flatten();
-    params = (char*) malloc(sizeof(char) * (params_str8.length()+1));
-    strcpy(params, params_str8.string());
 
 #ifdef DUMP_PARAMS
     camParams.dump();
 #endif
 
+    return param_blob_alloc(params_str8.string(), params_str8.length());
+}
+
+char* camera_get_parameters(struct camera_device * device)
+{
+    priv_camera_device_t* dev = NULL;
+    param_blob_t *blob;
+    int32_t gen;
+
+    ALOGI("%s+++: device %p", __FUNCTION__, device);
+
+    if(!device)
+        return NULL;
+
+    dev = (priv_camera_device_t*) device;
+
+    pthread_mutex_lock(&dev->params_lock);
+    gen = dev->params_gen;
+    blob = dev->params_get;
+    if (blob && blob->gen == gen) {
+        blob->refs++;
+        dev->params_get_hits++;
+        pthread_mutex_unlock(&dev->params_lock);
+        ALOGI("%s--- cached", __FUNCTION__);
+        return blob->data;
+    }
+    dev->params_get_misses++;
+    pthread_mutex_unlock(&dev->params_lock);
+
+    /* Stamped with the generation read before the HAL was asked, so a
+     * change racing with the rebuild leaves the entry stale. */
+    blob = camera_build_parameters(dev);
+    if (!blob) {
+        ALOGE("%s: parameter string allocation fail", __FUNCTION__);
+        return NULL;
+    }
+    blob->gen = gen;
+    blob->refs = 2;
+
+    pthread_mutex_lock(&dev->params_lock);
+    param_blob_put(dev->params_get);
+    dev->params_get = blob;
+    pthread_mutex_unlock(&dev->params_lock);
+
     ALOGI("%s---", __FUNCTION__);
-    return params;
+    return blob->data;
 }
 
 static void camera_put_parameters(struct camera_device *device, char *parms)
 {
+    priv_camera_device_t* dev = NULL;
+
     ALOGI("%s+++", __FUNCTION__);
-    free(parms);
+
+    if(!device || !parms)
+        return;
+
+    dev = (priv_camera_device_t*) device;
+
+    pthread_mutex_lock(&dev->params_lock);
+    param_blob_put((param_blob_t *)(parms - offsetof(param_blob_t, data)));
+    pthread_mutex_unlock(&dev->params_lock);
     ALOGI("%s---", __FUNCTION__);
 }
 
@@ -930,6 +1180,7 @@ int camera_send_command(struct camera_device * device,
     dev = (priv_camera_device_t*) device;
 
     rv = gCameraHals[dev->cameraid]->sendCommand(cmd, arg1, arg2);
+    params_touch(dev);
 
     ALOGI("%s--- rv %d", __FUNCTION__,rv);
     return rv;
@@ -947,6 +1198,7 @@ void camera_release(struct camera_device * device)
     dev = (priv_camera_device_t*) device;
 
     gCameraHals[dev->cameraid]->release();
+    params_touch(dev);
     ALOGI("%s---", __FUNCTION__);
 }
 
@@ -988,6 +1240,16 @@ int camera_device_close(hw_device_t* device)
         gCameraHals[dev->cameraid] = NULL;
         gCamerasOpen--;
 
+        ALOGI("%s: parameter cache: %u hits, %u rebuilds, %u unchanged sets",
+              __FUNCTION__, dev->params_get_hits, dev->params_get_misses,
+              dev->params_set_skips);
+        /* strings still held by the framework keep their own reference */
+        pthread_mutex_lock(&dev->params_lock);
+        param_blob_put(dev->params_get);
+        param_blob_put(dev->params_set);
+        pthread_mutex_unlock(&dev->params_lock);
+        pthread_mutex_destroy(&dev->params_lock);
+
         if (dev->base.ops) {
             free(dev->base.ops);
         }
@@ -1093,6 +1355,7 @@ int camera_device_open(const hw_module_t* module, const char* name,
 
         memset(priv_camera_device, 0, sizeof(*priv_camera_device));
         memset(camera_ops, 0, sizeof(*camera_ops));
+        pthread_mutex_init(&priv_camera_device->params_lock, NULL);
 
         priv_camera_device->base.common.tag = HARDWARE_DEVICE_TAG;
         priv_camera_device->base.common.version = 0;
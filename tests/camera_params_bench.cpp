@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Device benchmark of the parameter cache in the camera_device wrapper.
+ * Opens the camera module the way the camera service does and times the
+ * get/put round trip the framework does for every parameter poll and a
+ * set of unchanged parameters, first with the cache defeated and then with
+ * it in use. Run it with the camera service stopped.
+ *
+ *   camera_params_bench [iterations] [camera id]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hardware/camera.h>
+#include <utils/String8.h>
+#include <utils/Timers.h>
+
+using namespace android;
+
+// A key the HAL does not know; changing it defeats the cache.
+#define BENCH_KEY "bench-pass"
+
+// Sets params with BENCH_KEY appended, so every pass gets its own string.
+static int set_tagged(camera_device_t *dev, const String8 &params, int tag)
+{
+    String8 str(params);
+    str.appendFormat(";" BENCH_KEY "=%d", tag);
+    return dev->ops->set_parameters(dev, str.string());
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    const char *id = argc > 2 ? argv[2] : "0";
+    const camera_module_t *module;
+    camera_device_t *dev;
+
+    if (iterations < 1)
+        iterations = 1;
+    if (hw_get_module(CAMERA_HARDWARE_MODULE_ID, (const hw_module_t **)&module) < 0) {
+        fprintf(stderr, "no camera module\n");
+        return 1;
+    }
+    if (module->common.methods->open(&module->common, id, (hw_device_t **)&dev) < 0) {
+        fprintf(stderr, "cannot open camera %s\n", id);
+        return 1;
+    }
+
+    char *params = dev->ops->get_parameters(dev);
+    if (params == NULL) {
+        fprintf(stderr, "no parameters\n");
+        dev->common.close(&dev->common);
+        return 1;
+    }
+    String8 current(params);
+    dev->ops->put_parameters(dev, params);
+
+    // [cached][get, set]
+    nsecs_t elapsed[2][2] = { { 0, 0 }, { 0, 0 } };
+    for (int i = 0; i < iterations; i++) {
+        // A set in between makes the next get rebuild; it is not timed.
+        set_tagged(dev, current, i);
+        nsecs_t start = systemTime();
+        params = dev->ops->get_parameters(dev);
+        dev->ops->put_parameters(dev, params);
+        elapsed[0][0] += systemTime() - start;
+    }
+    nsecs_t start = systemTime();
+    for (int i = 0; i < iterations; i++) {
+        params = dev->ops->get_parameters(dev);
+        dev->ops->put_parameters(dev, params);
+    }
+    elapsed[1][0] = systemTime() - start;
+
+    start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        set_tagged(dev, current, iterations + i);
+    elapsed[0][1] = systemTime() - start;
+    start = systemTime();
+    for (int i = 0; i < iterations; i++)
+        set_tagged(dev, current, 0);
+    elapsed[1][1] = systemTime() - start;
+
+    printf("%d x %d bytes: get %lld/%lld us, set %lld/%lld us (uncached/cached)\n",
+           iterations, (int)current.length(),
+           ns2us(elapsed[0][0]) / iterations, ns2us(elapsed[1][0]) / iterations,
+           ns2us(elapsed[0][1]) / iterations, ns2us(elapsed[1][1]) / iterations);
+
+    dev->common.close(&dev->common);
+    return 0;
+}
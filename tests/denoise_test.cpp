@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test and benchmark of the multi-frame denoise. Noisy copies of one
+ * textured 5MP scene, each moved by a few pixels, are merged into the
+ * last one. The merge must align them, which leaves the result closer to
+ * the clean scene than the reference frame was, and must keep a patch
+ * that moves on its own from ghosting. The merge rate is printed in MP/s.
+ *
+ *   denoise_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../ImageProcessing.h"
+
+using namespace android;
+
+#define WIDTH       2592
+#define HEIGHT      1944
+#define FRAMES      4
+#define NOISE       8           // peak to peak
+#define MARGIN      16          // the scene extends past every frame edge
+#define PATCH_X     1200
+#define PATCH_Y     900
+#define PATCH_SIZE  128
+
+static int failures;
+
+#define EXPECT(cond) do {                                           \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static uint32_t seed = 1;
+
+static int rnd(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static int64_t now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Mean absolute luma difference over the frame less a border.
+static double luma_error(const uint8_t *a, const uint8_t *b)
+{
+    uint64_t sum = 0;
+    int count = 0;
+    for (int y = MARGIN; y < HEIGHT - MARGIN; y++)
+        for (int x = MARGIN; x < WIDTH - MARGIN; x++, count++)
+            sum += abs(a[y * WIDTH + x] - b[y * WIDTH + x]);
+    return (double)sum / count;
+}
+
+int main()
+{
+    const int sceneW = WIDTH + 2 * MARGIN, sceneH = HEIGHT + 2 * MARGIN;
+    const int frameSize = WIDTH * HEIGHT * 3 / 2;
+
+    // Blurred noise: texture at every scale the motion search looks at.
+    uint8_t *scene = (uint8_t *)malloc(sceneW * sceneH);
+    uint8_t *tmp = (uint8_t *)malloc(sceneW * sceneH);
+    for (int i = 0; i < sceneW * sceneH; i++)
+        tmp[i] = rnd(256);
+    for (int y = 0; y < sceneH; y++) {
+        for (int x = 0; x < sceneW; x++) {
+            int sum = 0, n = 0;
+            for (int dy = -2; dy <= 2; dy++)
+                for (int dx = -2; dx <= 2; dx++)
+                    if (x + dx >= 0 && x + dx < sceneW && y + dy >= 0 && y + dy < sceneH) {
+                        sum += tmp[(y + dy) * sceneW + x + dx];
+                        n++;
+                    }
+            scene[y * sceneW + x] = 64 + (sum / n - 128) * 2 / 3 + 64;
+        }
+    }
+    free(tmp);
+
+    // Frame i sees the scene moved by (FRAMES - 1 - i) * (3, -2) pixels,
+    // the reference none, and the patch moved 13 times as far across.
+    uint8_t *buf = (uint8_t *)malloc(frameSize * FRAMES);
+    uint8_t *clean = (uint8_t *)malloc(WIDTH * HEIGHT);
+    fusion_job frames;
+    frames.numFrames = FRAMES;
+    frames.width = WIDTH;
+    frames.yOffset = 0;
+    frames.cbcrOffset = WIDTH * HEIGHT;
+    for (int i = 0; i < FRAMES; i++) {
+        uint8_t *f = buf + i * frameSize;
+        int mx = (FRAMES - 1 - i) * 3, my = -(FRAMES - 1 - i) * 2;
+        for (int y = 0; y < HEIGHT; y++) {
+            for (int x = 0; x < WIDTH; x++) {
+                int v = scene[(y + MARGIN + my) * sceneW + x + MARGIN + mx];
+                bool patch = x >= PATCH_X + mx * 13 && x < PATCH_X + mx * 13 + PATCH_SIZE &&
+                             y >= PATCH_Y && y < PATCH_Y + PATCH_SIZE;
+                if (patch)
+                    v = 240;
+                if (i == FRAMES - 1)
+                    clean[y * WIDTH + x] = v;
+                f[y * WIDTH + x] = v + rnd(NOISE + 1) - NOISE / 2;
+            }
+        }
+        memset(f + WIDTH * HEIGHT, 128, frameSize - WIDTH * HEIGHT);
+        frames.src[i] = f;
+    }
+    frames.dst = buf + (FRAMES - 1) * frameSize;
+
+    double before = luma_error(frames.dst, clean);
+    int64_t start = now_us();
+    int scratch = denoise_frames(&frames, HEIGHT, HAL_WORKER_THREADS);
+    int64_t elapsed = now_us() - start;
+    double after = luma_error(frames.dst, clean);
+
+    printf("%d frames %dx%d in %lld ms, %.1f MP/s, scratch %d KB\n",
+           FRAMES, WIDTH, HEIGHT, (long long)elapsed / 1000,
+           elapsed > 0 ? (double)FRAMES * WIDTH * HEIGHT / elapsed : 0.0,
+           scratch / 1024);
+    printf("mean luma error %.2f before, %.2f after\n", before, after);
+    // Averaging 4 aligned frames halves the noise.
+    EXPECT(after < before * 0.75);
+
+    // The patch holds no trace of where it was in the other frames.
+    int ghost = 0;
+    for (int y = PATCH_Y; y < PATCH_Y + PATCH_SIZE; y++)
+        for (int x = PATCH_X + PATCH_SIZE + 8; x < PATCH_X + PATCH_SIZE + 100; x++)
+            if (abs(frames.dst[y * WIDTH + x] - clean[y * WIDTH + x]) > 3 * NOISE)
+                ghost++;
+    printf("%d ghost pixels next to the moving patch\n", ghost);
+    EXPECT(ghost < PATCH_SIZE);
+
+    free(clean);
+    free(buf);
+    free(scene);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test of the software face detection against a real OpenCV cascade.
+ * The XML is read again here and every window is evaluated the way
+ * OpenCV runs its original Haar cascades: rectangle sums straight from
+ * the pixels, divided by the area and scaled by the standard deviation of
+ * the window less its one pixel border. The converted cascade must pass
+ * the same number of stages on noise, gradients and drawn faces.
+ *
+ *   face_cascade_convert haarcascade_frontalface_alt.xml face_cascade.bin
+ *   face_cascade_test haarcascade_frontalface_alt.xml face_cascade.bin
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../FaceDetector.h"
+
+using namespace android;
+
+#define MAX_STAGES      64
+#define MAX_NODES       4096
+#define WINDOWS         3000
+#define STAGE_BIAS      0.0001
+
+static int failures;
+
+#define EXPECT(cond) do {                                           \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+struct ref_node {
+    int numRects;
+    int rect[3][4];
+    double weight[3];
+    double threshold, left, right;
+};
+
+struct ref_cascade {
+    int winW, winH;
+    int numStages;
+    int stageEnd[MAX_STAGES];   // one past the last node of each stage
+    double stageThreshold[MAX_STAGES];
+    int numNodes;
+    ref_node nodes[MAX_NODES];
+};
+
+static char *read_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = (char *)malloc(size + 1);
+    if (data != NULL && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (data != NULL)
+        data[size] = '\0';
+    return data;
+}
+
+// The text after <tag> at or after p, or NULL.
+static const char *after(const char *p, const char *tag)
+{
+    p = strstr(p, tag);
+    return p != NULL ? p + strlen(tag) : NULL;
+}
+
+// Walks the stump trees in document order: each <rects> opens a node and
+// each <stage_threshold> closes the stage holding the nodes before it.
+static bool ref_load(const char *path, ref_cascade *c)
+{
+    char *xml = read_file(path);
+    if (xml == NULL)
+        return false;
+    memset(c, 0, sizeof(*c));
+    const char *p = after(xml, "<size>");
+    bool ok = p != NULL && sscanf(p, "%d %d", &c->winW, &c->winH) == 2;
+    while (ok) {
+        const char *rects = after(p, "<rects>");
+        const char *stage = after(p, "<stage_threshold>");
+        if (stage == NULL)
+            break;
+        if (rects != NULL && rects < stage) {
+            ok = c->numNodes < MAX_NODES;
+            if (!ok)
+                break;
+            ref_node *n = &c->nodes[c->numNodes++];
+            const char *end = strstr(rects, "</rects>");
+            const char *r = rects;
+            while ((r = after(r, "<_>")) != NULL && r < end && n->numRects < 3) {
+                int *rc = n->rect[n->numRects];
+                ok = ok && sscanf(r, "%d %d %d %d %lf", &rc[0], &rc[1], &rc[2],
+                                  &rc[3], &n->weight[n->numRects]) == 5;
+                n->numRects++;
+            }
+            p = after(end, "<threshold>");
+            ok = ok && p != NULL;
+            if (!ok)
+                break;
+            n->threshold = strtod(p, NULL);
+            p = after(p, "<left_val>");
+            ok = p != NULL;
+            if (!ok)
+                break;
+            n->left = strtod(p, NULL);
+            p = after(p, "<right_val>");
+            ok = p != NULL;
+            if (!ok)
+                break;
+            n->right = strtod(p, NULL);
+        } else {
+            ok = c->numStages < MAX_STAGES;
+            if (!ok)
+                break;
+            c->stageThreshold[c->numStages] = strtod(stage, NULL);
+            c->stageEnd[c->numStages++] = c->numNodes;
+            p = stage;
+        }
+    }
+    free(xml);
+    return ok && c->numStages > 0;
+}
+
+static double pixel_sum(const uint8_t *win, int stride, const int *r, bool squared)
+{
+    double sum = 0;
+    for (int y = r[1]; y < r[1] + r[3]; y++)
+        for (int x = r[0]; x < r[0] + r[2]; x++)
+            sum += squared ? win[y * stride + x] * win[y * stride + x]
+                           : win[y * stride + x];
+    return sum;
+}
+
+// cvRunHaarClassifierCascade at scale 1 for the window at win.
+static int ref_stages(const ref_cascade *c, const uint8_t *win, int stride)
+{
+    int inset[4] = { 1, 1, c->winW - 2, c->winH - 2 };
+    double invArea = 1.0 / (inset[2] * inset[3]);
+    double mean = pixel_sum(win, stride, inset, false) * invArea;
+    double var = pixel_sum(win, stride, inset, true) * invArea - mean * mean;
+    double sd = var >= 0 ? sqrt(var) : 1.0;
+
+    int node = 0;
+    for (int i = 0; i < c->numStages; i++) {
+        double stageSum = 0;
+        for (; node < c->stageEnd[i]; node++) {
+            const ref_node *n = &c->nodes[node];
+            // The first weight balances the others, as OpenCV sets it.
+            double rest = 0;
+            for (int r = 1; r < n->numRects; r++)
+                rest += n->weight[r] * n->rect[r][2] * n->rect[r][3];
+            double sum = -rest / (n->rect[0][2] * n->rect[0][3]) *
+                         pixel_sum(win, stride, n->rect[0], false);
+            for (int r = 1; r < n->numRects; r++)
+                sum += n->weight[r] * pixel_sum(win, stride, n->rect[r], false);
+            stageSum += sum * invArea < n->threshold * sd ? n->left : n->right;
+        }
+        if (stageSum < c->stageThreshold[i] - STAGE_BIAS)
+            return i;
+    }
+    return c->numStages;
+}
+
+static uint32_t seed = 1;
+
+static int rnd(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static uint8_t clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Draws one test window: noise, a gradient, or a face of an oval with
+// dark eyes, brows and mouth, at a random exposure and contrast.
+static void draw_window(uint8_t *win, int w, int h, int kind)
+{
+    int base = 40 + rnd(160), contrast = 20 + rnd(80);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int v;
+            if (kind == 0) {
+                v = rnd(256);
+            } else if (kind == 1) {
+                v = base + (x * (rnd(3) - 1) + y * (rnd(3) - 1)) * contrast / w;
+            } else {
+                // Coordinates in 1/100 of the window from its centre.
+                int cx = (x * 100 + 50) / w - 50, cy = (y * 100 + 50) / h - 50;
+                bool skin = cx * cx * 100 / (40 * 40) + cy * cy * 100 / (48 * 48) < 100;
+                bool eye = cy > -22 && cy < -8 && abs(abs(cx) - 18) < 9;
+                bool brow = cy > -30 && cy < -24 && abs(abs(cx) - 18) < 11;
+                bool mouth = cy > 18 && cy < 26 && abs(cx) < 14;
+                bool nose = cy > -4 && cy < 10 && abs(cx) < 4;
+                v = !skin ? base - contrast : eye || brow || mouth ? base - contrast / 2 :
+                    nose ? base + contrast / 4 : base + contrast / 2;
+                v += rnd(9) - 4;
+            }
+            win[y * w + x] = clamp(v);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <cascade.xml> <face_cascade.bin>\n", argv[0]);
+        return 2;
+    }
+    static ref_cascade ref;
+    EXPECT(ref_load(argv[1], &ref));
+    face_cascade *c = face_cascade_load(argv[2]);
+    EXPECT(c != NULL);
+    if (failures)
+        return 1;
+    printf("%s: %dx%d window, %d stages, %d features\n", argv[1],
+           ref.winW, ref.winH, ref.numStages, ref.numNodes);
+
+    int w = ref.winW, h = ref.winH;
+    uint8_t *win = (uint8_t *)malloc(w * h);
+    int mismatches = 0, deep = 0;
+    int reached[MAX_STAGES + 1];
+    memset(reached, 0, sizeof(reached));
+    for (int i = 0; i < WINDOWS; i++) {
+        draw_window(win, w, h, i % 3);
+        int want = ref_stages(&ref, win, w);
+        int got = face_window_stages(c, win, w);
+        reached[want]++;
+        if (want >= 2)
+            deep++;
+        if (got != want) {
+            if (mismatches < 10)
+                fprintf(stderr, "window %d: %d stages, OpenCV passes %d\n",
+                        i, got, want);
+            mismatches++;
+        }
+    }
+    for (int i = 0; i <= ref.numStages; i++)
+        if (reached[i])
+            printf("%d windows pass %d stages\n", reached[i], i);
+
+    // Float sums may land on the other side of a threshold now and then;
+    // a normalisation that differs from OpenCV's moves most windows.
+    EXPECT(mismatches <= WINDOWS / 100);
+    // Windows must get past the first stages to test anything.
+    EXPECT(deep >= WINDOWS / 20);
+    printf("%d of %d windows differ\n", mismatches, WINDOWS);
+
+    free(win);
+    face_cascade_free(c);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test of the software face detection. A three stage cascade that
+ * accepts a dark band above a bright one narrower than the window,
+ * balanced left to right, is written in the face cascade layout and run
+ * the way face_thread does on a VGA preview luma holding one such pattern
+ * at a known place.
+ *
+ *   face_detect_test [scratch directory]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../FaceDetector.h"
+
+using namespace android;
+
+#define PREVIEW_W   640
+#define PREVIEW_H   480
+#define FACE_X      240
+#define FACE_Y      160
+#define FACE_SIZE   160
+#define MAX_FACES   5
+
+static int failures;
+
+#define EXPECT(cond) do {                                           \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static uint32_t float_bits(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+struct weak_def {
+    int numRects;
+    int rect[3][4];             // x, y, w, h
+    float weight[3];
+    float threshold, left, right;
+};
+
+static void put_weak(FILE *f, const weak_def *w)
+{
+    uint32_t words[19];
+    memset(words, 0, sizeof(words));
+    words[0] = w->numRects;
+    for (int r = 0; r < w->numRects; r++) {
+        for (int k = 0; k < 4; k++)
+            words[1 + 5 * r + k] = w->rect[r][k];
+        words[1 + 5 * r + 4] = float_bits(w->weight[r]);
+    }
+    words[16] = float_bits(w->threshold);
+    words[17] = float_bits(w->left);
+    words[18] = float_bits(w->right);
+    fwrite(words, sizeof(words), 1, f);
+}
+
+static bool write_cascade(const char *path)
+{
+    // Stage 1: the top half is darker than the bottom half.
+    static const weak_def bands = {
+        2, { { 0, 0, 20, 10 }, { 0, 10, 20, 10 } }, { 1, -1 },
+        -0.25f, 1.0f, -1.0f
+    };
+    // Stage 2: neither side half is much darker than the other.
+    static const weak_def leftDark = {
+        2, { { 0, 0, 10, 20 }, { 10, 0, 10, 20 } }, { 1, -1 },
+        -0.2f, -1.0f, 1.0f
+    };
+    static const weak_def rightDark = {
+        2, { { 10, 0, 10, 20 }, { 0, 0, 10, 20 } }, { 1, -1 },
+        -0.2f, -1.0f, 1.0f
+    };
+    // Stage 3: the side columns are darker than the middle ones.
+    static const weak_def sides = {
+        3, { { 0, 0, 4, 20 }, { 16, 0, 4, 20 }, { 4, 0, 12, 20 } },
+        { 1, 1, -2.0f / 3 }, -0.1f, 1.0f, -1.0f
+    };
+    uint32_t header[] = {
+        FACE_CASCADE_MAGIC, FACE_CASCADE_VERSION, 20, 20, 3
+    };
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL)
+        return false;
+    fwrite(header, sizeof(header), 1, f);
+    uint32_t stage1[] = { 1, float_bits(0.5f) };
+    fwrite(stage1, sizeof(stage1), 1, f);
+    put_weak(f, &bands);
+    uint32_t stage2[] = { 2, float_bits(1.5f) };
+    fwrite(stage2, sizeof(stage2), 1, f);
+    put_weak(f, &leftDark);
+    put_weak(f, &rightDark);
+    uint32_t stage3[] = { 1, float_bits(0.5f) };
+    fwrite(stage3, sizeof(stage3), 1, f);
+    put_weak(f, &sides);
+    return fclose(f) == 0;
+}
+
+// Runs the detector on a preview luma plane as face_thread does, and
+// returns the faces in preview pixels.
+static int detect(const face_cascade *c, const uint8_t *luma, int *faces,
+                  int *scores)
+{
+    int bw = PREVIEW_W / 4, bh = PREVIEW_H / 4;
+    uint8_t *rows = (uint8_t *)malloc(PREVIEW_W * bh * 2);
+    uint8_t *work = (uint8_t *)malloc(bw * bh + face_scratch_size(bw, bh));
+    for (int r = 0; r < bh; r++) {
+        memcpy(rows + 2 * r * PREVIEW_W, luma + (4 * r + 1) * PREVIEW_W, PREVIEW_W);
+        memcpy(rows + (2 * r + 1) * PREVIEW_W, luma + (4 * r + 2) * PREVIEW_W, PREVIEW_W);
+    }
+    face_downscale_base(rows, PREVIEW_W, bw, bh, work);
+    int n = face_detect(c, work, bw, bh, work + bw * bh, faces, scores,
+                        MAX_FACES);
+    for (int i = 0; i < n * 4; i++)
+        faces[i] *= 4;
+    free(work);
+    free(rows);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    char path[256];
+    int faces[MAX_FACES * 4];
+    int scores[MAX_FACES];
+
+    snprintf(path, sizeof(path), "%s/face_detect_test.bin",
+             argc > 1 ? argv[1] : "/tmp");
+    EXPECT(write_cascade(path));
+    face_cascade *c = face_cascade_load(path);
+    EXPECT(c != NULL);
+    if (c == NULL)
+        return 1;
+
+    // A noisy background gives no faces.
+    uint8_t *luma = (uint8_t *)malloc(PREVIEW_W * PREVIEW_H);
+    uint32_t seed = 1;
+    for (int i = 0; i < PREVIEW_W * PREVIEW_H; i++) {
+        seed = seed * 1103515245 + 12345;
+        luma[i] = seed >> 24;
+    }
+    EXPECT(detect(c, luma, faces, scores) == 0);
+
+    // The pattern is a dark band over a bright one with dark sides.
+
+    for (int y = 0; y < FACE_SIZE; y++) {
+        uint8_t *row = luma + (FACE_Y + y) * PREVIEW_W + FACE_X;
+        if (y < FACE_SIZE / 2)
+            memset(row, 100, FACE_SIZE);
+        else {
+            memset(row, 60, FACE_SIZE);
+            memset(row + FACE_SIZE / 5, 220, FACE_SIZE * 3 / 5);
+        }
+    }
+    // Smaller windows inside the pattern may match as well, so the best
+    // supported face must be the pattern and every face must lie on it.
+    int n = detect(c, luma, faces, scores);
+    EXPECT(n >= 1);
+    for (int i = 0; i < n; i++) {
+        int *f = faces + 4 * i;
+        printf("face at %d,%d %dx%d, score %d\n", f[0], f[1], f[2], f[3],
+               scores[i]);
+        EXPECT(scores[i] >= 1 && scores[i] <= 100);
+        EXPECT(i == 0 || scores[i] <= scores[i - 1]);
+        EXPECT(f[0] + f[2] / 2 > FACE_X && f[0] + f[2] / 2 < FACE_X + FACE_SIZE);
+        EXPECT(f[1] + f[3] / 2 > FACE_Y && f[1] + f[3] / 2 < FACE_Y + FACE_SIZE);
+    }
+    if (n >= 1) {
+        EXPECT(abs(faces[0] + faces[2] / 2 - (FACE_X + FACE_SIZE / 2)) <= FACE_SIZE / 10);
+        EXPECT(abs(faces[1] + faces[3] / 2 - (FACE_Y + FACE_SIZE / 2)) <= FACE_SIZE / 10);
+        EXPECT(abs(faces[2] - FACE_SIZE) <= FACE_SIZE / 4);
+    }
+    face_cascade_free(c);
+
+    // A file that is not a cascade is refused.
+    FILE *f = fopen(path, "wb");
+    if (f != NULL) {
+        fwrite(luma, 1, 4096, f);
+        fclose(f);
+    }
+    EXPECT(face_cascade_load(path) == NULL);
+    remove(path);
+    free(luma);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test and benchmark of the MIPI10 unpack. Random frames of several
+ * widths, with and without a partial last group and row padding, must
+ * match a pixel at a time reference. A 5MP frame is then timed on every
+ * thread count and the rate printed in MP/s.
+ *
+ *   raw_unpack_test
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../ImageProcessing.h"
+
+using namespace android;
+
+#define BLACK   64
+#define RUNS    5
+
+static int failures;
+
+#define EXPECT(cond) do {                                           \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static uint32_t seed = 1;
+
+static int rnd(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static int64_t now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Pixel x of a row rowBytes long; low bits past the row end read as 0.
+static uint16_t ref_pixel(const uint8_t *row, int rowBytes, int x)
+{
+    int group = (x / 4) * 5, i = x % 4;
+    int low = group + 4 < rowBytes ? row[group + 4] : 0;
+    int v = (row[group + i] << 2) | ((low >> (2 * i)) & 3);
+    return v > BLACK ? v - BLACK : 0;
+}
+
+static void check_width(int width, int padding)
+{
+    const int height = 6;
+    const int stride = (width * 10 + 7) / 8 + padding;
+    uint8_t *src = (uint8_t *)malloc(stride * height);
+    uint16_t *dst = (uint16_t *)malloc(width * height * sizeof(uint16_t));
+    for (int i = 0; i < stride * height; i++)
+        src[i] = rnd(256);
+    memset(dst, 0xff, width * height * sizeof(uint16_t));
+
+    unpack_mipi10(src, dst, stride, width, height, BLACK, HAL_WORKER_THREADS);
+    int errors = 0;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            if (dst[y * width + x] != ref_pixel(src + y * stride, stride, x)) {
+                if (errors++ == 0)
+                    fprintf(stderr, "width %d stride %d: pixel (%d, %d) is %d, want %d\n",
+                            width, stride, x, y, dst[y * width + x],
+                            ref_pixel(src + y * stride, stride, x));
+            }
+    EXPECT(errors == 0);
+    free(src);
+    free(dst);
+}
+
+int main()
+{
+    static const int widths[] = { 1, 2, 3, 4, 7, 8, 13, 16, 33, 2590, 2592, 2593 };
+    for (unsigned i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        check_width(widths[i], 0);
+        check_width(widths[i], 3);
+    }
+
+    const int width = 2592, height = 1944;
+    const int stride = width * 5 / 4;
+    uint8_t *src = (uint8_t *)malloc(stride * height);
+    uint16_t *dst = (uint16_t *)malloc(width * height * sizeof(uint16_t));
+    for (int i = 0; i < stride * height; i++)
+        src[i] = (uint8_t)(i * 131 + (i >> 7));
+    for (int threads = 1; threads <= HAL_WORKER_THREADS; threads++) {
+        int64_t start = now_us();
+        for (int r = 0; r < RUNS; r++)
+            unpack_mipi10(src, dst, stride, width, height, BLACK, threads);
+        int64_t elapsed = (now_us() - start) / RUNS;
+        printf("%dx%d, %d thread(s): %lld us/frame, %.1f MP/s\n",
+               width, height, threads, (long long)elapsed,
+               elapsed > 0 ? (double)width * height / elapsed : 0.0);
+    }
+    free(src);
+    free(dst);
+
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test and benchmark of the AF sharpness metric. The Tenengrad sum
+ * must match a direct Sobel evaluation on odd window sizes, fall with
+ * every step of defocus, and rank a sharp ROI above a blurred one of the
+ * same frame. The full frame and the default centre ROI of a 720p preview
+ * are then timed.
+ *
+ *   sharpness_test [rounds]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../ImageProcessing.h"
+
+using namespace android;
+
+#define WIDTH   1280
+#define HEIGHT  720
+#define BLURS   4
+
+static int failures;
+
+#define EXPECT(cond) do {                                           \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                             \
+        }                                                           \
+    } while (0)
+
+static uint32_t seed = 1;
+
+static int rnd(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static int64_t now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static uint64_t ref_tenengrad(const uint8_t *p, int stride, int x0, int y0,
+                              int width, int height)
+{
+    uint64_t sum = 0;
+    for (int y = y0; y < y0 + height; y++) {
+        for (int x = x0; x < x0 + width; x++) {
+            int gx = 0, gy = 0;
+            for (int k = -1; k <= 1; k++) {
+                int w = k == 0 ? 2 : 1;
+                gx += w * (p[(y + k) * stride + x + 1] - p[(y + k) * stride + x - 1]);
+                gy += w * (p[(y + 1) * stride + x + k] - p[(y - 1) * stride + x + k]);
+            }
+            sum += gx * gx + gy * gy;
+        }
+    }
+    return sum;
+}
+
+// Box blur of radius r over rows [y0, y1), edges clamped.
+static void box_blur(const uint8_t *src, uint8_t *dst, int r, int y0, int y1)
+{
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            int sum = 0, n = 0;
+            for (int dy = -r; dy <= r; dy++) {
+                int sy = y + dy < 0 ? 0 : y + dy >= HEIGHT ? HEIGHT - 1 : y + dy;
+                for (int dx = -r; dx <= r; dx++) {
+                    int sx = x + dx < 0 ? 0 : x + dx >= WIDTH ? WIDTH - 1 : x + dx;
+                    sum += src[sy * WIDTH + sx];
+                    n++;
+                }
+            }
+            dst[y * WIDTH + x] = (sum + n / 2) / n;
+        }
+    }
+}
+
+// Per pixel sharpness of the centre ROI the HAL uses without a touch.
+static uint64_t centre(const uint8_t *luma)
+{
+    int dx = WIDTH / 2, dy = HEIGHT / 2;
+    return tenengrad_sum(luma + ((HEIGHT - dy) / 2) * WIDTH + (WIDTH - dx) / 2,
+                         WIDTH, dx, dy) / ((uint64_t)dx * dy);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    if (rounds < 1)
+        rounds = 1;
+
+    // A scene of random blocks: edges at every position and direction.
+    uint8_t *scene = (uint8_t *)malloc(WIDTH * HEIGHT);
+    uint8_t *blurred = (uint8_t *)malloc(WIDTH * HEIGHT);
+    for (int by = 0; by < HEIGHT; by += 8)
+        for (int bx = 0; bx < WIDTH; bx += 8) {
+            int v = rnd(256);
+            for (int y = by; y < by + 8 && y < HEIGHT; y++)
+                memset(scene + y * WIDTH + bx, v, 8);
+        }
+
+    // Odd sizes and offsets cover every tail of the vector loop.
+    for (int i = 0; i < 200; i++) {
+        int w = 1 + rnd(40), h = 1 + rnd(6);
+        int x = 1 + rnd(WIDTH - w - 2), y = 1 + rnd(HEIGHT - h - 2);
+        EXPECT(tenengrad_sum(scene + y * WIDTH + x, WIDTH, w, h) ==
+               ref_tenengrad(scene, WIDTH, x, y, w, h));
+    }
+
+    uint64_t prev = centre(scene);
+    printf("defocus 0: %llu\n", (unsigned long long)prev);
+    for (int r = 1; r < BLURS; r++) {
+        box_blur(scene, blurred, r, 0, HEIGHT);
+        uint64_t value = centre(blurred);
+        printf("defocus %d: %llu\n", r, (unsigned long long)value);
+        EXPECT(value < prev);
+        prev = value;
+    }
+
+    // Top half in focus, bottom half not: a touch on either half must
+    // score its own half.
+    memcpy(blurred, scene, WIDTH * HEIGHT / 2);
+    box_blur(scene, blurred, 2, HEIGHT / 2, HEIGHT);
+    uint64_t top = tenengrad_sum(blurred + (HEIGHT / 8) * WIDTH + WIDTH / 4,
+                                 WIDTH, 100, 100);
+    uint64_t bottom = tenengrad_sum(blurred + (HEIGHT * 5 / 8) * WIDTH + WIDTH / 4,
+                                    WIDTH, 100, 100);
+    EXPECT(top > 2 * bottom);
+
+    uint64_t check = 0;
+    int64_t start = now_us();
+    for (int i = 0; i < rounds; i++)
+        check += tenengrad_sum(scene + WIDTH + 1, WIDTH, WIDTH - 2, HEIGHT - 2);
+    int64_t full = now_us() - start;
+    start = now_us();
+    for (int i = 0; i < rounds; i++)
+        check += centre(scene);
+    int64_t roi = now_us() - start;
+    printf("%dx%d full frame %lld us, centre ROI %lld us per frame over %d rounds (%llu)\n",
+           WIDTH, HEIGHT, (long long)full / rounds, (long long)roi / rounds, rounds,
+           (unsigned long long)check);
+
+    free(blurred);
+    free(scene);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+    return failures ? 1 : 0;
+}
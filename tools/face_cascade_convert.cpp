@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Converts an OpenCV Haar cascade in the original XML layout (the
+ * haarcascade_frontalface_*.xml files: <size>, then <stages> of <trees>
+ * whose nodes hold <feature><rects>, <threshold>, <left_val> and
+ * <right_val>) into the face cascade file read by FaceDetector.cpp.
+ * Only stump trees with upright features are supported, which covers the
+ * frontal face cascades.
+ *
+ *   face_cascade_convert <cascade.xml> <face_cascade.bin>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../FaceDetector.h"
+
+#define MAX_WORDS (1 << 20)
+
+static uint32_t words[MAX_WORDS];
+static int numWords;
+
+static void put(uint32_t word)
+{
+    if (numWords == MAX_WORDS) {
+        fprintf(stderr, "cascade too large\n");
+        exit(1);
+    }
+    words[numWords++] = word;
+}
+
+static uint32_t float_bits(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static char *read_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = (char *)malloc(size + 1);
+    if (data != NULL && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (data != NULL)
+        data[size] = '\0';
+    return data;
+}
+
+static int fail(const char *msg)
+{
+    fprintf(stderr, "face_cascade_convert: %s\n", msg);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <cascade.xml> <face_cascade.bin>\n", argv[0]);
+        return 2;
+    }
+    char *xml = read_file(argv[1]);
+    if (xml == NULL)
+        return fail("cannot read the cascade");
+
+    int stageCountPos = -1, stageWordPos = -1, numStages = 0;
+    int weakPos = -1, numRects = 0, stageWeak = 0;
+    bool haveSize = false, inRects = false;
+    const char *text = NULL;
+
+    put(FACE_CASCADE_MAGIC);
+    put(FACE_CASCADE_VERSION);
+    put(0);                                     // window width
+    put(0);                                     // window height
+    stageCountPos = numWords;
+    put(0);
+
+    // Each tag is handled on its own; the content of the last opening tag
+    // is the text up to the next '<'.
+    for (char *p = strchr(xml, '<'); p != NULL; p = strchr(p + 1, '<')) {
+        if (!strncmp(p, "<!--", 4)) {
+            char *end = strstr(p, "-->");
+            if (end == NULL)
+                return fail("unterminated comment");
+            p = end;
+            continue;
+        }
+        char *end = strchr(p, '>');
+        if (end == NULL)
+            return fail("unterminated tag");
+        bool closing = p[1] == '/';
+        const char *name = p + (closing ? 2 : 1);
+        size_t len = strcspn(name, " />");
+#define IS(tag) (len == sizeof(tag) - 1 && !strncmp(name, tag, len))
+        if (!closing) {
+            text = end + 1;
+            if (IS("cascade"))
+                return fail("the new OpenCV cascade layout is not supported");
+            if (IS("left_node") || IS("right_node"))
+                return fail("only stump trees are supported");
+            if (IS("trees")) {
+                stageWordPos = numWords;
+                put(0);                         // weak classifier count
+                put(0);                         // stage threshold
+                stageWeak = 0;
+            } else if (IS("rects")) {
+                if (stageWordPos < 0)
+                    return fail("feature outside a stage");
+                weakPos = numWords;
+                for (int i = 0; i < 19; i++)
+                    put(0);
+                numRects = 0;
+                inRects = true;
+                stageWeak++;
+            }
+            p = end;
+            continue;
+        }
+
+        if (IS("rects")) {
+            inRects = false;
+            if (numRects < 1)
+                return fail("feature without rectangles");
+            words[weakPos] = numRects;
+        } else if (IS("_") && inRects) {
+            int x, y, w, h;
+            float weight;
+            if (sscanf(text, "%d %d %d %d %f", &x, &y, &w, &h, &weight) != 5)
+                return fail("malformed rectangle");
+            if (numRects == 3)
+                return fail("more than 3 rectangles in a feature");
+            uint32_t *r = &words[weakPos + 1 + 5 * numRects++];
+            r[0] = x;
+            r[1] = y;
+            r[2] = w;
+            r[3] = h;
+            r[4] = float_bits(weight);
+        } else if (IS("tilted")) {
+            if (atoi(text) != 0)
+                return fail("tilted features are not supported");
+        } else if (IS("threshold") || IS("left_val") || IS("right_val")) {
+            if (weakPos < 0)
+                return fail("node value outside a feature");
+            int slot = IS("threshold") ? 16 : IS("left_val") ? 17 : 18;
+            words[weakPos + slot] = float_bits(strtof(text, NULL));
+        } else if (IS("stage_threshold")) {
+            if (stageWordPos < 0)
+                return fail("stage threshold outside a stage");
+            words[stageWordPos] = stageWeak;
+            words[stageWordPos + 1] = float_bits(strtof(text, NULL));
+            stageWordPos = -1;
+            weakPos = -1;
+            numStages++;
+        } else if (IS("size") && !haveSize) {
+            int w, h;
+            if (sscanf(text, "%d %d", &w, &h) != 2)
+                return fail("malformed window size");
+            words[2] = w;
+            words[3] = h;
+            haveSize = true;
+        }
+#undef IS
+        p = end;
+    }
+    free(xml);
+
+    if (!haveSize || numStages == 0)
+        return fail("no Haar cascade found");
+    words[stageCountPos] = numStages;
+
+    FILE *out = fopen(argv[2], "wb");
+    if (out == NULL)
+        return fail("cannot create the output file");
+    // The format is little-endian, as are the hosts this runs on.
+    bool ok = fwrite(words, sizeof(uint32_t), numWords, out) == (size_t)numWords;
+    ok = fclose(out) == 0 && ok;
+    if (!ok)
+        return fail("cannot write the output file");
+    printf("%s: %dx%d window, %d stages\n", argv[2], words[2], words[3], numStages);
+    return 0;
+}